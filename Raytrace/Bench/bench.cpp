@@ -0,0 +1,822 @@
+// ray_bench: renders scenes in-process and reports how long every phase
+// takes. Run it from the build directory, like ray, as the scene files
+// refer to their meshes relative to it.
+
+#include "image.h"
+#include "imagewriter.h"
+#include "objloader.h"
+#include "raytracer.h"
+#include "stats.h"
+#include "texture.h"
+#include "shapes/cone.h"
+#include "shapes/cylinder.h"
+#include "shapes/sphere.h"
+
+#include "json/json.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace
+{
+    // Differences below this many seconds are never reported as a
+    // regression, they are within the noise of the timer and scheduler
+    double const MIN_DELTA = 0.001;
+
+    char const *const PHASES[] = { "parse", "build", "render", "encode" };
+    unsigned const NUM_PHASES = 4;
+
+    char const *const OBJ_PHASES[] = { "parse" };
+
+    // Same for the shape kernels, in nanoseconds per call
+    double const MIN_DELTA_NS = 1.0;
+
+    char const *const SHAPE_PHASES[] = { "ns" };
+
+    // Rays traced per pass over a shape, and passes per run
+    unsigned const SHAPE_RAYS = 4096;
+    unsigned const SHAPE_PASSES = 256;
+
+    struct Options
+    {
+        unsigned runs = 3;
+        int threads = -1;           // -1: use the value of the scene file
+        int packetSize = -1;
+        string format = "json";
+        string output;              // empty: standard output
+        string baseline;            // compare mode when not empty
+        double tolerance = 0.10;
+        string sceneDir = "../Scenes";
+        bool obj = false;           // time the OBJ parser instead
+        bool texture = false;       // simulate the texture cache behaviour
+        bool shapes = false;        // time the intersection kernels instead
+        ImageWriter::Format imageFormat = ImageWriter::Format::PNG;
+        unsigned compression = 6;   // of PNG images
+        string meshCache = MeshCache::defaultDirectory();
+        vector<string> scenes;
+    };
+
+    struct Result
+    {
+        string scene;
+        double seconds[NUM_PHASES]; // median over the runs
+        double renderMin;           // fastest render
+        RenderStats stats;          // of the last run
+    };
+
+    struct ObjResult
+    {
+        string mesh;
+        size_t bytes;
+        double seconds;             // median over the runs
+        double secondsMin;
+    };
+
+    struct TextureResult
+    {
+        string scene;
+        string filter;
+        unsigned long reads;        // texels read by one render
+        unsigned long missesRows;   // simulated misses, row-major layout
+        unsigned long missesTiles;  // simulated misses, tiled layout
+        double seconds;             // median render time over the runs
+        double secondsMin;
+    };
+
+    struct ShapeResult
+    {
+        string kernel;              // shape.operation
+        unsigned long calls;        // per run
+        unsigned long hits;         // calls which hit the shape, per run
+        double ns;                  // median time per call over the runs
+        double nsMin;
+    };
+
+    char const *const FILTERS[] = { "nearest", "bilinear", "trilinear" };
+
+    // Set associative cache with LRU replacement, counting the misses of
+    // the addresses passed to access. Its size is that of a typical L1 data
+    // cache: 32 KB, 8 ways of 64 byte lines.
+    class CacheSim
+    {
+        static unsigned const LINE = 64;
+        static unsigned const WAYS = 8;
+        static unsigned const SETS = 32 * 1024 / LINE / WAYS;
+
+        uint64_t d_tags[SETS][WAYS];
+        uint64_t d_used[SETS][WAYS];    // time of the last access
+        uint64_t d_time = 0;
+        unsigned long d_misses = 0;
+
+        public:
+            CacheSim()
+            {
+                for (unsigned set = 0; set != SETS; ++set)
+                    for (unsigned way = 0; way != WAYS; ++way)
+                    {
+                        d_tags[set][way] = UINT64_MAX;
+                        d_used[set][way] = 0;
+                    }
+            }
+
+            void access(uint64_t address)
+            {
+                uint64_t line = address / LINE;
+                unsigned set = line % SETS;
+                unsigned victim = 0;
+                ++d_time;
+                for (unsigned way = 0; way != WAYS; ++way)
+                {
+                    if (d_tags[set][way] == line)
+                    {
+                        d_used[set][way] = d_time;
+                        return;
+                    }
+                    if (d_used[set][way] < d_used[set][victim])
+                        victim = way;
+                }
+                ++d_misses;
+                d_tags[set][victim] = line;
+                d_used[set][victim] = d_time;
+            }
+
+            unsigned long misses() const
+            {
+                return d_misses;
+            }
+    };
+
+    // State of the texel access hook, used by one render at a time
+    struct TextureTrace
+    {
+        unsigned long reads = 0;
+        CacheSim rows;
+        CacheSim tiles;
+        map<Texture const *, vector<uint64_t>> rowOffsets;  // of the levels
+        map<Texture const *, uint64_t> bases;               // of the textures
+    };
+    TextureTrace *textureTrace = nullptr;
+
+    void traceTexel(Texture const &texture, unsigned level, unsigned x, unsigned y)
+    {
+        TextureTrace &trace = *textureTrace;
+        ++trace.reads;
+
+        // every texture gets an address range of its own; the levels of the
+        // row-major layout follow each other, 4 bytes per texel
+        auto found = trace.bases.find(&texture);
+        if (found == trace.bases.end())
+        {
+            found = trace.bases.emplace(&texture, uint64_t(trace.bases.size() + 1) << 40).first;
+            vector<uint64_t> &offsets = trace.rowOffsets[&texture];
+            uint64_t offset = 0;
+            for (unsigned idx = 0; idx != texture.levels(); ++idx)
+            {
+                offsets.push_back(offset);
+                offset += uint64_t(texture.width(idx)) * texture.height(idx) * 4;
+            }
+        }
+        uint64_t base = found->second;
+        trace.rows.access(base + trace.rowOffsets[&texture][level]
+                          + (uint64_t(y) * texture.width(level) + x) * 4);
+        trace.tiles.access(base + texture.index(level, x, y) * 4);
+    }
+
+    void usage(char const *program)
+    {
+        cerr << "Usage: " << program << " [options] [scene.json ...]\n"
+             << "Renders every scene (default: all .json files in ../Scenes)\n"
+             << "several times and reports the median time of each phase.\n"
+             << "Options:\n"
+             << "  --runs N          renders per scene (default: 3)\n"
+             << "  --threads N       number of render (or OBJ parse) threads\n"
+             << "  --packet-size N   trace primary rays in packets of N\n"
+             << "  --format F        json (default) or csv\n"
+             << "  --image-format F  encode the images as png (default), ppm or pfm\n"
+             << "  --compression N   PNG compression level, 0 to 9 (default: 6)\n"
+             << "  --output FILE     write the report to FILE\n"
+             << "  --scenes DIR      directory with the scenes\n"
+             << "  --mesh-cache DIR  mesh cache directory of the scenes\n"
+             << "  --no-mesh-cache   parse the meshes of the scenes every run\n"
+             << "  --obj             parse .obj files (default: those in the scene\n"
+             << "                    directory) instead and report MB/s\n"
+             << "  --texture         render the textured scenes (default: those in the\n"
+             << "                    scene directory) with every texture filter and\n"
+             << "                    report the texel reads and the misses of a\n"
+             << "                    simulated 32 KB cache for a row-major and the\n"
+             << "                    tiled texture layout\n"
+             << "  --shapes          time intersect, occluded and mapTexture of the\n"
+             << "                    sphere, cylinder and cone on random rays, in\n"
+             << "                    nanoseconds per call (no scenes are rendered)\n"
+             << "  --compare FILE    compare with a report saved in json format,\n"
+             << "                    exit with status 2 on a regression\n"
+             << "  --tolerance X     allowed slowdown in compare mode (default: 0.1)\n";
+    }
+
+    vector<string> listFiles(string const &dir, string const &suffix)
+    {
+        vector<string> files;
+        DIR *handle = opendir(dir.c_str());
+        if (!handle)
+            throw runtime_error("Could not open directory " + dir);
+        while (dirent *entry = readdir(handle))
+        {
+            string name = entry->d_name;
+            if (name.size() > suffix.size()
+                && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+                files.push_back(dir + '/' + name);
+        }
+        closedir(handle);
+        sort(files.begin(), files.end());
+        return files;
+    }
+
+    double median(vector<double> values)
+    {
+        sort(values.begin(), values.end());
+        size_t mid = values.size() / 2;
+        return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+    }
+
+    string baseName(string const &path)
+    {
+        return path.substr(path.find_last_of('/') + 1);
+    }
+
+    Result benchScene(string const &path, Options const &opts)
+    {
+        typedef chrono::steady_clock Clock;
+        auto since = [](Clock::time_point start)
+        {
+            return chrono::duration<double>(Clock::now() - start).count();
+        };
+
+        Result result;
+        result.scene = baseName(path);
+        vector<double> times[NUM_PHASES];
+        string tmpname = "ray_bench_" + result.scene + ImageWriter::extension(opts.imageFormat);
+        ImageWriter writer(opts.imageFormat, opts.compression, opts.threads < 0 ? 0 : opts.threads);
+
+        for (unsigned run = 0; run != opts.runs; ++run)
+        {
+            Raytracer raytracer;
+            raytracer.meshCache(opts.meshCache);
+
+            Clock::time_point start = Clock::now();
+            if (!raytracer.readScene(path))
+                throw runtime_error("Reading " + path + " failed");
+            times[0].push_back(since(start));
+
+            if (opts.threads >= 0)
+                raytracer.threads(opts.threads);
+            if (opts.packetSize >= 1)
+                raytracer.packetSize(opts.packetSize);
+
+            start = Clock::now();
+            raytracer.build();
+            times[1].push_back(since(start));
+
+            Image img(400, 400);    // the size used by renderToFile
+            start = Clock::now();
+            raytracer.render(img);
+            times[2].push_back(since(start));
+
+            start = Clock::now();
+            writer.write(img, tmpname);
+            times[3].push_back(since(start));
+
+            result.stats = raytracer.stats();
+        }
+        remove(tmpname.c_str());
+
+        for (unsigned phase = 0; phase != NUM_PHASES; ++phase)
+            result.seconds[phase] = median(times[phase]);
+        result.renderMin = *min_element(times[2].begin(), times[2].end());
+        return result;
+    }
+
+    ObjResult benchObj(string const &path, Options const &opts)
+    {
+        typedef chrono::steady_clock Clock;
+
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            throw runtime_error("Could not stat " + path);
+
+        ObjResult result;
+        result.mesh = baseName(path);
+        result.bytes = info.st_size;
+
+        vector<double> times;
+        for (unsigned run = 0; run != opts.runs; ++run)
+        {
+            Clock::time_point start = Clock::now();
+            OBJLoader loader(path, opts.threads < 0 ? 0 : opts.threads);
+            times.push_back(chrono::duration<double>(Clock::now() - start).count());
+        }
+        result.seconds = median(times);
+        result.secondsMin = *min_element(times.begin(), times.end());
+        return result;
+    }
+
+    vector<TextureResult> benchTexture(string const &path, Options const &opts)
+    {
+        typedef chrono::steady_clock Clock;
+
+        vector<TextureResult> results;
+        for (char const *filter : FILTERS)
+        {
+            TextureResult result;
+            result.scene = baseName(path);
+            result.filter = filter;
+
+            vector<double> times;
+            for (unsigned run = 0; run <= opts.runs; ++run)
+            {
+                Raytracer raytracer;
+                raytracer.meshCache(opts.meshCache);
+                if (!raytracer.readScene(path))
+                    throw runtime_error("Reading " + path + " failed");
+                raytracer.textureFilter(Texture::filter(filter));
+                if (opts.packetSize >= 1)
+                    raytracer.packetSize(opts.packetSize);
+                raytracer.build();
+
+                Image img(400, 400);
+                if (run == 0)
+                {
+                    // the hook is not thread safe: trace on one thread
+                    TextureTrace trace;
+                    textureTrace = &trace;
+                    Texture::accessHook(traceTexel);
+                    raytracer.threads(1);
+                    raytracer.render(img);
+                    Texture::accessHook(nullptr);
+                    textureTrace = nullptr;
+
+                    result.reads = trace.reads;
+                    result.missesRows = trace.rows.misses();
+                    result.missesTiles = trace.tiles.misses();
+                    continue;
+                }
+
+                if (opts.threads >= 0)
+                    raytracer.threads(opts.threads);
+                Clock::time_point start = Clock::now();
+                raytracer.render(img);
+                times.push_back(chrono::duration<double>(Clock::now() - start).count());
+            }
+            result.seconds = median(times);
+            result.secondsMin = *min_element(times.begin(), times.end());
+            results.push_back(result);
+        }
+        return results;
+    }
+
+    // Times the kernels of one shape on SHAPE_RAYS rays from a sphere of
+    // radius 5 aimed at the box [-1.5, 1.5]^3 around the origin, which
+    // the shapes fill about half of. The rays are the same for every build.
+    vector<ShapeResult> benchShape(string const &name, Object &shape, Options const &opts)
+    {
+        typedef chrono::steady_clock Clock;
+
+        mt19937 random(1);
+        uniform_real_distribution<Real> unit(-1, 1);
+        vector<Ray> rays;
+        while (rays.size() != SHAPE_RAYS)
+        {
+            Vector from(unit(random), unit(random), unit(random));
+            Vector to(1.5 * unit(random), 1.5 * unit(random), 1.5 * unit(random));
+            if (from.length_2() > 1 || from.length_2() < 1e-6)
+                continue;
+            from = 5 * from.normalized();
+            rays.push_back(Ray(from, (to - from).normalized()));
+        }
+
+        vector<Hit> hits;
+        for (Ray const &ray : rays)
+            hits.push_back(shape.intersect(ray));
+
+        // the operations and what a pass over the rays counts as a hit
+        vector<pair<string, function<unsigned long()>>> operations;
+        operations.emplace_back("intersect", [&]()
+        {
+            unsigned long count = 0;
+            for (Ray const &ray : rays)
+                count += !isnan(shape.intersect(ray).t);
+            return count;
+        });
+        operations.emplace_back("occluded", [&]()
+        {
+            unsigned long count = 0;
+            for (Ray const &ray : rays)
+                count += shape.occluded(ray, 100);
+            return count;
+        });
+        if (name == "sphere")       // the only shape with a texture mapping
+            operations.emplace_back("texture", [&]()
+            {
+                // a checksum of the coordinates, on the rays which hit
+                unsigned long count = 0;
+                for (size_t idx = 0; idx != rays.size(); ++idx)
+                    if (!isnan(hits[idx].t))
+                    {
+                        Point uv = shape.mapTexture(rays[idx], hits[idx]);
+                        count += static_cast<unsigned long>(uv.x * 1000) + static_cast<unsigned long>(uv.y * 1000);
+                    }
+                return count;
+            });
+
+        vector<ShapeResult> results;
+        for (auto const &operation : operations)
+        {
+            ShapeResult result;
+            result.kernel = name + '.' + operation.first;
+            result.calls = 0;
+            if (operation.first == "texture")
+                for (Hit const &hit : hits)
+                    result.calls += !isnan(hit.t);
+            else
+                result.calls = rays.size();
+            result.calls *= SHAPE_PASSES;
+            result.hits = operation.second() * SHAPE_PASSES;
+
+            vector<double> times;
+            for (unsigned run = 0; run != opts.runs; ++run)
+            {
+                unsigned long count = 0;
+                Clock::time_point start = Clock::now();
+                for (unsigned pass = 0; pass != SHAPE_PASSES; ++pass)
+                    count += operation.second();
+                times.push_back(chrono::duration<double, nano>(Clock::now() - start).count() / result.calls);
+                if (count != result.hits)
+                    throw runtime_error(result.kernel + " is not deterministic");
+            }
+            result.ns = median(times);
+            result.nsMin = *min_element(times.begin(), times.end());
+            results.push_back(result);
+        }
+        return results;
+    }
+
+    vector<ShapeResult> benchShapes(Options const &opts)
+    {
+        // tilted, so no component of the axes is zero
+        vector<pair<string, unique_ptr<Object>>> shapes;
+        shapes.emplace_back("sphere", unique_ptr<Object>(
+            new Sphere(Point(0.1, -0.2, 0.1), 1, M_PI / 6, Vector(0.3, 1, 0.2))));
+        shapes.emplace_back("cylinder", unique_ptr<Object>(
+            new Cylinder(Point(-0.2, -1, 0.1), Point(0.3, 1, -0.2), 0.6)));
+        shapes.emplace_back("cone", unique_ptr<Object>(
+            new Cone(Point(-0.2, -1, 0.1), Point(0.3, 1, -0.2), 0.8)));
+
+        vector<ShapeResult> results;
+        for (auto const &shape : shapes)
+        {
+            cerr << "Timing " << shape.first << "...\n";
+            vector<ShapeResult> kernels = benchShape(shape.first, *shape.second, opts);
+            results.insert(results.end(), kernels.begin(), kernels.end());
+        }
+        return results;
+    }
+
+    json reportHeader(Options const &opts)
+    {
+        json report;
+#ifdef __OPTIMIZE__
+        report["optimized"] = true;
+#else
+        report["optimized"] = false;
+#endif
+        report["runs"] = opts.runs;
+        return report;
+    }
+
+    json toJson(vector<ObjResult> const &results, Options const &opts)
+    {
+        json report = reportHeader(opts);
+        report["meshes"] = json::array();
+        for (ObjResult const &result : results)
+        {
+            json node;
+            node["mesh"] = result.mesh;
+            node["bytes"] = result.bytes;
+            node["parse"] = result.seconds;
+            node["parse_min"] = result.secondsMin;
+            node["mb_per_second"] = result.bytes / 1e6 / result.seconds;
+            report["meshes"].push_back(node);
+        }
+        return report;
+    }
+
+    json toJson(vector<TextureResult> const &results, Options const &opts)
+    {
+        json report = reportHeader(opts);
+        report["textures"] = json::array();
+        for (TextureResult const &result : results)
+        {
+            json node;
+            node["scene"] = result.scene;
+            node["filter"] = result.filter;
+            node["texel_reads"] = result.reads;
+            node["misses_row_major"] = result.missesRows;
+            node["misses_tiled"] = result.missesTiles;
+            node["render"] = result.seconds;
+            node["render_min"] = result.secondsMin;
+            report["textures"].push_back(node);
+        }
+        return report;
+    }
+
+    json toJson(vector<ShapeResult> const &results, Options const &opts)
+    {
+        json report = reportHeader(opts);
+        report["shapes"] = json::array();
+        for (ShapeResult const &result : results)
+        {
+            json node;
+            node["kernel"] = result.kernel;
+            node["calls"] = result.calls;
+            node["hits"] = result.hits;
+            node["ns"] = result.ns;
+            node["ns_min"] = result.nsMin;
+            report["shapes"].push_back(node);
+        }
+        return report;
+    }
+
+    json toJson(vector<Result> const &results, Options const &opts)
+    {
+        json report = reportHeader(opts);
+        report["scenes"] = json::array();
+        for (Result const &result : results)
+        {
+            json node;
+            node["scene"] = result.scene;
+            for (unsigned phase = 0; phase != NUM_PHASES; ++phase)
+                node[PHASES[phase]] = result.seconds[phase];
+            node["render_min"] = result.renderMin;
+            node["rays"] = result.stats.rays();
+            node["rays_per_second"] = result.stats.rays() / result.seconds[2];
+            node["tests"] = result.stats.tests();
+            node["tests_per_second"] = result.stats.tests() / result.seconds[2];
+            report["scenes"].push_back(node);
+        }
+        return report;
+    }
+
+    void writeCsv(ostream &out, vector<Result> const &results)
+    {
+        out << "scene,parse,build,render,encode,render_min,rays,rays_per_second,"
+               "tests,tests_per_second\n";
+        for (Result const &result : results)
+        {
+            out << result.scene;
+            for (unsigned phase = 0; phase != NUM_PHASES; ++phase)
+                out << ',' << result.seconds[phase];
+            out << ',' << result.renderMin
+                << ',' << result.stats.rays() << ',' << result.stats.rays() / result.seconds[2]
+                << ',' << result.stats.tests() << ',' << result.stats.tests() / result.seconds[2]
+                << '\n';
+        }
+    }
+
+    void writeCsv(ostream &out, vector<ObjResult> const &results)
+    {
+        out << "mesh,bytes,parse,parse_min,mb_per_second\n";
+        for (ObjResult const &result : results)
+            out << result.mesh << ',' << result.bytes << ',' << result.seconds
+                << ',' << result.secondsMin << ',' << result.bytes / 1e6 / result.seconds << '\n';
+    }
+
+    void writeCsv(ostream &out, vector<TextureResult> const &results)
+    {
+        out << "scene,filter,texel_reads,misses_row_major,misses_tiled,render,render_min\n";
+        for (TextureResult const &result : results)
+            out << result.scene << ',' << result.filter << ',' << result.reads
+                << ',' << result.missesRows << ',' << result.missesTiles
+                << ',' << result.seconds << ',' << result.secondsMin << '\n';
+    }
+
+    void writeCsv(ostream &out, vector<ShapeResult> const &results)
+    {
+        out << "kernel,calls,hits,ns,ns_min\n";
+        for (ShapeResult const &result : results)
+            out << result.kernel << ',' << result.calls << ',' << result.hits
+                << ',' << result.ns << ',' << result.nsMin << '\n';
+    }
+
+    // Prints the phases of every scene (mesh, or shape kernel) which are
+    // slower than in the baseline, returns true if there is a regression
+    bool compare(json const &report, string const &baselineFile, double tolerance)
+    {
+        bool const obj = report.count("meshes") != 0;
+        bool const shapes = report.count("shapes") != 0;
+        char const *list = obj ? "meshes" : shapes ? "shapes" : "scenes";
+        char const *key = obj ? "mesh" : shapes ? "kernel" : "scene";
+        vector<char const *> phases = obj
+            ? vector<char const *>(begin(OBJ_PHASES), end(OBJ_PHASES))
+            : shapes ? vector<char const *>(begin(SHAPE_PHASES), end(SHAPE_PHASES))
+            : vector<char const *>(begin(PHASES), end(PHASES));
+        double const minDelta = shapes ? MIN_DELTA_NS : MIN_DELTA;
+
+        ifstream in(baselineFile);
+        if (!in)
+            throw runtime_error("Could not open " + baselineFile);
+        json baseline;
+        in >> baseline;
+
+        map<string, json> before;
+        for (json const &node : baseline[list])
+            before[node[key].get<string>()] = node;
+
+        bool regression = false;
+        cerr << left << setw(48) << key << setw(8) << "phase"
+             << right << setw(12) << "baseline" << setw(12) << "current" << setw(9) << "change\n";
+        for (json const &node : report[list])
+        {
+            string scene = node[key];
+            auto found = before.find(scene);
+            if (found == before.end())
+            {
+                cerr << left << setw(48) << scene << "not in baseline\n";
+                continue;
+            }
+            json const &old = found->second;
+            for (char const *phase : phases)
+            {
+                double then = old[phase];
+                double now = node[phase];
+                bool slower = now > then * (1 + tolerance) && now - then > minDelta;
+                regression = regression || slower;
+                cerr << left << setw(48) << scene << setw(8) << phase << right << fixed
+                     << setprecision(4) << setw(12) << then << setw(12) << now
+                     << setprecision(1) << setw(8) << showpos
+                     << (then > 0 ? 100 * (now - then) / then : 0.0) << '%' << noshowpos
+                     << (slower ? "  REGRESSION" : "") << '\n';
+            }
+            if (shapes && (old["calls"] != node["calls"] || old["hits"] != node["hits"]))
+                cerr << left << setw(48) << scene << "makes a different number of calls or hits\n";
+            else if (!obj && !shapes && (old["rays"] != node["rays"] || old["tests"] != node["tests"]))
+                cerr << left << setw(48) << scene << "traces a different number of rays or tests\n";
+        }
+        return regression;
+    }
+}
+
+int main(int argc, char *argv[])
+try
+{
+    Options opts;
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        string arg = argv[idx];
+        bool hasValue = idx + 1 < argc;
+        if (arg == "--runs" && hasValue)
+            opts.runs = max(1, stoi(argv[++idx]));
+        else if (arg == "--threads" && hasValue)
+            opts.threads = max(0, stoi(argv[++idx]));
+        else if (arg == "--packet-size" && hasValue)
+            opts.packetSize = max(1, stoi(argv[++idx]));
+        else if (arg == "--format" && hasValue)
+            opts.format = argv[++idx];
+        else if (arg == "--image-format" && hasValue)
+            opts.imageFormat = ImageWriter::parseFormat(argv[++idx]);
+        else if (arg == "--compression" && hasValue)
+            opts.compression = max(0, stoi(argv[++idx]));
+        else if (arg == "--output" && hasValue)
+            opts.output = argv[++idx];
+        else if (arg == "--scenes" && hasValue)
+            opts.sceneDir = argv[++idx];
+        else if (arg == "--compare" && hasValue)
+            opts.baseline = argv[++idx];
+        else if (arg == "--tolerance" && hasValue)
+            opts.tolerance = stod(argv[++idx]);
+        else if (arg == "--mesh-cache" && hasValue)
+            opts.meshCache = argv[++idx];
+        else if (arg == "--no-mesh-cache")
+            opts.meshCache.clear();
+        else if (arg == "--obj")
+            opts.obj = true;
+        else if (arg == "--texture")
+            opts.texture = true;
+        else if (arg == "--shapes")
+            opts.shapes = true;
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            opts.scenes.push_back(arg);
+    }
+    if ((opts.format != "json" && opts.format != "csv") || opts.obj + opts.texture + opts.shapes > 1
+        || (opts.texture && !opts.baseline.empty()) || (opts.shapes && !opts.scenes.empty()))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opts.scenes.empty() && !opts.shapes)
+        opts.scenes = listFiles(opts.sceneDir, opts.obj ? ".obj" : ".json");
+    if (opts.texture)
+        opts.scenes.erase(remove_if(opts.scenes.begin(), opts.scenes.end(),
+                                    [](string const &path)
+                                    {
+                                        return baseName(path).find("texture") == string::npos;
+                                    }),
+                          opts.scenes.end());
+
+#ifndef __OPTIMIZE__
+    cerr << "Warning: ray_bench was built without optimization, configure "
+            "with -DCMAKE_BUILD_TYPE=Release\n";
+#endif
+
+    vector<Result> results;
+    vector<ObjResult> objResults;
+    vector<TextureResult> textureResults;
+    vector<ShapeResult> shapeResults;
+    if (opts.shapes)
+        shapeResults = benchShapes(opts);
+    for (string const &path : opts.scenes)
+    {
+        if (opts.obj)
+        {
+            cerr << "Parsing " << path << "...\n";
+            objResults.push_back(benchObj(path, opts));
+            continue;
+        }
+
+        cerr << "Benchmarking " << path << "...\n";
+        // the raytracer reports its progress on cout, keep the report clean
+        streambuf *coutBuf = cout.rdbuf(nullptr);
+        try
+        {
+            if (opts.texture)
+            {
+                vector<TextureResult> scene = benchTexture(path, opts);
+                textureResults.insert(textureResults.end(), scene.begin(), scene.end());
+            }
+            else
+                results.push_back(benchScene(path, opts));
+        }
+        catch (...)
+        {
+            cout.rdbuf(coutBuf);
+            cout.clear();
+            throw;
+        }
+        cout.rdbuf(coutBuf);
+        cout.clear();
+    }
+
+    json report = opts.obj ? toJson(objResults, opts)
+                : opts.texture ? toJson(textureResults, opts)
+                : opts.shapes ? toJson(shapeResults, opts) : toJson(results, opts);
+
+    ofstream file;
+    if (!opts.output.empty())
+    {
+        file.open(opts.output);
+        if (!file)
+            throw runtime_error("Could not open " + opts.output + " for writing");
+    }
+    ostream &out = opts.output.empty() ? cout : file;
+    if (opts.format == "json")
+        out << setw(4) << report << '\n';
+    else if (opts.obj)
+        writeCsv(out, objResults);
+    else if (opts.texture)
+        writeCsv(out, textureResults);
+    else if (opts.shapes)
+        writeCsv(out, shapeResults);
+    else
+        writeCsv(out, results);
+
+    if (!opts.baseline.empty() && compare(report, opts.baseline, opts.tolerance))
+        return 2;
+    return 0;
+}
+catch (exception const &ex)
+{
+    cerr << "Error: " << ex.what() << '\n';
+    return 1;
+}
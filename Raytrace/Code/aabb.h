@@ -0,0 +1,102 @@
+#ifndef AABB_H_
+#define AABB_H_
+
+#include "ray.h"
+#include "triple.h"
+
+#include <algorithm>
+#include <limits>
+
+// Axis aligned bounding box, used by the acceleration structures.
+// A default constructed box is empty: extending it by anything
+// results in exactly that thing.
+class AABB
+{
+    public:
+        Point min;
+        Point max;
+
+        AABB()
+        :
+            min(std::numeric_limits<Real>::infinity(),
+                std::numeric_limits<Real>::infinity(),
+                std::numeric_limits<Real>::infinity()),
+            max(-std::numeric_limits<Real>::infinity(),
+                -std::numeric_limits<Real>::infinity(),
+                -std::numeric_limits<Real>::infinity())
+        {}
+
+        AABB(Point const &min, Point const &max)
+        :
+            min(min),
+            max(max)
+        {}
+
+        bool empty() const
+        {
+            return min.x > max.x || min.y > max.y || min.z > max.z;
+        }
+
+        void extend(Point const &p)
+        {
+            for (int axis = 0; axis != 3; ++axis)
+            {
+                min.data[axis] = std::min(min.data[axis], p.data[axis]);
+                max.data[axis] = std::max(max.data[axis], p.data[axis]);
+            }
+        }
+
+        void extend(AABB const &box)
+        {
+            for (int axis = 0; axis != 3; ++axis)
+            {
+                min.data[axis] = std::min(min.data[axis], box.min.data[axis]);
+                max.data[axis] = std::max(max.data[axis], box.max.data[axis]);
+            }
+        }
+
+        Point centroid() const
+        {
+            return (min + max) * 0.5;
+        }
+
+        // Axis (0, 1 or 2) along which the box is the widest
+        int longestAxis() const
+        {
+            Vector d = max - min;
+            if (d.x > d.y && d.x > d.z)
+                return 0;
+            return d.y > d.z ? 1 : 2;
+        }
+
+        Real surfaceArea() const
+        {
+            if (empty())
+                return 0.0;
+            Vector d = max - min;
+            return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+
+        // Slab test against the parametric interval [tMin, tMax] of the ray.
+        // invD holds the reciprocal of the ray direction. The test is
+        // conservative: NaNs (ray origin on a slab of a flat box) never
+        // reject the box and tMax is widened to absorb rounding errors.
+        bool intersect(Ray const &ray, Vector const &invD, Real tMin, Real tMax) const
+        {
+            tMax *= 1.0 + 4.0 * std::numeric_limits<Real>::epsilon();
+            for (int axis = 0; axis != 3; ++axis)
+            {
+                Real t0 = (min.data[axis] - ray.O.data[axis]) * invD.data[axis];
+                Real t1 = (max.data[axis] - ray.O.data[axis]) * invD.data[axis];
+                if (t0 > t1)
+                    std::swap(t0, t1);
+                tMin = t0 > tMin ? t0 : tMin;
+                tMax = t1 < tMax ? t1 : tMax;
+                if (tMin > tMax)
+                    return false;
+            }
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,315 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+// The packet box test works on doubles
+#if defined(__SSE2__) && !defined(RAY_SINGLE_PRECISION)
+#include <emmintrin.h>
+#define SSE2_BOX_TEST
+#endif
+
+using namespace std;
+
+// Relative cost of traversing a node compared to intersecting a primitive
+#define TRAVERSAL_COST (0.125)
+
+void BVH::build(vector<AABB> const &bounds, unsigned maxLeafSize)
+{
+    clear();
+    d_maxLeafSize = max(maxLeafSize, 1U);
+    if (bounds.empty())
+        return;
+
+    vector<Point> centroids;
+    centroids.reserve(bounds.size());
+    for (AABB const &box : bounds)
+        centroids.push_back(box.centroid());
+
+    d_indices.resize(bounds.size());
+    for (unsigned idx = 0; idx != d_indices.size(); ++idx)
+        d_indices[idx] = idx;
+
+    d_nodes.reserve(2 * bounds.size());
+    buildRecursive(bounds, centroids, 0, bounds.size(), 0);
+    d_nodes.shrink_to_fit();
+}
+
+void BVH::clear()
+{
+    d_nodes.clear();
+    d_indices.clear();
+}
+
+bool BVH::empty() const
+{
+    return d_nodes.empty();
+}
+
+unsigned BVH::numNodes() const
+{
+    return d_nodes.size();
+}
+
+AABB BVH::bounds() const
+{
+    return d_nodes.empty() ? AABB() : d_nodes.front().bounds;
+}
+
+vector<BVH::Node> const &BVH::nodes() const
+{
+    return d_nodes;
+}
+
+vector<unsigned> const &BVH::indices() const
+{
+    return d_indices;
+}
+
+void BVH::assign(vector<Node> &&nodes, vector<unsigned> &&indices)
+{
+    d_nodes = move(nodes);
+    d_indices = move(indices);
+}
+
+bool BVH::valid(unsigned numPrimitives) const
+{
+    for (unsigned prim : d_indices)
+    {
+        if (prim >= numPrimitives)
+            return false;
+    }
+    if (d_nodes.empty())
+        return true;
+
+    // Visit the nodes depth first, left child first, which is the order
+    // build stores them in: the left child directly follows its parent and
+    // the right child (offset) follows the left subtree. A node found
+    // anywhere else is shared by two parents or part of a cycle.
+    struct Pending
+    {
+        unsigned node;
+        unsigned depth;
+    };
+    vector<Pending> pending{{0, 0}};
+    unsigned next = 0;
+    while (!pending.empty())
+    {
+        Pending current = pending.back();
+        pending.pop_back();
+        if (current.node != next || next == d_nodes.size() || current.depth > STACK_SIZE)
+            return false;
+        ++next;
+
+        Node const &node = d_nodes[current.node];
+        if (node.count > 0)
+        {
+            if (node.offset > d_indices.size() || node.count > d_indices.size() - node.offset)
+                return false;
+            continue;
+        }
+        if (node.axis > 2)
+            return false;
+        pending.push_back({node.offset, current.depth + 1});
+        pending.push_back({current.node + 1, current.depth + 1});
+    }
+    return next == d_nodes.size();
+}
+
+unsigned BVH::primitive(unsigned pos) const
+{
+    return d_indices[pos];
+}
+
+unsigned BVH::buildRecursive(vector<AABB> const &bounds,
+                             vector<Point> const &centroids,
+                             unsigned begin, unsigned end, unsigned depth)
+{
+    unsigned nodeIdx = d_nodes.size();
+    d_nodes.push_back(Node{AABB(), begin, end - begin, 0});
+
+    AABB box;
+    AABB centroidBox;
+    for (unsigned idx = begin; idx != end; ++idx)
+    {
+        box.extend(bounds[d_indices[idx]]);
+        centroidBox.extend(centroids[d_indices[idx]]);
+    }
+    d_nodes[nodeIdx].bounds = box;
+
+    unsigned count = end - begin;
+    if (count == 1)
+        return nodeIdx;
+
+    int axis = centroidBox.longestAxis();
+    Real cmin = centroidBox.min.data[axis];
+    Real extent = centroidBox.max.data[axis] - cmin;
+    unsigned mid = begin;
+
+    // Binned SAH: sort the centroids into buckets along the widest axis
+    // and evaluate the cost of splitting between each pair of buckets.
+    // Deep trees are split at the median so the traversal stack never
+    // overflows.
+    if (extent > 0.0 && depth < STACK_SIZE / 2)
+    {
+        struct Bin
+        {
+            AABB bounds;
+            unsigned count = 0;
+        } bins[NUM_BINS];
+
+        auto binOf = [&](unsigned prim)
+        {
+            unsigned bin = static_cast<unsigned>(
+                NUM_BINS * ((centroids[prim].data[axis] - cmin) / extent));
+            return min(bin, NUM_BINS - 1);
+        };
+
+        for (unsigned idx = begin; idx != end; ++idx)
+        {
+            Bin &bin = bins[binOf(d_indices[idx])];
+            bin.bounds.extend(bounds[d_indices[idx]]);
+            ++bin.count;
+        }
+
+        // Sweep from the right to collect the cost of the right halves
+        Real rightCost[NUM_BINS];
+        AABB rightBox;
+        unsigned rightCount = 0;
+        for (unsigned split = NUM_BINS - 1; split != 0; --split)
+        {
+            rightBox.extend(bins[split].bounds);
+            rightCount += bins[split].count;
+            rightCost[split] = rightCount * rightBox.surfaceArea();
+        }
+
+        Real bestCost = numeric_limits<Real>::infinity();
+        unsigned bestSplit = 0;
+        AABB leftBox;
+        unsigned leftCount = 0;
+        for (unsigned split = 1; split != NUM_BINS; ++split)
+        {
+            leftBox.extend(bins[split - 1].bounds);
+            leftCount += bins[split - 1].count;
+            Real cost = leftCount * leftBox.surfaceArea() + rightCost[split];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = split;
+            }
+        }
+
+        Real leafCost = count;
+        Real splitCost = TRAVERSAL_COST + bestCost / box.surfaceArea();
+        if (count <= d_maxLeafSize && leafCost <= splitCost)
+            return nodeIdx;
+
+        mid = partition(d_indices.begin() + begin, d_indices.begin() + end,
+                        [&](unsigned prim) { return binOf(prim) < bestSplit; })
+              - d_indices.begin();
+    }
+    else if (count <= d_maxLeafSize)
+    {
+        return nodeIdx;
+    }
+
+    // All centroids in one bin (or coinciding): split by count instead
+    if (mid == begin || mid == end)
+    {
+        mid = begin + count / 2;
+        nth_element(d_indices.begin() + begin, d_indices.begin() + mid,
+                    d_indices.begin() + end,
+                    [&](unsigned lhs, unsigned rhs)
+                    {
+                        return centroids[lhs].data[axis] < centroids[rhs].data[axis];
+                    });
+    }
+
+    d_nodes[nodeIdx].count = 0;
+    d_nodes[nodeIdx].axis = axis;
+    buildRecursive(bounds, centroids, begin, mid, depth + 1);
+    unsigned right = buildRecursive(bounds, centroids, mid, end, depth + 1);
+    d_nodes[nodeIdx].offset = right;
+    return nodeIdx;
+}
+
+BVH::PacketFrame::PacketFrame(RayPacket const &packet)
+:
+    size(packet.size)
+{
+    // Copy the padded lanes as well, the SIMD box test reads whole registers
+    for (unsigned lane = 0; lane != packet.paddedSize(); ++lane)
+    {
+        origin[0][lane] = packet.ox[lane];
+        origin[1][lane] = packet.oy[lane];
+        origin[2][lane] = packet.oz[lane];
+        invD[0][lane] = 1.0 / packet.dx[lane];
+        invD[1][lane] = 1.0 / packet.dy[lane];
+        invD[2][lane] = 1.0 / packet.dz[lane];
+    }
+}
+
+#ifdef SSE2_BOX_TEST
+
+// Slab test of AABB::intersect on two lanes at a time. SSE2 is part of the
+// x86-64 baseline, so unlike the kernels of the shapes this needs no runtime
+// dispatch; on the test machine it also beat an AVX version, which pays for
+// switching to AVX code on every node.
+static bool anyLaneHitsSSE2(AABB const &box, Real const origin[3][RayPacket::MAX_SIZE],
+                            Real const invD[3][RayPacket::MAX_SIZE], Real const tMax[], unsigned size)
+{
+    __m128d const widen = _mm_set1_pd(1.0 + 4.0 * numeric_limits<Real>::epsilon());
+    for (unsigned lane = 0; lane < size; lane += 2)
+    {
+        __m128d tNear = _mm_setzero_pd();
+        __m128d tFar = _mm_mul_pd(_mm_loadu_pd(tMax + lane), widen);
+        for (int axis = 0; axis != 3; ++axis)
+        {
+            __m128d o = _mm_load_pd(origin[axis] + lane);
+            __m128d inv = _mm_load_pd(invD[axis] + lane);
+            __m128d t0 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(box.min.data[axis]), o), inv);
+            __m128d t1 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(box.max.data[axis]), o), inv);
+            __m128d swap = _mm_cmpgt_pd(t0, t1);
+            __m128d lo = _mm_or_pd(_mm_and_pd(swap, t1), _mm_andnot_pd(swap, t0));
+            __m128d hi = _mm_or_pd(_mm_and_pd(swap, t0), _mm_andnot_pd(swap, t1));
+            __m128d gt = _mm_cmpgt_pd(lo, tNear);
+            tNear = _mm_or_pd(_mm_and_pd(gt, lo), _mm_andnot_pd(gt, tNear));
+            __m128d lt = _mm_cmplt_pd(hi, tFar);
+            tFar = _mm_or_pd(_mm_and_pd(lt, hi), _mm_andnot_pd(lt, tFar));
+        }
+        if (_mm_movemask_pd(_mm_cmple_pd(tNear, tFar)) != 0)
+            return true;
+    }
+    return false;
+}
+
+#endif
+
+// Once some lane hits the box all lanes are reported: coherent rays mostly
+// agree, and testing the remaining lanes costs more than the primitive
+// tests it saves.
+unsigned BVH::intersect(AABB const &box, PacketFrame const &frame, Real const tMax[])
+{
+#ifdef SSE2_BOX_TEST
+    return anyLaneHitsSSE2(box, frame.origin, frame.invD, tMax, frame.size) ? (1U << frame.size) - 1 : 0;
+#else
+    for (unsigned lane = 0; lane != frame.size; ++lane)
+    {
+        Real tNear = 0.0;
+        Real tFar = tMax[lane] * (1.0 + 4.0 * numeric_limits<Real>::epsilon());
+        for (int axis = 0; axis != 3; ++axis)
+        {
+            Real t0 = (box.min.data[axis] - frame.origin[axis][lane]) * frame.invD[axis][lane];
+            Real t1 = (box.max.data[axis] - frame.origin[axis][lane]) * frame.invD[axis][lane];
+            if (t0 > t1)
+                swap(t0, t1);
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+        }
+        if (tNear <= tFar)
+            return (1U << frame.size) - 1;
+    }
+    return 0;
+#endif
+}
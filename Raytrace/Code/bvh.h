@@ -0,0 +1,278 @@
+#ifndef BVH_H_
+#define BVH_H_
+
+#include "aabb.h"
+#include "ray.h"
+#include "raypacket.h"
+#include "triple.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+// Bounding volume hierarchy over an arbitrary set of primitives.
+//
+// The tree is built once from the bounding boxes of the primitives using
+// the surface area heuristic (SAH) evaluated over a fixed number of bins.
+// Nodes are stored depth first in a flat array: the left child of an
+// interior node directly follows its parent, the index of the right child
+// is stored in the node.
+//
+// The BVH knows nothing about the primitives themselves, traversal reports
+// primitive indices (as passed to build) to a visitor which performs the
+// actual intersection test.
+class BVH
+{
+    public:
+        static unsigned const MAX_LEAF_SIZE = 4;   // default for build
+
+        struct Node
+        {
+            AABB bounds;
+            unsigned offset;    // first primitive (leaf) or right child
+            unsigned count;     // number of primitives, 0 for interior nodes
+            unsigned axis;      // split axis of interior nodes
+        };
+
+        // Builds the hierarchy over primitives with the given bounds.
+        // Leaves hold at most maxLeafSize primitives.
+        void build(std::vector<AABB> const &bounds, unsigned maxLeafSize = MAX_LEAF_SIZE);
+        void clear();
+
+        bool empty() const;
+        unsigned numNodes() const;
+        AABB bounds() const;
+
+        std::vector<Node> const &nodes() const;
+
+        // Primitive order of the leaves. Together with nodes() this is all
+        // the state of a built hierarchy.
+        std::vector<unsigned> const &indices() const;
+
+        // Restores a hierarchy from the nodes() and indices() of a built one
+        void assign(std::vector<Node> &&nodes, std::vector<unsigned> &&indices);
+
+        // true if the nodes form a hierarchy laid out as build lays it out,
+        // no deeper than the traversal supports, whose leaves cover
+        // positions of indices() which all hold primitives below
+        // numPrimitives. Checks a hierarchy assigned from untrusted data.
+        bool valid(unsigned numPrimitives) const;
+
+        // Primitive at position pos of the leaf order: leaf covers the
+        // primitives at positions [leaf.offset, leaf.offset + leaf.count)
+        unsigned primitive(unsigned pos) const;
+
+        // Visits all primitives whose leaves are hit by the ray within
+        // [0, tMax], near child first. The visitor is called as
+        // visit(primitive, tMax) and shrinks tMax when it records a
+        // closer hit, which prunes the remaining traversal.
+        template <typename Visitor>
+        void closestHit(Ray const &ray, Real tMax, Visitor &&visit) const;
+
+        // Visits the primitives whose leaves are hit by the ray within
+        // [0, tMax] in no particular order. The visitor is called as
+        // visit(primitive) and returns true to stop the traversal, which
+        // makes anyHit return true as well.
+        template <typename Visitor>
+        bool anyHit(Ray const &ray, Real tMax, Visitor &&visit) const;
+
+        // Packet version of closestHit. A node is entered when any ray of
+        // the packet hits it within [0, tMax[lane]]; the visitor is called
+        // as visit(primitive, mask, tMax) where mask holds the lanes which
+        // may have reached the leaf (once one lane hits a node all lanes
+        // count as active, rays missing the node simply miss its
+        // primitives). The direction of the first ray decides which child
+        // is visited first, which works well for coherent rays.
+        template <typename Visitor>
+        void closestHit(RayPacket const &packet, Real tMax[], Visitor &&visit) const;
+
+        // Versions of the traversals above which call the visitor once per
+        // leaf instead of once per primitive, with the leaf node instead of
+        // the primitive index. Used by structures storing their primitives
+        // per leaf (e.g. the triangle blocks of TriangleMesh).
+        template <typename Visitor>
+        void closestLeaf(Ray const &ray, Real tMax, Visitor &&visit) const;
+        template <typename Visitor>
+        bool anyLeaf(Ray const &ray, Real tMax, Visitor &&visit) const;
+        template <typename Visitor>
+        void closestLeaf(RayPacket const &packet, Real tMax[], Visitor &&visit) const;
+
+    private:
+        // Origins and reciprocal directions of the rays of a packet
+        struct PacketFrame
+        {
+            alignas(32) Real origin[3][RayPacket::MAX_SIZE];
+            alignas(32) Real invD[3][RayPacket::MAX_SIZE];
+            unsigned size;
+
+            explicit PacketFrame(RayPacket const &packet);
+        };
+
+        // Lanes of the packet which may hit box within [0, tMax[lane]]
+        static unsigned intersect(AABB const &box, PacketFrame const &frame, Real const tMax[]);
+
+        static unsigned const NUM_BINS = 16;
+        static unsigned const STACK_SIZE = 64;
+
+        std::vector<Node> d_nodes;
+        std::vector<unsigned> d_indices;    // primitive order of the leaves
+        unsigned d_maxLeafSize;
+
+        unsigned buildRecursive(std::vector<AABB> const &bounds,
+                                std::vector<Point> const &centroids,
+                                unsigned begin, unsigned end, unsigned depth);
+};
+
+template <typename Visitor>
+void BVH::closestHit(Ray const &ray, Real tMax, Visitor &&visit) const
+{
+    closestLeaf(ray, tMax, [&](Node const &leaf, Real &tMax)
+    {
+        for (unsigned idx = 0; idx != leaf.count; ++idx)
+            visit(d_indices[leaf.offset + idx], tMax);
+    });
+}
+
+template <typename Visitor>
+void BVH::closestHit(RayPacket const &packet, Real tMax[], Visitor &&visit) const
+{
+    closestLeaf(packet, tMax, [&](Node const &leaf, unsigned mask, Real tMax[])
+    {
+        for (unsigned idx = 0; idx != leaf.count; ++idx)
+            visit(d_indices[leaf.offset + idx], mask, tMax);
+    });
+}
+
+template <typename Visitor>
+bool BVH::anyHit(Ray const &ray, Real tMax, Visitor &&visit) const
+{
+    return anyLeaf(ray, tMax, [&](Node const &leaf)
+    {
+        for (unsigned idx = 0; idx != leaf.count; ++idx)
+            if (visit(d_indices[leaf.offset + idx]))
+                return true;
+        return false;
+    });
+}
+
+template <typename Visitor>
+void BVH::closestLeaf(Ray const &ray, Real tMax, Visitor &&visit) const
+{
+    if (d_nodes.empty())
+        return;
+
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+    bool const negative[3] = {invD.x < 0.0, invD.y < 0.0, invD.z < 0.0};
+
+    unsigned stack[STACK_SIZE];
+    unsigned top = 0;
+    unsigned current = 0;
+    while (true)
+    {
+        Node const &node = d_nodes[current];
+        if (node.bounds.intersect(ray, invD, 0.0, tMax))
+        {
+            if (node.count > 0)
+            {
+                visit(node, tMax);
+            }
+            else
+            {
+                // Descend into the child closest to the ray origin first
+                if (negative[node.axis])
+                {
+                    stack[top++] = current + 1;
+                    current = node.offset;
+                }
+                else
+                {
+                    stack[top++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (top == 0)
+            break;
+        current = stack[--top];
+    }
+}
+
+template <typename Visitor>
+void BVH::closestLeaf(RayPacket const &packet, Real tMax[], Visitor &&visit) const
+{
+    if (d_nodes.empty() || packet.size == 0)
+        return;
+
+    PacketFrame const frame(packet);
+    bool const negative[3] = {frame.invD[0][0] < 0.0, frame.invD[1][0] < 0.0, frame.invD[2][0] < 0.0};
+
+    unsigned stack[STACK_SIZE];
+    unsigned top = 0;
+    unsigned current = 0;
+    while (true)
+    {
+        Node const &node = d_nodes[current];
+        unsigned mask = intersect(node.bounds, frame, tMax);
+        if (mask != 0)
+        {
+            if (node.count > 0)
+            {
+                visit(node, mask, tMax);
+            }
+            else
+            {
+                if (negative[node.axis])
+                {
+                    stack[top++] = current + 1;
+                    current = node.offset;
+                }
+                else
+                {
+                    stack[top++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (top == 0)
+            break;
+        current = stack[--top];
+    }
+}
+
+template <typename Visitor>
+bool BVH::anyLeaf(Ray const &ray, Real tMax, Visitor &&visit) const
+{
+    if (d_nodes.empty())
+        return false;
+
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+
+    unsigned stack[STACK_SIZE];
+    unsigned top = 0;
+    unsigned current = 0;
+    while (true)
+    {
+        Node const &node = d_nodes[current];
+        if (node.bounds.intersect(ray, invD, 0.0, tMax))
+        {
+            if (node.count > 0)
+            {
+                if (visit(node))
+                    return true;
+            }
+            else
+            {
+                stack[top++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (top == 0)
+            return false;
+        current = stack[--top];
+    }
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    char const MAGIC[8] = {'R', 'A', 'Y', 'C', 'K', 'P', 'T', '\0'};
+    uint32_t const VERSION = 1;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t realSize;
+        Checkpoint::Fingerprint fingerprint;
+        uint32_t numTiles;
+        uint32_t samples;
+        uint32_t imageWidth;
+        uint32_t imageHeight;
+        uint64_t numSums;
+    };
+}
+
+bool Checkpoint::Fingerprint::operator==(Fingerprint const &other) const
+{
+    return sceneHash == other.sceneHash && textureFilter == other.textureFilter
+        && progressive == other.progressive && width == other.width && height == other.height
+        && x0 == other.x0 && y0 == other.y0 && x1 == other.x1 && y1 == other.y1;
+}
+
+bool Checkpoint::Fingerprint::operator!=(Fingerprint const &other) const
+{
+    return !(*this == other);
+}
+
+Checkpoint::Checkpoint(Fingerprint const &fingerprint, Scene::RenderState state)
+:
+    d_fingerprint(fingerprint),
+    d_state(move(state))
+{}
+
+Checkpoint::Fingerprint const &Checkpoint::fingerprint() const
+{
+    return d_fingerprint;
+}
+
+Scene::RenderState const &Checkpoint::state() const
+{
+    return d_state;
+}
+
+Scene::RenderState &Checkpoint::state()
+{
+    return d_state;
+}
+
+void Checkpoint::write(string const &filename) const
+{
+    Image const &img = d_state.image;
+    Header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.realSize = sizeof(Real);
+    header.fingerprint = d_fingerprint;
+    header.numTiles = d_state.tiles.size();
+    header.samples = d_state.samples;
+    header.imageWidth = img.width();
+    header.imageHeight = img.height();
+    header.numSums = d_state.sums.size();
+
+    vector<Real> sums;
+    sums.reserve(3 * d_state.sums.size());
+    for (Color const &sum : d_state.sums)
+    {
+        sums.push_back(sum.r);
+        sums.push_back(sum.g);
+        sums.push_back(sum.b);
+    }
+
+    string tmpname = filename + ".tmp";
+    {
+        ofstream out(tmpname, ios::binary);
+        out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        out.write(reinterpret_cast<char const *>(d_state.tiles.data()), d_state.tiles.size());
+        out.write(reinterpret_cast<char const *>(img.pixels<Image::RGB32F>()), img.bytes());
+        out.write(reinterpret_cast<char const *>(sums.data()), sums.size() * sizeof(Real));
+        out.close();
+        if (!out)
+        {
+            remove(tmpname.c_str());
+            throw runtime_error("Could not write checkpoint " + tmpname);
+        }
+    }
+    if (rename(tmpname.c_str(), filename.c_str()) != 0)
+    {
+        remove(tmpname.c_str());
+        throw runtime_error("Could not rename " + tmpname + " to " + filename);
+    }
+}
+
+Checkpoint Checkpoint::read(string const &filename)
+{
+    ifstream in(filename, ios::binary);
+    if (!in)
+        throw runtime_error("Could not open checkpoint " + filename);
+
+    Header header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))
+        || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw runtime_error(filename + " is not a checkpoint");
+    if (header.version != VERSION || header.realSize != sizeof(Real))
+        throw runtime_error(filename + " was written by another version of ray");
+    // render has a done flag per tile, renderProgressive a sum per pixel
+    Checkpoint::Fingerprint const &render = header.fingerprint;
+    bool progressive = render.progressive != 0;
+    if (header.imageWidth != render.width || header.imageHeight != render.height
+        || header.numTiles != (progressive ? 0 : Scene::numTiles(render.width, render.height))
+        || header.numSums != (progressive ? uint64_t(render.width) * render.height : 0))
+        throw runtime_error(filename + " is damaged");
+
+    Scene::RenderState state;
+    state.samples = header.samples;
+    state.tiles.resize(header.numTiles);
+    state.image = Image(header.imageWidth, header.imageHeight);
+    vector<Real> sums(3 * header.numSums);
+    if (!in.read(reinterpret_cast<char *>(state.tiles.data()), state.tiles.size())
+        || !in.read(reinterpret_cast<char *>(state.image.pixels<Image::RGB32F>()), state.image.bytes())
+        || !in.read(reinterpret_cast<char *>(sums.data()), sums.size() * sizeof(Real)))
+        throw runtime_error(filename + " is truncated");
+
+    state.sums.resize(header.numSums);
+    for (size_t idx = 0; idx != state.sums.size(); ++idx)
+        state.sums[idx] = Color(sums[3 * idx], sums[3 * idx + 1], sums[3 * idx + 2]);
+    return Checkpoint(header.fingerprint, move(state));
+}
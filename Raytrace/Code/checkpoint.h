@@ -0,0 +1,54 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include "scene.h"
+
+#include <cstdint>
+#include <string>
+
+// The state of an unfinished render (Scene::RenderState) saved to a file,
+// with a fingerprint of the render it belongs to: the hash of the scene
+// file and the settings of the command line which change the image. A
+// checkpoint is only resumed by a render with the same fingerprint.
+//
+// The file holds a header, the done flags of the tiles, the pixels of the
+// image (RGB32F) and, of progressive renders, the sums of the samples (as
+// Real, whose size is in the header), in the byte order of the machine.
+class Checkpoint
+{
+    public:
+        struct Fingerprint
+        {
+            uint64_t sceneHash;
+            uint32_t textureFilter;
+            uint32_t progressive;       // 1 for renderProgressive
+            uint32_t width;
+            uint32_t height;
+            uint32_t x0, y0, x1, y1;    // Scene::region
+
+            bool operator==(Fingerprint const &other) const;
+            bool operator!=(Fingerprint const &other) const;
+        };
+
+    private:
+        Fingerprint d_fingerprint;
+        Scene::RenderState d_state;
+
+    public:
+        Checkpoint(Fingerprint const &fingerprint, Scene::RenderState state);
+
+        Fingerprint const &fingerprint() const;
+        Scene::RenderState const &state() const;
+        Scene::RenderState &state();
+
+        // Writes to filename.tmp first and renames that to filename, so
+        // an interrupted write leaves the previous checkpoint intact
+        // @throws std::runtime_error if the file cannot be written
+        void write(std::string const &filename) const;
+
+        // @throws std::runtime_error if the file cannot be read or is not
+        // a checkpoint (of this build)
+        static Checkpoint read(std::string const &filename);
+};
+
+#endif
@@ -0,0 +1,34 @@
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+bool cpu::hasSSE41() {
+    static bool const supported = __builtin_cpu_supports("sse4.1");
+    return supported;
+}
+
+bool cpu::hasAVX() {
+    static bool const supported = __builtin_cpu_supports("avx");
+    return supported;
+}
+
+bool cpu::hasAVX2() {
+    static bool const supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+#else
+
+bool cpu::hasSSE41() {
+    return false;
+}
+
+bool cpu::hasAVX() {
+    return false;
+}
+
+bool cpu::hasAVX2() {
+    return false;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef CPU_H_
+#define CPU_H_
+
+// Runtime detection of the instruction set extensions used by the SIMD
+// kernels. All functions return false on non-x86 machines.
+namespace cpu {
+    bool hasSSE41();
+    bool hasAVX();
+    bool hasAVX2();
+}
+
+#endif //CPU_H_
@@ -1,4 +1,4 @@
 #include "debug.h"
 
-unsigned currentX = 0;
-unsigned currentY = 0;
+thread_local unsigned currentX = 0;
+thread_local unsigned currentY = 0;
@@ -1,7 +1,8 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
-extern unsigned currentX;
-extern unsigned currentY;
+// Pixel currently traced by the calling thread
+extern thread_local unsigned currentX;
+extern thread_local unsigned currentY;
 
 #endif
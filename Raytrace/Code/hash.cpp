@@ -0,0 +1,35 @@
+#include "hash.h"
+
+#include <cstring>
+
+using namespace std;
+
+uint64_t contentHash(char const *begin, char const *end)
+{
+    uint64_t const PRIME = 0x9e3779b97f4a7c15ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL ^ static_cast<uint64_t>(end - begin);
+
+    auto mix = [&](uint64_t word)
+    {
+        hash = ((hash << 29 | hash >> 35) ^ word) * PRIME;
+    };
+
+    char const *pos = begin;
+    for (; end - pos >= 8; pos += 8)
+    {
+        uint64_t word;
+        memcpy(&word, pos, 8);
+        mix(word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, pos, end - pos);
+    mix(tail);
+
+    // final avalanche (MurmurHash3 fmix64)
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
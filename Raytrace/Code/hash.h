@@ -0,0 +1,11 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <cstdint>
+
+// 64-bit hash of the bytes in [begin, end), processed a word at a time.
+// Good enough to tell files apart (meshes in the mesh cache, the scenes of
+// tiles), not meant to resist tampering.
+uint64_t contentHash(char const *begin, char const *end);
+
+#endif
@@ -7,21 +7,37 @@
 class Hit
 {
     public:
-        double t;   // distance of hit
+        Real t;   // distance of hit
         Vector N;   // Normal at hit
 
-        Hit(double time, Vector const &normal)
+        // Triangle of a mesh that was hit and the barycentric coordinates
+        // of its first and second corner, for mapTexture. Other shapes do
+        // not use them.
+        unsigned primitive = 0;
+        Real u = 0;
+        Real v = 0;
+
+        Hit(Real time, Vector const &normal)
         :
             t(time),
             N(normal)
         {}
 
+        Hit(Real time, Vector const &normal, unsigned primitive, Real u, Real v)
+        :
+            t(time),
+            N(normal),
+            primitive(primitive),
+            u(u),
+            v(v)
+        {}
+
         static Hit const NO_HIT()
         {
-            static Hit no_hit(std::numeric_limits<double>::quiet_NaN(),
-                              Vector(std::numeric_limits<double>::quiet_NaN(),
-                                     std::numeric_limits<double>::quiet_NaN(),
-                                     std::numeric_limits<double>::quiet_NaN()));
+            static Hit no_hit(std::numeric_limits<Real>::quiet_NaN(),
+                              Vector(std::numeric_limits<Real>::quiet_NaN(),
+                                     std::numeric_limits<Real>::quiet_NaN(),
+                                     std::numeric_limits<Real>::quiet_NaN()));
             return no_hit;
         }
 };
@@ -1,19 +1,83 @@
 #include "image.h"
 
+#include "imagewriter.h"
 #include "lode/lodepng.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
 
 using namespace std;
 
-Image::Image(unsigned width, unsigned height)
+namespace
+{
+    // Conversions between float and IEEE 754 half precision, rounding to
+    // nearest even. Values beyond the half range become infinity.
+    uint16_t floatToHalf(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof bits);
+        uint16_t sign = (bits >> 16) & 0x8000;
+        bits &= 0x7fffffff;
+
+        if (bits >= 0x7f800000)                     // inf and nan
+            return sign | 0x7c00 | (bits > 0x7f800000 ? 0x200 : 0);
+        if (bits >= 0x477ff000)                     // rounds to >= 2^16
+            return sign | 0x7c00;
+        if (bits < 0x38800000)                      // below 2^-14: subnormal
+            return sign | static_cast<uint16_t>(nearbyintf(fabsf(value) * 16777216.0f));
+
+        uint32_t half = ((bits >> 23) - 127 + 15) << 10 | (bits & 0x7fffff) >> 13;
+        uint32_t rest = bits & 0x1fff;
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+            ++half;                                 // may carry into the exponent
+        return sign | half;
+    }
+
+    float halfToFloat(uint16_t half)
+    {
+        uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+        uint32_t exponent = (half >> 10) & 0x1f;
+        uint32_t mantissa = half & 0x3ff;
+
+        if (exponent == 0)                          // zero and subnormals
+        {
+            float value = mantissa / 16777216.0f;
+            return sign ? -value : value;
+        }
+
+        uint32_t bits = exponent == 0x1f
+            ? sign | 0x7f800000 | mantissa << 13    // inf and nan
+            : sign | (exponent - 15 + 127) << 23 | mantissa << 13;
+        float value;
+        memcpy(&value, &bits, sizeof value);
+        return value;
+    }
+
+    // Channel of an RGBA8 pixel: clamped to [0, 1] and truncated, as the
+    // PNG writer quantizes. NaN becomes 0.
+    uint8_t toByte(double value)
+    {
+        return static_cast<uint8_t>(value >= 0 ? min(value, 1.0) * 255.0 : 0);
+    }
+}
+
+Image::Image(unsigned width, unsigned height, Format format)
 :
-    d_pixels(width * height),
+    d_pixels(static_cast<size_t>(width) * height * pixelSize(format)),
     d_width(width),
-    d_height(height)
+    d_height(height),
+    d_format(format)
 {}
 
 Image::Image(string const &filename)
+:
+    d_width(0),
+    d_height(0),
+    d_format(Format::RGBA8)
 {
     read_png(filename);
 }
@@ -21,23 +85,36 @@ Image::Image(string const &filename)
 // normal accessors
 void Image::put_pixel(unsigned x, unsigned y, Color const &c)
 {
-    (*this)(x, y) = c;
-}
-Color Image::get_pixel(unsigned x, unsigned y) const
-{
-    return (*this)(x, y);
-}
+    if (x >= d_width || y >= d_height)
+        throw out_of_range("pixel outside the image");
 
-// Handier accessors
-// Usage: color = img(x,y);
-//        img(x,y) = color;
-Color const&Image::operator()(unsigned x, unsigned y) const
-{
-    return d_pixels.at(index(x, y));
+    unsigned idx = index(x, y);
+    switch (d_format)
+    {
+        case Format::RGBA8:
+            pixels<RGBA8>()[idx] = RGBA8{
+                toByte(c.r), toByte(c.g), toByte(c.b),
+                255
+            };
+            break;
+        case Format::RGB16F:
+            pixels<RGB16F>()[idx] = RGB16F{
+                floatToHalf(c.r), floatToHalf(c.g), floatToHalf(c.b)
+            };
+            break;
+        case Format::RGB32F:
+            pixels<RGB32F>()[idx] = RGB32F{
+                static_cast<float>(c.r), static_cast<float>(c.g), static_cast<float>(c.b)
+            };
+            break;
+    }
 }
-Color &Image::operator()(unsigned x, unsigned y)
+
+Color Image::get_pixel(unsigned x, unsigned y) const
 {
-    return d_pixels.at(index(x, y));
+    if (x >= d_width || y >= d_height)
+        throw out_of_range("pixel outside the image");
+    return color(index(x, y));
 }
 
 unsigned Image::width() const
@@ -55,45 +132,82 @@ unsigned Image::size() const
     return d_width * d_height;
 }
 
+Image::Format Image::format() const
+{
+    return d_format;
+}
+
+size_t Image::bytes() const
+{
+    return d_pixels.size();
+}
+
 // Normalized accessors, unsignederval is (0...1, 0...1)
 // usefull for texture access
-Color const &Image::colorAt(float x, float y) const
+Color Image::colorAt(float x, float y) const
 {
-    return d_pixels.at(findex(x, y));
+    unsigned idx = findex(x, y);
+    if (idx >= size())
+        throw out_of_range("texture coordinate outside the image");
+    return color(idx);
 }
 
 void Image::write_png(std::string const &filename) const
 {
-    vector<unsigned char> image;
-    image.reserve(size() * 4);  // reserves size (less allocations)
-    for (Color pixel : d_pixels)
-    {
-        image.push_back(static_cast<unsigned char>(pixel.r * 255.0));
-        image.push_back(static_cast<unsigned char>(pixel.g * 255.0));
-        image.push_back(static_cast<unsigned char>(pixel.b * 255.0));
-        image.push_back(255);   // alpha is always 1
-    }
-
-    lodepng::encode(filename, image, d_width, d_height);
+    ImageWriter(ImageWriter::Format::PNG).write(*this, filename);
 }
 
 void Image::read_png(std::string const &filename)
 {
-    vector<unsigned char> image;
-    lodepng::decode(image, d_width, d_height, filename);
-    d_pixels.reserve(size());
+    // The decoded RGBA bytes are stored as they are, they are only
+    // converted to colors when sampled
+    d_pixels.clear();
+    d_format = Format::RGBA8;
+    lodepng::decode(d_pixels, d_width, d_height, filename);
+    d_pixels.shrink_to_fit();
+}
 
-    auto imgIter = image.begin();
-    while (imgIter != image.end())
+size_t Image::pixelSize(Format format)
+{
+    switch (format)
     {
-        double r = (*imgIter) / 255.0;
-        ++imgIter;
-        double g = (*imgIter) / 255.0;
-        ++imgIter;
-        double b = (*imgIter) / 255.0;
-        ++imgIter;
-        // Ignore Alpha
-        ++imgIter;
-        d_pixels.push_back(Color(r, g, b));
+        case Format::RGBA8:
+            return sizeof(RGBA8);
+        case Format::RGB16F:
+            return sizeof(RGB16F);
+        case Format::RGB32F:
+            return sizeof(RGB32F);
     }
+    throw logic_error("unknown pixel format");
+}
+
+// Color of the pixel at index idx, conversions as the former read_png
+// (channel / 255.0) and write_png
+Color Image::color(unsigned idx) const
+{
+    switch (d_format)
+    {
+        case Format::RGBA8:
+        {
+            RGBA8 const &pixel = pixels<RGBA8>()[idx];
+            return Color(pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0);
+        }
+        case Format::RGB16F:
+        {
+            RGB16F const &pixel = pixels<RGB16F>()[idx];
+            return Color(halfToFloat(pixel.r), halfToFloat(pixel.g), halfToFloat(pixel.b));
+        }
+        case Format::RGB32F:
+        {
+            RGB32F const &pixel = pixels<RGB32F>()[idx];
+            return Color(pixel.r, pixel.g, pixel.b);
+        }
+    }
+    throw logic_error("unknown pixel format");
+}
+
+void Image::checkFormat(Format format) const
+{
+    if (format != d_format)
+        throw logic_error("pixels accessed in another format than stored");
 }
@@ -3,37 +3,71 @@
 
 #include "triple.h"
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
+// Image stored in one of several pixel formats. Textures read from PNG
+// files keep their 8-bit channels, rendered images use floats. Pixels are
+// converted from and to Color when they are accessed as colors; code that
+// knows the format can work on the stored pixels through pixels<Pixel>().
 class Image
 {
-    std::vector<Color> d_pixels;
-    unsigned d_width;
-    unsigned d_height;
+    public:
+        enum class Format
+        {
+            RGBA8,      // 8 bits per channel, with alpha (PNG textures)
+            RGB16F,     // half floats
+            RGB32F      // floats (rendered images)
+        };
+
+        // Stored pixel of each format
+        struct RGBA8
+        {
+            uint8_t r, g, b, a;
+        };
+        struct RGB16F
+        {
+            uint16_t r, g, b;       // IEEE 754 half precision
+        };
+        struct RGB32F
+        {
+            float r, g, b;
+        };
+
+    private:
+        std::vector<unsigned char> d_pixels;
+        unsigned d_width;
+        unsigned d_height;
+        Format d_format;
 
     public:
-        Image(unsigned width = 0, unsigned height = 0);
-        Image(std::string const &filename);
+        Image(unsigned width = 0, unsigned height = 0, Format format = Format::RGB32F);
+        Image(std::string const &filename);     // stored as RGBA8
 
-        // normal accessors
+        // normal accessors, converting to and from the format
         void put_pixel(unsigned x, unsigned y, Color const &c);
         Color get_pixel(unsigned x, unsigned y) const;
 
-        // Handier accessors
-        // Usage: color = img(x,y);
-        //        img(x,y) = color;
-        Color const &operator()(unsigned x, unsigned y) const;
-        Color &operator()(unsigned x, unsigned y);
+        // Typed access to the stored pixels, row by row. Pixel must be the
+        // type of format(), otherwise std::logic_error is thrown.
+        template <typename Pixel>
+        Pixel const *pixels() const;
+        template <typename Pixel>
+        Pixel *pixels();
 
         unsigned width() const;
         unsigned height() const;
         unsigned size() const;
 
+        Format format() const;
+        size_t bytes() const;                   // memory used by the pixels
+
         // Normalized accessors, unsignederval is (0...1, 0...1)
         // usefull for texture access
-        Color const &colorAt(float x, float y) const;
+        Color colorAt(float x, float y) const;
 
+        // with the default settings of ImageWriter, see there for others
         void write_png(std::string const &filename) const;
         void read_png(std::string const &filename);
 
@@ -50,6 +84,45 @@ class Image
                 static_cast<unsigned>(y * (d_height - 1)));
         }
 
+        static size_t pixelSize(Format format);
+
+        template <typename Pixel>
+        static Format formatOf();
+
+        Color color(unsigned idx) const;
+        void checkFormat(Format format) const;
 };
 
+template <>
+inline Image::Format Image::formatOf<Image::RGBA8>()
+{
+    return Format::RGBA8;
+}
+
+template <>
+inline Image::Format Image::formatOf<Image::RGB16F>()
+{
+    return Format::RGB16F;
+}
+
+template <>
+inline Image::Format Image::formatOf<Image::RGB32F>()
+{
+    return Format::RGB32F;
+}
+
+template <typename Pixel>
+Pixel const *Image::pixels() const
+{
+    checkFormat(formatOf<Pixel>());
+    return reinterpret_cast<Pixel const *>(d_pixels.data());
+}
+
+template <typename Pixel>
+Pixel *Image::pixels()
+{
+    checkFormat(formatOf<Pixel>());
+    return reinterpret_cast<Pixel *>(d_pixels.data());
+}
+
 #endif
@@ -0,0 +1,388 @@
+#include "imagewriter.h"
+
+#include "image.h"
+#include "threadpool.h"
+
+#include "lode/lodepng.h"
+
+#ifdef RAY_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    inline unsigned char quantizeChannel(double value)
+    {
+        // as the former write_png (truncation), NaN becomes 0
+        double scaled = value * 255.0;
+        return static_cast<unsigned char>(scaled >= 0 ? min(scaled, 255.0) : 0);
+    }
+
+    void quantizeFloats(float const *in, unsigned char *out, size_t count)
+    {
+        size_t idx = 0;
+#ifdef __SSE2__
+        // In doubles, so the result is that of the scalar code. maxpd
+        // returns its second operand for NaN.
+        __m128d const scale = _mm_set1_pd(255.0);
+        __m128d const zero = _mm_setzero_pd();
+        auto convert = [&](__m128 values)
+        {
+            __m128d low = _mm_mul_pd(_mm_cvtps_pd(values), scale);
+            __m128d high = _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(values, values)), scale);
+            low = _mm_min_pd(_mm_max_pd(low, zero), scale);
+            high = _mm_min_pd(_mm_max_pd(high, zero), scale);
+            return _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+        };
+        for (; idx + 8 <= count; idx += 8)
+        {
+            __m128i words = _mm_packs_epi32(convert(_mm_loadu_ps(in + idx)),
+                                            convert(_mm_loadu_ps(in + idx + 4)));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(out + idx), _mm_packus_epi16(words, words));
+        }
+#endif
+        for (; idx != count; ++idx)
+            out[idx] = quantizeChannel(in[idx]);
+    }
+
+    [[noreturn]] void writeError(string const &filename)
+    {
+        throw runtime_error("Could not write " + filename);
+    }
+
+#ifdef RAY_HAVE_ZLIB
+    // Filtered rows are cut into blocks of at least this many bytes
+    size_t const MIN_BLOCK_SIZE = 128 * 1024;
+
+    struct DeflateSettings
+    {
+        unsigned level;
+        unsigned threads;
+        size_t rowBytes;            // filter byte and pixels of a row
+    };
+
+    // Deflates one block as raw deflate data. All blocks but the last
+    // end with a full flush (an empty stored block), which ends them on a
+    // byte boundary, so the blocks can be concatenated.
+    vector<unsigned char> deflateBlock(unsigned char const *in, size_t size, unsigned level, bool last)
+    {
+        z_stream stream;
+        memset(&stream, 0, sizeof stream);
+        if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw runtime_error("deflateInit2 failed");
+
+        vector<unsigned char> out(deflateBound(&stream, size) + 16);
+        stream.next_in = const_cast<unsigned char *>(in);
+        stream.avail_in = size;
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        int status = deflate(&stream, last ? Z_FINISH : Z_FULL_FLUSH);
+        out.resize(out.size() - stream.avail_out);
+        deflateEnd(&stream);
+        if (status != (last ? Z_STREAM_END : Z_OK) || stream.avail_in != 0)
+            throw runtime_error("deflate failed");
+        return out;
+    }
+
+    // custom_zlib of lodepng: the zlib stream of the filtered rows, made
+    // of blocks deflated in parallel
+    unsigned deflateRows(unsigned char **out, size_t *outsize, unsigned char const *in, size_t insize,
+                         LodePNGCompressSettings const *lodeSettings)
+    try
+    {
+        DeflateSettings const &settings = *static_cast<DeflateSettings const *>(lodeSettings->custom_context);
+
+        unsigned threads = settings.threads == 0 ? ThreadPool::hardwareThreads() : settings.threads;
+        size_t rows = insize / settings.rowBytes;
+        size_t rowsPerBlock = max<size_t>((MIN_BLOCK_SIZE + settings.rowBytes - 1) / settings.rowBytes, 1);
+        unsigned numBlocks = threads > 1 ? max<size_t>((rows + rowsPerBlock - 1) / rowsPerBlock, 1) : 1;
+        if (numBlocks == 1)
+            rowsPerBlock = rows;
+
+        vector<vector<unsigned char>> blocks(numBlocks);
+        vector<uLong> checksums(numBlocks);
+        auto blockBegin = [&](unsigned idx)
+        {
+            return idx == numBlocks ? insize : idx * rowsPerBlock * settings.rowBytes;
+        };
+        auto task = [&](unsigned idx)
+        {
+            size_t size = blockBegin(idx + 1) - blockBegin(idx);
+            blocks[idx] = deflateBlock(in + blockBegin(idx), size, settings.level, idx + 1 == numBlocks);
+            checksums[idx] = adler32(adler32(0, nullptr, 0), in + blockBegin(idx), size);
+        };
+        if (numBlocks == 1)
+            task(0);
+        else
+        {
+            ThreadPool pool(min(threads, numBlocks));
+            pool.run(numBlocks, task);
+        }
+
+        // zlib header (deflate, 32K window), the blocks and the Adler-32
+        // checksum of all data
+        uLong checksum = checksums[0];
+        size_t total = 2 + blocks[0].size() + 4;
+        for (unsigned idx = 1; idx != numBlocks; ++idx)
+        {
+            checksum = adler32_combine(checksum, checksums[idx], blockBegin(idx + 1) - blockBegin(idx));
+            total += blocks[idx].size();
+        }
+
+        unsigned char *data = static_cast<unsigned char *>(malloc(total));  // freed by lodepng
+        if (!data)
+            return 83;                              // lodepng: allocation failed
+        unsigned char *pos = data;
+        *pos++ = 0x78;
+        *pos++ = 0x9c;
+        for (vector<unsigned char> const &block : blocks)
+            pos = copy(block.begin(), block.end(), pos);
+        for (int shift = 24; shift >= 0; shift -= 8)
+            *pos++ = static_cast<unsigned char>(checksum >> shift);
+
+        *out = data;
+        *outsize = total;
+        return 0;
+    }
+    catch (exception const &)
+    {
+        return 111;                                 // not used by lodepng
+    }
+#endif
+}
+
+ImageWriter::ImageWriter(Format format, unsigned compression, unsigned threads)
+:
+    d_format(format),
+    d_compression(min(compression, 9U)),
+    d_threads(threads)
+{}
+
+ImageWriter::Format ImageWriter::format() const
+{
+    return d_format;
+}
+
+void ImageWriter::format(Format format)
+{
+    d_format = format;
+}
+
+unsigned ImageWriter::compression() const
+{
+    return d_compression;
+}
+
+void ImageWriter::compression(unsigned level)
+{
+    d_compression = min(level, 9U);
+}
+
+unsigned ImageWriter::threads() const
+{
+    return d_threads;
+}
+
+void ImageWriter::threads(unsigned count)
+{
+    d_threads = count;
+}
+
+ImageWriter::Format ImageWriter::format(string const &filename) const
+{
+    if (d_format != Format::AUTO)
+        return d_format;
+
+    size_t dot = filename.find_last_of('.');
+    string ext = dot == string::npos ? "" : filename.substr(dot);
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".ppm")
+        return Format::PPM;
+    if (ext == ".pfm")
+        return Format::PFM;
+    return Format::PNG;
+}
+
+void ImageWriter::write(Image const &img, string const &filename) const
+{
+    write(img, filename, format(filename));
+}
+
+void ImageWriter::write(Image const &img, string const &filename, Format format) const
+{
+    switch (format)
+    {
+        case Format::AUTO:
+        case Format::PNG:
+            writePng(img, filename);
+            break;
+        case Format::PPM:
+            writePpm(img, filename);
+            break;
+        case Format::PFM:
+            writePfm(img, filename);
+            break;
+    }
+}
+
+ImageWriter::Format ImageWriter::parseFormat(string const &name)
+{
+    if (name == "png")
+        return Format::PNG;
+    if (name == "ppm")
+        return Format::PPM;
+    if (name == "pfm")
+        return Format::PFM;
+    throw invalid_argument("Unknown image format '" + name + "'.");
+}
+
+string ImageWriter::extension(Format format)
+{
+    switch (format)
+    {
+        case Format::PPM:
+            return ".ppm";
+        case Format::PFM:
+            return ".pfm";
+        default:
+            return ".png";
+    }
+}
+
+vector<unsigned char> ImageWriter::quantize(Image const &img)
+{
+    size_t count = static_cast<size_t>(img.size()) * 3;
+    vector<unsigned char> out(count);
+    switch (img.format())
+    {
+        case Image::Format::RGB32F:
+            static_assert(sizeof(Image::RGB32F) == 3 * sizeof(float), "RGB32F is not packed");
+            quantizeFloats(reinterpret_cast<float const *>(img.pixels<Image::RGB32F>()), out.data(), count);
+            break;
+
+        case Image::Format::RGBA8:
+        {
+            Image::RGBA8 const *pixels = img.pixels<Image::RGBA8>();
+            for (size_t idx = 0; idx != img.size(); ++idx)
+            {
+                out[3 * idx] = pixels[idx].r;
+                out[3 * idx + 1] = pixels[idx].g;
+                out[3 * idx + 2] = pixels[idx].b;
+            }
+            break;
+        }
+
+        default:
+            for (unsigned y = 0; y != img.height(); ++y)
+                for (unsigned x = 0; x != img.width(); ++x)
+                {
+                    Color c = img.get_pixel(x, y);
+                    size_t idx = (static_cast<size_t>(y) * img.width() + x) * 3;
+                    out[idx] = quantizeChannel(c.r);
+                    out[idx + 1] = quantizeChannel(c.g);
+                    out[idx + 2] = quantizeChannel(c.b);
+                }
+    }
+    return out;
+}
+
+void ImageWriter::writePng(Image const &img, string const &filename) const
+{
+    // Images read from PNG files keep their alpha channel, rendered images
+    // are opaque and written as RGB
+    bool const alpha = img.format() == Image::Format::RGBA8;
+    LodePNGColorType const type = alpha ? LCT_RGBA : LCT_RGB;
+
+    lodepng::State state;
+    state.info_raw.colortype = type;
+    state.info_png.color.colortype = type;
+    state.encoder.auto_convert = 0;
+    if (d_compression == 0)
+        state.encoder.filter_strategy = LFS_ZERO;
+
+#ifdef RAY_HAVE_ZLIB
+    DeflateSettings settings{d_compression, d_threads, 1 + img.width() * (alpha ? 4U : 3U)};
+    state.encoder.zlibsettings.custom_zlib = deflateRows;
+    state.encoder.zlibsettings.custom_context = &settings;
+#else
+    // The deflate of lodepng, its window and match lengths grow with the
+    // level
+    LodePNGCompressSettings &zlib = state.encoder.zlibsettings;
+    if (d_compression == 0)
+    {
+        zlib.btype = 0;
+        zlib.use_lz77 = 0;
+    }
+    else
+    {
+        zlib.windowsize = min(256U << (d_compression - 1), 32768U);
+        zlib.nicematch = d_compression <= 3 ? 32 : d_compression <= 6 ? 128 : 258;
+        zlib.lazymatching = d_compression >= 4;
+    }
+#endif
+
+    vector<unsigned char> png;
+    unsigned error = alpha
+        ? lodepng::encode(png, reinterpret_cast<unsigned char const *>(img.pixels<Image::RGBA8>()), img.width(), img.height(), state)
+        : lodepng::encode(png, quantize(img), img.width(), img.height(), state);
+    if (error)
+        throw runtime_error("Could not encode " + filename + ": " + lodepng_error_text(error));
+    if (lodepng::save_file(png, filename) != 0)
+        writeError(filename);
+}
+
+void ImageWriter::writePpm(Image const &img, string const &filename) const
+{
+    ofstream file(filename, ios::binary);
+    if (!file)
+        writeError(filename);
+    file << "P6\n" << img.width() << ' ' << img.height() << "\n255\n";
+    vector<unsigned char> pixels = quantize(img);
+    file.write(reinterpret_cast<char const *>(pixels.data()), pixels.size());
+    if (!file)
+        writeError(filename);
+}
+
+void ImageWriter::writePfm(Image const &img, string const &filename) const
+{
+    // A negative scale marks little endian floats
+    uint16_t const probe = 1;
+    bool const little = *reinterpret_cast<unsigned char const *>(&probe) == 1;
+
+    ofstream file(filename, ios::binary);
+    if (!file)
+        writeError(filename);
+    file << "PF\n" << img.width() << ' ' << img.height() << '\n' << (little ? "-1.0" : "1.0") << '\n';
+
+    // rows from the bottom up
+    vector<Image::RGB32F> row(img.width());
+    for (unsigned y = img.height(); y-- != 0; )
+    {
+        if (img.format() == Image::Format::RGB32F)
+            copy_n(img.pixels<Image::RGB32F>() + static_cast<size_t>(y) * img.width(), img.width(), row.begin());
+        else
+            for (unsigned x = 0; x != img.width(); ++x)
+            {
+                Color c = img.get_pixel(x, y);
+                row[x] = Image::RGB32F{static_cast<float>(c.r), static_cast<float>(c.g),
+                                       static_cast<float>(c.b)};
+            }
+        file.write(reinterpret_cast<char const *>(row.data()), row.size() * sizeof(Image::RGB32F));
+    }
+    if (!file)
+        writeError(filename);
+}
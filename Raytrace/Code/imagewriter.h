@@ -0,0 +1,70 @@
+#ifndef IMAGEWRITER_H_
+#define IMAGEWRITER_H_
+
+#include <string>
+#include <vector>
+
+class Image;
+
+// Writes images to files in one of several formats:
+// - PNG, deflated at the given compression level. When built with zlib
+//   the filtered rows are cut into blocks which are deflated on several
+//   threads and joined into one zlib stream (as pigz does); without zlib
+//   the encoder of lodepng is used, on one thread.
+// - PPM (binary P6), 8 bits per channel without compression, the
+//   fastest to write;
+// - PFM, the raw floats of the image (bottom row first, as the format
+//   prescribes), without any quantisation.
+class ImageWriter
+{
+    public:
+        enum class Format
+        {
+            AUTO,       // by the extension of the file name, PNG if unknown
+            PNG,
+            PPM,
+            PFM
+        };
+
+        // compression: 0 (none) to 9 (smallest), threads: 0 is one per core
+        explicit ImageWriter(Format format = Format::AUTO, unsigned compression = 6,
+                             unsigned threads = 0);
+
+        Format format() const;
+        void format(Format format);
+
+        unsigned compression() const;
+        void compression(unsigned level);
+
+        unsigned threads() const;
+        void threads(unsigned count);
+
+        // The format a file of this name is written in
+        Format format(std::string const &filename) const;
+
+        // @throws std::runtime_error if the file cannot be written
+        void write(Image const &img, std::string const &filename) const;
+        void write(Image const &img, std::string const &filename, Format format) const;
+
+        // Format named png, ppm or pfm
+        // @throws std::invalid_argument for another name
+        static Format parseFormat(std::string const &name);
+
+        // Extension (with dot) of the files of a format, not AUTO
+        static std::string extension(Format format);
+
+        // The pixels as 8-bit RGB, row by row: channels are clamped to
+        // [0, 1], scaled by 255 and truncated (using SSE2 for float images)
+        static std::vector<unsigned char> quantize(Image const &img);
+
+    private:
+        Format d_format;
+        unsigned d_compression;
+        unsigned d_threads;
+
+        void writePng(Image const &img, std::string const &filename) const;
+        void writePpm(Image const &img, std::string const &filename) const;
+        void writePfm(Image const &img, std::string const &filename) const;
+};
+
+#endif
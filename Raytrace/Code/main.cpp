@@ -1,44 +1,391 @@
 #include "raytracer.h"
+#include "renderfarm.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
 using namespace std;
 
+static void usage(char const *program)
+{
+    cerr << "Usage: " << program << " [options] in-file [out-file.png]\n"
+         << "       " << program << " [options] --region x0,y0,x1,y1 in-file [out-file.tile]\n"
+         << "       " << program << " [options] --tile i/N in-file [out-file.tile]\n"
+         << "       " << program << " [options] --batch in-file...\n"
+         << "       " << program << " [options] --coordinate address in-file [out-file.png]\n"
+         << "       " << program << " [options] --serve address\n"
+         << "Options:\n"
+         << "  --threads N       number of render and PNG encoding threads (default:\n"
+         << "                    one per core)\n"
+         << "  --packet-size N   trace primary rays in packets of N (4, 8 or 16)\n"
+         << "  --progressive S   render in passes, writing the image every S seconds\n"
+         << "  --texture-filter F  filter textures with F: nearest (default),\n"
+         << "                    bilinear or trilinear (mip-mapped)\n"
+         << "  --format F        write the image as png, ppm or pfm (default: by the\n"
+         << "                    extension of out-file, png)\n"
+         << "  --compression N   PNG compression level, 0 (fastest) to 9 (default: 6)\n"
+         << "  --heatmap COST    also write the cost of every pixel, COST is tests\n"
+         << "                    (intersection tests) or time (nanoseconds)\n"
+         << "  --mesh-cache DIR  keep parsed meshes in DIR (default: $RAY_MESH_CACHE\n"
+         << "                    or ~/.cache/ray/meshes)\n"
+         << "  --no-mesh-cache   always parse meshes\n"
+         << "  --batch           render every in-file (e.g. the frames of an\n"
+         << "                    animation) in one process, next to its scene\n"
+         << "  --incremental     with --batch: only trace the pixels of a frame which\n"
+         << "                    depend on objects that look different than in the\n"
+         << "                    frame before\n"
+         << "  --region x0,y0,x1,y1  only render the pixels x0 <= x < x1, y0 <= y < y1\n"
+         << "                    and write them as a tile (see ray_merge)\n"
+         << "  --tile i/N        only render the i-th (from 0) of N horizontal bands\n"
+         << "                    and write it as a tile (see ray_merge)\n"
+         << "  --coordinate A    render with the workers connecting to address A:\n"
+         << "                    unix:PATH, HOST:PORT or PORT (on 127.0.0.1)\n"
+         << "  --serve A         work for the coordinator at address A, rendering the\n"
+         << "                    tiles it hands out until it is done\n"
+         << "  --tile-size N     with --coordinate: tiles of N x N pixels (default: 64)\n"
+         << "  --checkpoint S    save the state of the render to out-file.checkpoint\n"
+         << "                    every S seconds, removed when the image is written\n"
+         << "  --resume          continue from out-file.checkpoint, if it exists\n";
+}
+
+// Options of the command line which apply to every scene
+struct Settings
+{
+    int threads = -1;           // -1: use the value of the scene file
+    int packetSize = -1;
+    double progressInterval = -1;   // < 0: no progressive rendering
+    Scene::Cost heatmap = Scene::Cost::NONE;
+    string textureFilter;       // empty: use the value of the scene file
+    string meshCache = MeshCache::defaultDirectory();
+    ImageWriter writer;
+    bool incremental = false;
+    string tile;                // tile name suffix, empty: render whole images
+    Scene::Region region{0, 0, 0, 0};
+    unsigned tileIndex = 0;
+    unsigned tileCount = 0;     // 0: region
+    double checkpointInterval = -1;     // < 0: no checkpoints
+    bool resume = false;
+
+    // applied after reading the scene, they override its keys
+    void configure(Raytracer &raytracer) const
+    {
+        if (threads >= 0)
+            raytracer.threads(threads);
+        if (packetSize >= 1)
+            raytracer.packetSize(packetSize);
+        if (progressInterval >= 0)
+            raytracer.progressive(progressInterval);
+        if (!textureFilter.empty())
+            raytracer.textureFilter(Texture::filter(textureFilter));
+        raytracer.heatmap(heatmap);
+        raytracer.imageWriter(writer);
+        raytracer.incremental(incremental);
+        if (checkpointInterval >= 0)
+            raytracer.checkpoint(checkpointInterval);
+        raytracer.resume(resume);
+        if (tileCount != 0)
+            raytracer.tile(tileIndex, tileCount);
+        else if (!tile.empty())
+            raytracer.region(region);
+    }
+
+    // the scene file with .json replaced by .png (or .ppm, .pfm), or by
+    // the tile: scene.0-of-4.tile, scene.0-0-200-100.tile
+    string outputName(string const &ifname) const
+    {
+        string ofname = ifname;
+        ofname.erase(ofname.begin() + ofname.find_last_of('.'), ofname.end());
+        if (!tile.empty())
+            return ofname + '.' + tile + ".tile";
+        ofname += writer.format() == ImageWriter::Format::AUTO
+            ? ".png" : ImageWriter::extension(writer.format());
+        return ofname;
+    }
+};
+
+static unique_ptr<Raytracer> loadScene(string const &ifname, Settings const &settings)
+{
+    unique_ptr<Raytracer> raytracer(new Raytracer);
+    raytracer->meshCache(settings.meshCache);
+    if (!raytracer->readScene(ifname))
+    {
+        cerr << "Error: reading scene from " << ifname <<
+            " failed - no output generated.\n";
+        return nullptr;
+    }
+    settings.configure(*raytracer);
+    return raytracer;
+}
+
+// Renders the scenes one after the other in a pipeline: while frame N is
+// rendered, the scene of frame N + 1 is read (and its BVH built) and the
+// image of frame N - 1 is written, each on a thread of its own. Textures
+// are decoded once for all frames (TextureCache), meshes are read from
+// the mesh cache. In incremental mode frames start from the image of the
+// frame before. A frame that fails is reported and skipped, the other
+// frames are still rendered.
+static int renderBatch(vector<string> const &files, Settings const &settings)
+{
+    auto load = [&](string const &ifname)
+    {
+        unique_ptr<Raytracer> raytracer = loadScene(ifname, settings);
+        if (raytracer)
+            raytracer->build();
+        return raytracer;
+    };
+
+    int status = 0;
+    auto fail = [&](string const &ifname, exception const &ex)
+    {
+        cerr << "Error: " << ifname << ": " << ex.what() << '\n';
+        status = 1;
+    };
+
+    future<void> writing;
+    string writingFile;             // the scene whose image is written
+    auto finishWriting = [&]
+    {
+        if (!writing.valid())
+            return;
+        try
+        {
+            writing.get();
+        }
+        catch (exception const &ex)
+        {
+            fail(writingFile, ex);
+        }
+    };
+
+    future<unique_ptr<Raytracer>> next = async(launch::async, load, files[0]);
+    shared_ptr<Raytracer const> previous;
+    shared_ptr<Image const> previousImage;
+    for (size_t idx = 0; idx != files.size(); ++idx)
+    {
+        shared_ptr<Raytracer> raytracer;
+        try
+        {
+            raytracer = next.get();
+        }
+        catch (exception const &ex)
+        {
+            fail(files[idx], ex);
+        }
+        if (idx + 1 != files.size())
+            next = async(launch::async, load, files[idx + 1]);
+        if (!raytracer)
+        {
+            status = 1;
+            continue;
+        }
+
+        string ofname = settings.outputName(files[idx]);
+        shared_ptr<Image> img = make_shared<Image>(400, 400);   // the size used by renderToFile
+        try
+        {
+            if (settings.incremental && previous)
+                raytracer->renderIncremental(*img, ofname, *previous, *previousImage);
+            else
+                raytracer->renderFrame(*img, ofname);
+        }
+        catch (exception const &ex)
+        {
+            fail(files[idx], ex);
+            continue;
+        }
+
+        finishWriting();
+        writingFile = files[idx];
+        writing = async(launch::async, [=]
+        {
+            raytracer->writeOutput(*img, ofname);
+            raytracer->removeCheckpoint(ofname);
+        });
+        previous = raytracer;
+        previousImage = img;
+    }
+    finishWriting();
+    return status;
+}
+
+// Renders the tiles a coordinator hands out (ray --coordinate), reading
+// their scenes with the settings of the command line
+static int serveTiles(string const &address, Settings const &settings)
+try
+{
+    Worker worker(address, [&](string const &ifname)
+    {
+        unique_ptr<Raytracer> raytracer = loadScene(ifname, settings);
+        if (raytracer)
+            raytracer->build();
+        return raytracer;
+    });
+    unsigned rendered = worker.serve();
+    cout << "Rendered " << rendered << " tiles, the coordinator is done.\n";
+    return 0;
+}
+catch (exception const &ex)
+{
+    cerr << "Error: " << ex.what() << '\n';
+    return 1;
+}
+
+// Renders the scene with the workers connecting to address (ray --serve)
+static int coordinateTiles(string const &address, Raytracer &raytracer, string const &ifname,
+                           string const &ofname, Settings const &settings, unsigned tileSize)
+{
+    Coordinator coordinator(address);
+    raytracer.build();
+    Image img(400, 400);    // the size used by renderToFile
+    coordinator.render(raytracer, ifname, img, tileSize);
+    cout << "Writing image to " << ofname << "...\n";
+    settings.writer.write(img, ofname);
+    cout << "Done.\n";
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     cout << "Introduction to Computer Graphics - Raytracer\n\n";
 
-    if (argc < 2 || argc > 3)
+    vector<string> files;
+    Settings settings;
+    bool batch = false;
+    string coordinate;
+    string serve;
+    unsigned tileSize = 64;
+    for (int idx = 1; idx < argc; ++idx)
     {
-        cerr << "Usage: " << argv[0] << "in-file [out-file.png]\n";
-        return 1;
+        string arg = argv[idx];
+        if (arg == "--threads" && idx + 1 < argc)
+        {
+            settings.threads = stoi(argv[++idx]);
+            if (settings.threads < 0)
+                settings.threads = 0;
+            settings.writer.threads(settings.threads);
+        }
+        else if (arg == "--packet-size" && idx + 1 < argc)
+        {
+            settings.packetSize = stoi(argv[++idx]);
+            if (settings.packetSize < 1)
+                settings.packetSize = 1;
+        }
+        else if (arg == "--progressive" && idx + 1 < argc)
+        {
+            settings.progressInterval = stod(argv[++idx]);
+            if (settings.progressInterval < 0)
+                settings.progressInterval = 0;
+        }
+        else if (arg == "--heatmap" && idx + 1 < argc
+                 && (argv[idx + 1] == string("tests") || argv[idx + 1] == string("time")))
+        {
+            settings.heatmap = argv[++idx] == string("tests") ? Scene::Cost::TESTS : Scene::Cost::TIME;
+        }
+        else if (arg == "--texture-filter" && idx + 1 < argc
+                 && (argv[idx + 1] == string("nearest") || argv[idx + 1] == string("bilinear")
+                     || argv[idx + 1] == string("trilinear")))
+            settings.textureFilter = argv[++idx];
+        else if (arg == "--format" && idx + 1 < argc
+                 && (argv[idx + 1] == string("png") || argv[idx + 1] == string("ppm")
+                     || argv[idx + 1] == string("pfm")))
+            settings.writer.format(ImageWriter::parseFormat(argv[++idx]));
+        else if (arg == "--compression" && idx + 1 < argc)
+            settings.writer.compression(max(0, stoi(argv[++idx])));
+        else if (arg == "--mesh-cache" && idx + 1 < argc)
+            settings.meshCache = argv[++idx];
+        else if (arg == "--no-mesh-cache")
+            settings.meshCache.clear();
+        else if (arg == "--batch")
+            batch = true;
+        else if (arg == "--incremental")
+            settings.incremental = true;
+        else if (arg == "--region" && idx + 1 < argc)
+        {
+            Scene::Region &rect = settings.region;
+            char end;
+            if (sscanf(argv[++idx], "%u,%u,%u,%u%c", &rect.x0, &rect.y0, &rect.x1, &rect.y1, &end) != 4
+                || rect.x0 >= rect.x1 || rect.y0 >= rect.y1)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            settings.tile = to_string(rect.x0) + '-' + to_string(rect.y0) + '-'
+                + to_string(rect.x1) + '-' + to_string(rect.y1);
+            settings.tileCount = 0;
+        }
+        else if (arg == "--tile" && idx + 1 < argc)
+        {
+            char end;
+            if (sscanf(argv[++idx], "%u/%u%c", &settings.tileIndex, &settings.tileCount, &end) != 2
+                || settings.tileIndex >= settings.tileCount)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            settings.tile = to_string(settings.tileIndex) + "-of-" + to_string(settings.tileCount);
+        }
+        else if (arg == "--coordinate" && idx + 1 < argc)
+            coordinate = argv[++idx];
+        else if (arg == "--serve" && idx + 1 < argc)
+            serve = argv[++idx];
+        else if (arg == "--checkpoint" && idx + 1 < argc)
+            settings.checkpointInterval = max(0.0, stod(argv[++idx]));
+        else if (arg == "--resume")
+            settings.resume = true;
+        else if (arg == "--tile-size" && idx + 1 < argc)
+            tileSize = max(1, stoi(argv[++idx]));
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            files.push_back(arg);
     }
 
-    Raytracer raytracer;
+    if (!serve.empty())
+    {
+        if (!files.empty() || batch || !coordinate.empty() || !settings.tile.empty())
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        return serveTiles(serve, settings);
+    }
 
-    // read the scene
-    if (!raytracer.readScene(argv[1]))
+    if (files.size() < 1 || (files.size() > 2 && !batch) || (batch && !settings.tile.empty())
+        || (!coordinate.empty() && (batch || !settings.tile.empty())))
     {
-        cerr << "Error: reading scene from " << argv[1] <<
-            " failed - no output generated.\n";
+        usage(argv[0]);
         return 1;
     }
 
+    if (batch)
+        return renderBatch(files, settings);
+
+    // read the scene
+    unique_ptr<Raytracer> raytracer = loadScene(files[0], settings);
+    if (!raytracer)
+        return 1;
+
     // determine output name
-    string ofname;
-    if (argc >= 3)
+    string ofname = files.size() >= 2 ? files[1] : settings.outputName(files[0]);
+    try
     {
-        ofname = argv[2];   // use the provided name
+        if (!coordinate.empty())
+            return coordinateTiles(coordinate, *raytracer, files[0], ofname, settings, tileSize);
+        raytracer->renderToFile(ofname);
     }
-    else
+    catch (exception const &ex)
     {
-        ofname = argv[1];   // replace .json with .png
-        ofname.erase(ofname.begin() + ofname.find_last_of('.'), ofname.end());
-        ofname += ".png";
+        cerr << "Error: " << ex.what() << '\n';
+        return 1;
     }
 
-    raytracer.renderToFile(ofname);
-
     return 0;
 }
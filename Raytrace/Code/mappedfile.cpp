@@ -0,0 +1,59 @@
+#include "mappedfile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+MappedFile::~MappedFile()
+{
+    if (d_data)
+        munmap(const_cast<char *>(d_data), d_size);
+}
+
+bool MappedFile::open(string const &filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    // only a regular file can be mapped, an empty one gives an empty range
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    if (info.st_size > 0)
+    {
+        void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        d_data = static_cast<char const *>(data);
+        d_size = info.st_size;
+        madvise(data, d_size, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+    return true;
+}
+
+char const *MappedFile::begin() const
+{
+    return d_data;
+}
+
+char const *MappedFile::end() const
+{
+    return d_data + d_size;
+}
+
+size_t MappedFile::size() const
+{
+    return d_size;
+}
@@ -0,0 +1,30 @@
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <cstddef>
+#include <string>
+
+// Read-only mapping of a whole file, unmapped when it goes out of scope.
+// An empty file gives an empty range.
+class MappedFile
+{
+    char const *d_data = nullptr;
+    size_t d_size = 0;
+
+    public:
+        MappedFile() = default;
+        ~MappedFile();
+
+        MappedFile(MappedFile const &) = delete;
+        MappedFile &operator=(MappedFile const &) = delete;
+
+        // false if the file could not be opened or mapped, or is not a
+        // regular file
+        bool open(std::string const &filename);
+
+        char const *begin() const;
+        char const *end() const;
+        size_t size() const;
+};
+
+#endif
@@ -2,24 +2,29 @@
 #define MATERIAL_H_
 
 #include "triple.h"
-#include "image.h"
+#include "texture.h"
+#include "texturecache.h"
 
 #include <memory>
 #include <string>
+#include <tuple>
+
+// Materials are stored once per scene (see Scene::addMaterial), objects
+// refer to them. Textures are shared through the TextureCache.
 
 class Material
 {
     public:
         Color color;        // base color
-        std::unique_ptr<Image> texture;
-        double ka;          // ambient intensity
-        double kd;          // diffuse intensity
-        double ks;          // specular intensity
-        double n;           // exponent for specular highlight size
+        std::shared_ptr<Texture const> texture;
+        Real ka;          // ambient intensity
+        Real kd;          // diffuse intensity
+        Real ks;          // specular intensity
+        Real n;           // exponent for specular highlight size
 
         Material() = default;
 
-        Material(Color const &color, double ka, double kd, double ks, double n)
+        Material(Color const &color, Real ka, Real kd, Real ks, Real n)
         :
             color(color),
             ka(ka),
@@ -27,13 +32,22 @@ class Material
             ks(ks),
             n(n)
         {}
-        Material(std::string texturePath, double ka, double kd, double ks, double n) :
-            texture(std::make_unique<Image>(texturePath)),
+        Material(std::string texturePath, Real ka, Real kd, Real ks, Real n) :
+            texture(TextureCache::load(texturePath)),
             ka(ka),
             kd(kd),
             ks(ks),
             n(n)
         {}
+
+        // Strict ordering for the material table of the scene; materials
+        // with the same texture file compare equal
+        bool operator<(Material const &other) const
+        {
+            return std::tie(color.r, color.g, color.b, texture, ka, kd, ks, n)
+                < std::tie(other.color.r, other.color.g, other.color.b, other.texture,
+                           other.ka, other.kd, other.ks, other.n);
+        }
 };
 
 #endif
@@ -0,0 +1,319 @@
+#include "meshcache.h"
+#include "hash.h"
+#include "mappedfile.h"
+#include "objloader.h"
+
+#include "shapes/trianglemesh.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    char const MAGIC[8] = {'R', 'A', 'Y', 'M', 'E', 'S', 'H', '\0'};
+    uint32_t const VERSION = 1;
+
+    // Arrays are stored at offsets which are a multiple of this
+    uint64_t const ALIGNMENT = 64;
+
+    // The arrays of an entry, in file order
+    enum Array
+    {
+        X, Y, Z,
+        NX, NY, NZ,
+        U, V,
+        POSITION_IDX, NORMAL_IDX, TEXCOORD_IDX,
+        BVH_NODES, BVH_INDICES,
+        BLOCKS, BLOCK_OF,
+        NUM_ARRAYS
+    };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t realSize;      // the BVH and blocks store Reals
+        uint32_t nodeSize;
+        uint32_t blockSize;
+        uint64_t sourceHash;
+        uint64_t sourceSize;
+        uint64_t offset[NUM_ARRAYS];    // in bytes from the start of the file
+        uint64_t count[NUM_ARRAYS];     // in elements
+    };
+
+    static_assert(is_trivially_copyable<BVH::Node>::value
+                  && is_trivially_copyable<TriangleBlock>::value,
+                  "cached structures are stored as raw bytes");
+
+    Header expectedHeader(uint64_t hash, uint64_t sourceSize)
+    {
+        Header header = {};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.realSize = sizeof(Real);
+        header.nodeSize = sizeof(BVH::Node);
+        header.blockSize = sizeof(TriangleBlock);
+        header.sourceHash = hash;
+        header.sourceSize = sourceSize;
+        return header;
+    }
+
+    // Creates the directory and its parents, false on failure
+    bool makeDirectories(string const &path)
+    {
+        for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
+        {
+            string part = path.substr(0, pos);
+            if (mkdir(part.c_str(), 0777) != 0 && errno != EEXIST)
+                return false;
+            if (pos == string::npos)
+                return true;
+        }
+    }
+
+    // Copies array idx of the mapped entry into values, false if it lies
+    // outside the file
+    template <typename Type>
+    bool readArray(MappedFile const &file, Header const &header, Array idx,
+                   vector<Type> &values)
+    {
+        uint64_t offset = header.offset[idx];
+        uint64_t count = header.count[idx];
+        if (offset > file.size() || count > (file.size() - offset) / sizeof(Type))
+            return false;
+
+        values.resize(count);
+        if (count != 0)
+            memcpy(values.data(), file.begin() + offset, count * sizeof(Type));
+        return true;
+    }
+
+    // true if all indices are below size
+    bool inRange(vector<unsigned> const &indices, size_t size)
+    {
+        for (unsigned idx : indices)
+        {
+            if (idx >= size)
+                return false;
+        }
+        return true;
+    }
+
+    // Appends the values to the entry at the next aligned offset and
+    // records where they went
+    template <typename Type>
+    void writeArray(ostream &out, Header &header, Array idx, vector<Type> const &values)
+    {
+        uint64_t offset = out.tellp();
+        offset = (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        while (static_cast<uint64_t>(out.tellp()) < offset)
+            out.put('\0');
+
+        header.offset[idx] = offset;
+        header.count[idx] = values.size();
+        out.write(reinterpret_cast<char const *>(values.data()), values.size() * sizeof(Type));
+    }
+}
+
+MeshCache::MeshCache(string const &directory)
+:
+    d_directory(directory)
+{}
+
+string MeshCache::defaultDirectory()
+{
+    if (char const *dir = getenv("RAY_MESH_CACHE"))
+        return dir;
+    if (char const *dir = getenv("XDG_CACHE_HOME"))
+    {
+        if (*dir != '\0')
+            return string(dir) + "/ray/meshes";
+    }
+    if (char const *home = getenv("HOME"))
+    {
+        if (*home != '\0')
+            return string(home) + "/.cache/ray/meshes";
+    }
+    return "";
+}
+
+string const &MeshCache::directory() const
+{
+    return d_directory;
+}
+
+unique_ptr<TriangleMesh> MeshCache::load(string const &objFile) const
+{
+    if (d_directory.empty())
+        return unique_ptr<TriangleMesh>(new TriangleMesh(OBJLoader(objFile, 0).mesh_data()));
+
+    uint64_t hash;
+    uint64_t sourceSize;
+    {
+        MappedFile source;
+        if (!source.open(objFile))     // let the loader report it
+            return unique_ptr<TriangleMesh>(new TriangleMesh(OBJLoader(objFile, 0).mesh_data()));
+        hash = contentHash(source.begin(), source.end());
+        sourceSize = source.size();
+    }
+
+    ostringstream name;
+    name << d_directory << '/' << hex << setw(16) << setfill('0') << hash << ".mesh";
+    string entry = name.str();
+
+    unique_ptr<TriangleMesh> mesh = read(entry, hash, sourceSize);
+    if (mesh)
+        return mesh;
+
+    mesh.reset(new TriangleMesh(OBJLoader(objFile, 0).mesh_data()));
+    if (!write(entry, *mesh, hash, sourceSize))
+        cerr << "Warning: could not write mesh cache entry " << entry << '\n';
+    return mesh;
+}
+
+unique_ptr<TriangleMesh> MeshCache::read(string const &entry, uint64_t hash,
+                                         uint64_t sourceSize) const
+{
+    MappedFile file;
+    if (!file.open(entry) || file.size() < sizeof(Header))
+        return nullptr;
+
+    Header header;
+    memcpy(&header, file.begin(), sizeof(Header));
+    Header expected = expectedHeader(hash, sourceSize);
+    if (memcmp(header.magic, expected.magic, sizeof(MAGIC)) != 0
+        || header.version != expected.version
+        || header.realSize != expected.realSize
+        || header.nodeSize != expected.nodeSize
+        || header.blockSize != expected.blockSize
+        || header.sourceHash != expected.sourceHash
+        || header.sourceSize != expected.sourceSize)
+        return nullptr;
+
+    MeshData data;
+    vector<BVH::Node> nodes;
+    vector<unsigned> indices;
+    vector<TriangleBlock> blocks;
+    vector<unsigned> blockOf;
+    bool complete = readArray(file, header, X, data.x)
+        && readArray(file, header, Y, data.y)
+        && readArray(file, header, Z, data.z)
+        && readArray(file, header, NX, data.nx)
+        && readArray(file, header, NY, data.ny)
+        && readArray(file, header, NZ, data.nz)
+        && readArray(file, header, U, data.u)
+        && readArray(file, header, V, data.v)
+        && readArray(file, header, POSITION_IDX, data.positionIdx)
+        && readArray(file, header, NORMAL_IDX, data.normalIdx)
+        && readArray(file, header, TEXCOORD_IDX, data.texCoordIdx)
+        && readArray(file, header, BVH_NODES, nodes)
+        && readArray(file, header, BVH_INDICES, indices)
+        && readArray(file, header, BLOCKS, blocks)
+        && readArray(file, header, BLOCK_OF, blockOf);
+    if (!complete
+        || data.normalIdx.size() != data.positionIdx.size()
+        || data.texCoordIdx.size() != data.positionIdx.size()
+        || indices.size() != data.numTriangles()
+        || blockOf.size() != data.numTriangles())
+        return nullptr;
+
+    // A damaged entry (truncated and padded, flipped bits) must be rebuilt
+    // instead of crashing every render: check all that is used as an index
+    if (data.positionIdx.size() % 3 != 0
+        || data.y.size() != data.x.size() || data.z.size() != data.x.size()
+        || data.ny.size() != data.nx.size() || data.nz.size() != data.nx.size()
+        || data.v.size() != data.u.size()
+        || !inRange(data.positionIdx, data.x.size())
+        || !inRange(data.normalIdx, data.nx.size())
+        || (!data.u.empty() && !inRange(data.texCoordIdx, data.u.size())))
+        return nullptr;
+
+    for (TriangleBlock const &block : blocks)
+    {
+        if (block.size > TriangleBlock::WIDTH)
+            return nullptr;
+        for (unsigned tri : block.tri)
+        {
+            if (tri >= data.numTriangles())
+                return nullptr;
+        }
+    }
+
+    BVH bvh;
+    bvh.assign(move(nodes), move(indices));
+    if (!bvh.valid(data.numTriangles()))
+        return nullptr;
+    for (BVH::Node const &node : bvh.nodes())
+    {
+        if (node.count > 0 && blockOf[node.offset] >= blocks.size())
+            return nullptr;
+    }
+
+    return unique_ptr<TriangleMesh>(
+        new TriangleMesh(move(data), move(bvh), move(blocks), move(blockOf)));
+}
+
+bool MeshCache::write(string const &entry, TriangleMesh const &mesh, uint64_t hash,
+                      uint64_t sourceSize) const
+{
+    if (!makeDirectories(d_directory))
+        return false;
+
+    // Written under another name and renamed when complete, so a reader
+    // (another ray) never sees half an entry
+    string tmpname = entry + '.' + to_string(getpid()) + ".part";
+    {
+        ofstream out(tmpname, ios::binary);
+        if (!out)
+            return false;
+
+        Header header = expectedHeader(hash, sourceSize);
+        out.write(reinterpret_cast<char const *>(&header), sizeof(Header));
+
+        MeshData const &data = mesh.d_data;
+        writeArray(out, header, X, data.x);
+        writeArray(out, header, Y, data.y);
+        writeArray(out, header, Z, data.z);
+        writeArray(out, header, NX, data.nx);
+        writeArray(out, header, NY, data.ny);
+        writeArray(out, header, NZ, data.nz);
+        writeArray(out, header, U, data.u);
+        writeArray(out, header, V, data.v);
+        writeArray(out, header, POSITION_IDX, data.positionIdx);
+        writeArray(out, header, NORMAL_IDX, data.normalIdx);
+        writeArray(out, header, TEXCOORD_IDX, data.texCoordIdx);
+        writeArray(out, header, BVH_NODES, mesh.d_bvh.nodes());
+        writeArray(out, header, BVH_INDICES, mesh.d_bvh.indices());
+        writeArray(out, header, BLOCKS, mesh.d_blocks);
+        writeArray(out, header, BLOCK_OF, mesh.d_blockOf);
+
+        // now that the offsets are known
+        out.seekp(0);
+        out.write(reinterpret_cast<char const *>(&header), sizeof(Header));
+        if (!out.flush())
+        {
+            remove(tmpname.c_str());
+            return false;
+        }
+    }
+    if (rename(tmpname.c_str(), entry.c_str()) != 0)
+    {
+        remove(tmpname.c_str());
+        return false;
+    }
+    return true;
+}
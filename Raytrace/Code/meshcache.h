@@ -0,0 +1,51 @@
+#ifndef MESHCACHE_H_
+#define MESHCACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class TriangleMesh;
+
+// Binary cache of the triangle meshes read from OBJ files.
+//
+// An entry holds the MeshData of a model together with the BVH and the
+// triangle blocks TriangleMesh builds from it, so a model seen before is
+// loaded from a mapping of the entry without parsing or building anything.
+// Entries are named after a hash of the contents of the OBJ file: a changed
+// model simply gets a new entry. The header records the format version,
+// the source hash and size and the sizes of Real and the stored structures;
+// an entry that does not match, or holds an index out of range, is rebuilt.
+//
+// The format is that of the machine writing it (byte order, alignment),
+// the cache is not meant to be shared between machines.
+class MeshCache
+{
+    std::string d_directory;    // empty: no caching
+
+    public:
+        explicit MeshCache(std::string const &directory = defaultDirectory());
+
+        // $RAY_MESH_CACHE if set (empty disables the cache), otherwise
+        // ray/meshes in $XDG_CACHE_HOME or ~/.cache
+        static std::string defaultDirectory();
+
+        std::string const &directory() const;
+
+        // The mesh of the OBJ file, from the cache when it has an entry for
+        // it, otherwise the file is parsed (on all cores) and an entry is
+        // added. Throws OBJLoader::Error when the file cannot be parsed.
+        std::unique_ptr<TriangleMesh> load(std::string const &objFile) const;
+
+    private:
+        // nullptr if the entry is missing, does not match the source or is
+        // damaged
+        std::unique_ptr<TriangleMesh> read(std::string const &entry, uint64_t hash,
+                                           uint64_t sourceSize) const;
+
+        // false if the entry could not be written
+        bool write(std::string const &entry, TriangleMesh const &mesh, uint64_t hash,
+                   uint64_t sourceSize) const;
+};
+
+#endif
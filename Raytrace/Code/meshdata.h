@@ -0,0 +1,33 @@
+#ifndef MESHDATA_H_
+#define MESHDATA_H_
+
+#include <vector>
+
+// Indexed triangle data as read from a model file. Positions, normals and
+// texture coordinates are stored as separate arrays per component (structure
+// of arrays) and shared between the triangles referring to them. Triangle i
+// uses the entries at index [3 * i + corner] of the three index arrays.
+struct MeshData
+{
+    std::vector<float> x;       // positions
+    std::vector<float> y;
+    std::vector<float> z;
+
+    std::vector<float> nx;      // normals
+    std::vector<float> ny;
+    std::vector<float> nz;
+
+    std::vector<float> u;       // texture coordinates, empty if the
+    std::vector<float> v;       // model has none
+
+    std::vector<unsigned> positionIdx;
+    std::vector<unsigned> normalIdx;
+    std::vector<unsigned> texCoordIdx;
+
+    unsigned numTriangles() const
+    {
+        return positionIdx.size() / 3;
+    }
+};
+
+#endif
@@ -1,11 +1,13 @@
 #ifndef OBJECT_H_
 #define OBJECT_H_
 
+#include "aabb.h"
 #include "material.h"
 
 // not really needed here, but deriving classes may need them
 #include "hit.h"
 #include "ray.h"
+#include "raypacket.h"
 #include "triple.h"
 
 #include <memory>
@@ -15,13 +17,54 @@ typedef std::shared_ptr<Object> ObjectPtr;
 class Object
 {
     public:
-        Material material;
+        Material const *material = nullptr;     // entry of the material
+                                                // table of the scene
 
         virtual ~Object() = default;
 
+        // Caches the values intersect, occluded and mapTexture need which
+        // do not depend on the ray (axes, lengths, squared radii, texture
+        // frames). Scene::build calls it for every object once the scene
+        // is read. Shapes also prepare themselves when constructed, so it
+        // only has to be called again after changing a public member.
+        virtual void prepare() {}
+
         virtual Hit intersect(Ray const &ray) = 0;  // must be implemented
                                                     // in derived class
+
+        // Visibility query for shadow rays: true if the object is hit at a
+        // distance between (a small epsilon and) tMax. Cheaper than
+        // intersect as no normal has to be computed and any hit will do.
+        virtual bool occluded(Ray const &ray, Real tMax) = 0;
+
+        // true if one part of the object can shadow another, as in a mesh.
+        // Otherwise shadow rays skip the object they leave: a convex shape
+        // only blocks them from points facing away from the light.
+        virtual bool shadowsItself() const
+        {
+            return false;
+        }
+
+        // Intersects the rays of the packet whose bit is set in mask and
+        // stores the hits per lane, exactly as intersect would have
+        // computed them. Entries of lanes outside mask may be overwritten.
+        // Shapes with a SIMD kernel override this, the default traces the
+        // rays one by one.
+        virtual void intersectPacket(RayPacket const &packet, unsigned mask, PacketHits &hits)
+        {
+            for (unsigned lane = 0; lane != packet.size; ++lane)
+                if (mask & (1U << lane))
+                    hits.set(lane, intersect(packet.ray(lane)));
+        }
         virtual Point mapTexture(Ray const &ray, Hit const &hit) = 0;
+
+        // Box enclosing the object, used to build the acceleration
+        // structure of the scene. Must contain every point at which
+        // intersect can report a hit.
+        virtual AABB boundingBox() const = 0;
+
+        // Name of the kind of shape, used in the render statistics
+        virtual char const *typeName() const = 0;
 };
 
 #endif
@@ -1,11 +1,17 @@
 #include "objloader.h"
+#include "mappedfile.h"
+#include "threadpool.h"
 
 // Pro C++ Tip: here you can specify other includes you may need
 // such as <iostream>
 
-#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
 
 using namespace std;
 
@@ -15,13 +21,13 @@ using namespace std;
 
 // --- Public --------------------------------------------------------
 
-OBJLoader::OBJLoader(string const &filename)
+OBJLoader::OBJLoader(string const &filename, unsigned threads)
     :
       d_hasTexCoords(false),
       d_current_line(0)
 {
     try {
-        parseFile(filename);
+        parseFile(filename, threads);
     } catch(...) {
         throw OBJLoader::Error{filename, d_current_line, std::current_exception()};
     }
@@ -75,10 +81,10 @@ vector<Face> OBJLoader::face_data() const
     vector<Face> data;
 
     // For all vertices in the model, interleave the data
-    for (vector<size_t> const &faceIndex : d_faces)
+    for (Face_idx const &faceIndex : d_faces)
     {
         Face face;
-        for (size_t index : faceIndex) {
+        for (size_t index = faceIndex.d_first; index != faceIndex.d_first + faceIndex.d_count; ++index) {
             Vertex_idx vertex = d_vertices.at(index);
 
             // Add coordinate data
@@ -113,6 +119,70 @@ vector<Face> OBJLoader::face_data() const
     return data;    // copy elision
 }
 
+MeshData OBJLoader::mesh_data() const
+{
+    MeshData data;
+
+    // The attribute arrays are copied as is, faces only store indices
+    data.x.reserve(d_coordinates.size());
+    data.y.reserve(d_coordinates.size());
+    data.z.reserve(d_coordinates.size());
+    for (vec3 const &coord : d_coordinates)
+    {
+        data.x.push_back(coord.x);
+        data.y.push_back(coord.y);
+        data.z.push_back(coord.z);
+    }
+
+    data.nx.reserve(d_normals.size());
+    data.ny.reserve(d_normals.size());
+    data.nz.reserve(d_normals.size());
+    for (vec3 const &norm : d_normals)
+    {
+        data.nx.push_back(norm.x);
+        data.ny.push_back(norm.y);
+        data.nz.push_back(norm.z);
+    }
+
+    if (d_hasTexCoords)
+    {
+        data.u.reserve(d_texCoords.size());
+        data.v.reserve(d_texCoords.size());
+        for (vec2 const &tex : d_texCoords)
+        {
+            data.u.push_back(tex.u);
+            data.v.push_back(tex.v);
+        }
+    }
+
+    data.positionIdx.reserve(3 * d_faces.size());
+    data.normalIdx.reserve(3 * d_faces.size());
+    data.texCoordIdx.reserve(3 * d_faces.size());
+    for (Face_idx const &faceIndex : d_faces)
+    {
+        if (faceIndex.d_count != 3)
+        {
+            stringstream msg;
+            msg << "Unsupported face type, expected 3 vertices per face, got " << faceIndex.d_count << " vertices";
+            throw runtime_error(msg.str());
+        }
+
+        for (size_t index = faceIndex.d_first; index != faceIndex.d_first + 3; ++index)
+        {
+            Vertex_idx const &vertex = d_vertices.at(index);
+            if (vertex.d_coord >= d_coordinates.size() || vertex.d_norm >= d_normals.size()
+                || (d_hasTexCoords && vertex.d_tex >= d_texCoords.size()))
+                throw out_of_range("vertex index out of range");
+
+            data.positionIdx.push_back(vertex.d_coord);
+            data.normalIdx.push_back(vertex.d_norm);
+            data.texCoordIdx.push_back(d_hasTexCoords ? vertex.d_tex : 0U);
+        }
+    }
+
+    return data;    // copy elision
+}
+
 unsigned OBJLoader::numTriangles() const
 {
     return d_vertices.size() / 3U;
@@ -152,125 +222,560 @@ void OBJLoader::unitize()
 
 // --- Private -------------------------------------------------------
 
-void OBJLoader::parseFile(string const &filename)
+namespace
 {
-    ifstream file(filename);
-    if (file)
+    // Text between the separators, [begin, end)
+    struct Token
+    {
+        char const *begin;
+        char const *end;
+
+        bool empty() const
+        {
+            return begin == end;
+        }
+
+        bool operator==(char const *str) const
+        {
+            size_t length = strlen(str);
+            return static_cast<size_t>(end - begin) == length && memcmp(begin, str, length) == 0;
+        }
+    };
+
+    // Next token of the line separated by spaces (only spaces, like the
+    // former split of the line), empty at the end of the line
+    Token nextToken(char const *&pos, char const *end)
+    {
+        while (pos != end && *pos == ' ')
+            ++pos;
+        char const *begin = pos;
+        while (pos != end && *pos != ' ')
+            ++pos;
+        return Token{begin, pos};
+    }
+
+    // Next token which must be there, as tokens.at(idx) was used before
+    Token requiredToken(char const *&pos, char const *end)
     {
-        string line;
-        // Not a good use of comma operator, but does exactly what we want here
-        while(d_current_line++, getline(file, line)) {
-            parseLine(line);
+        Token token = nextToken(pos, end);
+        if (token.empty())
+            throw out_of_range("missing value");
+        return token;
+    }
+
+    bool isDigit(char ch)
+    {
+        return ch >= '0' && ch <= '9';
+    }
+
+    // Same result (and exceptions) as stof on the token. Numbers with at
+    // most 15 significant digits and a small exponent, which is what
+    // modelling programs write, are converted directly: the mantissa and
+    // the power of ten are exact doubles, so one multiplication or division
+    // gives the correctly rounded double (Clinger's fast path). Rounding
+    // that to float is correct as well, unless the double lies exactly
+    // halfway between two floats. That case, and everything else (long
+    // mantissas, hex, inf, nan, leading white space) goes to stof.
+    float parseFloat(Token const &token)
+    {
+        static double const powersOf10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        unsigned const maxExponent = 22;
+        unsigned long const maxMantissa = 1UL << 53;
+        // bits of a double below the precision of a float, and their value
+        // for a double halfway between two floats
+        uint64_t const lowBits = (1ULL << 29) - 1;
+        uint64_t const halfway = 1ULL << 28;
+
+        char const *pos = token.begin;
+        bool negative = pos != token.end && *pos == '-';
+        if (pos != token.end && (*pos == '-' || *pos == '+'))
+            ++pos;
+
+        unsigned long mantissa = 0;
+        int exponent = 0;
+        bool exact = true;
+        bool digits = false;
+        for (; pos != token.end && isDigit(*pos); ++pos)
+        {
+            digits = true;
+            mantissa = mantissa * 10 + (*pos - '0');
+            exact = exact && mantissa <= maxMantissa;
+            if (!exact)
+                break;
+        }
+        if (exact && pos != token.end && *pos == '.')
+        {
+            for (++pos; pos != token.end && isDigit(*pos); ++pos)
+            {
+                digits = true;
+                mantissa = mantissa * 10 + (*pos - '0');
+                --exponent;
+                exact = exact && mantissa <= maxMantissa;
+                if (!exact)
+                    break;
+            }
         }
 
-    } else {
+        // 'x': hexadecimal float
+        if (exact && digits && pos != token.end && (*pos == 'x' || *pos == 'X'))
+            exact = false;
+
+        // An exponent needs at least one digit, otherwise the number ends
+        // before the 'e', like in strtof
+        if (exact && digits && pos != token.end && (*pos == 'e' || *pos == 'E'))
+        {
+            char const *exp = pos + 1;
+            bool negativeExp = exp != token.end && *exp == '-';
+            if (exp != token.end && (*exp == '-' || *exp == '+'))
+                ++exp;
+            if (exp != token.end && isDigit(*exp))
+            {
+                int value = 0;
+                for (; exp != token.end && isDigit(*exp) && value <= 100; ++exp)
+                    value = value * 10 + (*exp - '0');
+                exponent += negativeExp ? -value : value;
+            }
+        }
+
+        if (exact && digits && exponent >= -static_cast<int>(maxExponent)
+            && exponent <= static_cast<int>(maxExponent))
+        {
+            // at most 2^53 * 10^22 < FLT_MAX and at least 10^-22, so no
+            // overflow or underflow either
+            double value = static_cast<double>(mantissa);
+            value = exponent < 0 ? value / powersOf10[-exponent] : value * powersOf10[exponent];
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof bits);
+            if ((bits & lowBits) != halfway)
+                return static_cast<float>(negative ? -value : value);
+        }
+        return stof(string(token.begin, token.end));
+    }
+
+    // Same result (and exceptions) as stoul on the token
+    unsigned long parseIndex(Token const &token)
+    {
+        unsigned const maxDigits = 19;      // fits in 64 bits
+
+        unsigned long value = 0;
+        char const *pos = token.begin;
+        for (; pos != token.end && isDigit(*pos) && pos - token.begin < maxDigits; ++pos)
+            value = value * 10 + (*pos - '0');
+
+        // not a plain number, or possibly out of range: leave it to stoul
+        if (pos == token.begin || (pos != token.end && isDigit(*pos)))
+            return stoul(string(token.begin, token.end));
+        return value;
+    }
+
+    // Element idx of a face vertex "coord/tex/normal", as the former split
+    // on '/' gave them; false when the element is not there
+    bool findElement(Token const &vertex, unsigned idx, Token &element)
+    {
+        char const *begin = vertex.begin;
+        for (; idx != 0 && begin != vertex.end; --idx)
+        {
+            begin = find(begin, vertex.end, '/');
+            if (begin != vertex.end)
+                ++begin;
+        }
+        if (idx != 0 || begin == vertex.end)
+            return false;
+        element = Token{begin, find(begin, vertex.end, '/')};
+        return true;
+    }
+
+    // Same, but throws when the element is not there
+    Token faceElement(Token const &vertex, unsigned idx)
+    {
+        Token element;
+        if (!findElement(vertex, idx, element))
+            throw out_of_range("missing face element");
+        return element;
+    }
+
+    // Bits of Chunk::relative
+    enum : uint8_t
+    {
+        RELATIVE_COORD = 1,
+        RELATIVE_TEX = 2,
+        RELATIVE_NORM = 4
+    };
+
+    // Files smaller than this are parsed on the calling thread, larger
+    // files are cut into chunks of at least MIN_CHUNK_SIZE bytes
+    size_t const MIN_PARALLEL_SIZE = 4 << 20;
+    size_t const MIN_CHUNK_SIZE = 1 << 20;
+    unsigned const CHUNKS_PER_THREAD = 4;   // to balance uneven chunks
+}
+
+// Records of a range of whole lines of the file. Chunks are parsed
+// independently and concatenated afterwards, so whatever depends on the
+// lines before the chunk is left open while parsing:
+// - relative (negative) face indices count back from the number of
+//   elements seen so far; they are stored relative to the start of the
+//   chunk (wrapping around below zero) and marked in 'relative', the
+//   merge adds the number of elements in the chunks before;
+// - the texture index of a face vertex is only read when a 'vt' line came
+//   before. Until the first 'vt' line of the chunk it is read
+//   tentatively; the merge resets it if no earlier chunk had texture
+//   coordinates, or reports the first vertex without one if it had.
+struct OBJLoader::Chunk
+{
+    char const *begin;
+    char const *end;
+
+    vector<vec3> coordinates;
+    vector<vec3> normals;
+    vector<vec2> texCoords;
+    vector<Vertex_idx> vertices;
+    vector<Face_idx> faces;         // d_first counts from the chunk
+
+    vector<uint8_t> relative;       // RELATIVE_ bits per vertex, empty if
+                                    // the chunk has no relative indices
+    bool hasTexCoords = false;      // seen a 'vt' line
+    size_t tentativeTex = 0;        // vertices before the first 'vt' line
+
+    unsigned lines = 0;             // lines parsed
+    exception_ptr error;            // thrown while parsing line 'lines'
+
+    // first vertex before the first 'vt' line without a valid texture
+    // index, and its line
+    Token missingTex = Token{nullptr, nullptr};
+    unsigned missingTexLine = 0;
+
+    Chunk(char const *begin, char const *end)
+    :
+        begin(begin),
+        end(end)
+    {}
+
+    // Parses all lines, stops at the first error
+    void parse();
+
+    // The parse functions get the remainder of the line after the keyword
+    void parseLine(char const *begin, char const *end);
+    void parseVertex(char const *pos, char const *end);
+    void parseNormal(char const *pos, char const *end);
+    void parseTexCoord(char const *pos, char const *end);
+    void parseFace(char const *pos, char const *end);
+
+    // Index of a face element referring to one of 'count' elements so far,
+    // sets 'bit' in rel if it is relative
+    static size_t index(Token const &element, size_t count, uint8_t bit, uint8_t &rel);
+};
+
+void OBJLoader::parseFile(string const &filename, unsigned threads)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
         cerr << "Could not open: " << filename << " for reading!\n";
+        return;
+    }
+
+    if (threads == 0)
+        threads = ThreadPool::hardwareThreads();
+
+    unique_ptr<ThreadPool> pool;
+    if (threads > 1 && file.size() >= MIN_PARALLEL_SIZE)
+        pool.reset(new ThreadPool(threads));
+
+    // Cut the file after the newline following every boundary
+    size_t numChunks = 1;
+    if (pool)
+        numChunks = max<size_t>(1, min<size_t>(file.size() / MIN_CHUNK_SIZE,
+                                               CHUNKS_PER_THREAD * pool->size()));
+    vector<Chunk> chunks;
+    char const *begin = file.begin();
+    for (size_t idx = 1; idx <= numChunks && begin != file.end(); ++idx)
+    {
+        char const *end = file.begin() + file.size() * idx / numChunks;
+        if (end < begin)
+            end = begin;
+        if (end != file.end())
+        {
+            end = static_cast<char const *>(memchr(end, '\n', file.end() - end));
+            end = end ? end + 1 : file.end();
+        }
+        chunks.push_back(Chunk(begin, end));
+        begin = end;
+    }
+
+    if (pool)
+        pool->run(chunks.size(), [&](unsigned idx) { chunks[idx].parse(); });
+    else
+    {
+        for (Chunk &chunk : chunks)
+            chunk.parse();
+    }
+
+    checkChunks(chunks);
+    mergeChunks(chunks, pool ? pool->size() : 1);
+}
+
+// Throws the error the sequential parse would have hit first
+void OBJLoader::checkChunks(vector<Chunk> const &chunks)
+{
+    bool texBefore = false;
+    unsigned linesBefore = 0;
+    for (Chunk const &chunk : chunks)
+    {
+        if (texBefore && chunk.missingTex.begin)
+        {
+            d_current_line = linesBefore + chunk.missingTexLine;
+            uint8_t rel;
+            Chunk::index(faceElement(chunk.missingTex, 1), 0, RELATIVE_TEX, rel);   // throws
+            throw logic_error("missing texture index was valid");
+        }
+        if (chunk.error)
+        {
+            d_current_line = linesBefore + chunk.lines;
+            rethrow_exception(chunk.error);
+        }
+        texBefore = texBefore || chunk.hasTexCoords;
+        linesBefore += chunk.lines;
+    }
+    d_current_line = linesBefore;
+}
+
+void OBJLoader::mergeChunks(vector<Chunk> &chunks, unsigned threads)
+{
+    // Offsets of the chunks in the merged arrays
+    struct Offsets
+    {
+        size_t coord;
+        size_t norm;
+        size_t tex;
+        size_t vertex;
+        size_t face;
+        bool texBefore;
+    };
+    if (chunks.empty())
+        return;                     // empty file
+
+    vector<Offsets> offsets;
+    Offsets total = {0, 0, 0, 0, 0, false};
+    for (Chunk const &chunk : chunks)
+    {
+        offsets.push_back(total);
+        total.coord += chunk.coordinates.size();
+        total.norm += chunk.normals.size();
+        total.tex += chunk.texCoords.size();
+        total.vertex += chunk.vertices.size();
+        total.face += chunk.faces.size();
+        total.texBefore = total.texBefore || chunk.hasTexCoords;
+    }
+    d_hasTexCoords = total.texBefore;
+
+    // Resolves what the chunk left open, in place if from == to
+    auto fixVertices = [](Chunk const &chunk, Offsets const &offset,
+                          Vertex_idx const *from, Vertex_idx *to)
+    {
+        for (size_t idx = 0; idx != chunk.vertices.size(); ++idx)
+        {
+            Vertex_idx vertex = from[idx];
+            uint8_t rel = chunk.relative.empty() ? 0 : chunk.relative[idx];
+            if (rel & RELATIVE_COORD)
+                vertex.d_coord += offset.coord;
+            if (rel & RELATIVE_TEX)
+                vertex.d_tex += offset.tex;
+            if (rel & RELATIVE_NORM)
+                vertex.d_norm += offset.norm;
+            if (idx < chunk.tentativeTex && !offset.texBefore)
+                vertex.d_tex = 0U;  // ignored
+            to[idx] = vertex;
+        }
+    };
+
+    if (chunks.size() == 1)
+    {
+        Chunk &chunk = chunks.front();
+        fixVertices(chunk, offsets.front(), chunk.vertices.data(), chunk.vertices.data());
+        d_coordinates = move(chunk.coordinates);
+        d_normals = move(chunk.normals);
+        d_texCoords = move(chunk.texCoords);
+        d_vertices = move(chunk.vertices);
+        d_faces = move(chunk.faces);
+        return;
     }
+
+    d_coordinates.resize(total.coord);
+    d_normals.resize(total.norm);
+    d_texCoords.resize(total.tex);
+    d_vertices.resize(total.vertex);
+    d_faces.resize(total.face);
+
+    ThreadPool pool(threads);
+    pool.run(chunks.size(), [&](unsigned idx)
+    {
+        Chunk &chunk = chunks[idx];
+        Offsets const &offset = offsets[idx];
+        copy(chunk.coordinates.begin(), chunk.coordinates.end(), d_coordinates.begin() + offset.coord);
+        copy(chunk.normals.begin(), chunk.normals.end(), d_normals.begin() + offset.norm);
+        copy(chunk.texCoords.begin(), chunk.texCoords.end(), d_texCoords.begin() + offset.tex);
+        fixVertices(chunk, offset, chunk.vertices.data(), d_vertices.data() + offset.vertex);
+        for (size_t face = 0; face != chunk.faces.size(); ++face)
+        {
+            d_faces[offset.face + face] = chunk.faces[face];
+            d_faces[offset.face + face].d_first += offset.vertex;
+        }
+        chunk = Chunk(chunk.begin, chunk.end);  // free the memory early
+    });
 }
 
-void OBJLoader::parseLine(string const &line)
+void OBJLoader::Chunk::parse()
 {
-    if (line[0] == '#')
+    // lines end at '\n' only, like getline, a '\r' stays part of the line
+    try
+    {
+        for (char const *pos = begin; pos != end; )
+        {
+            ++lines;
+            char const *lineEnd = static_cast<char const *>(memchr(pos, '\n', end - pos));
+            if (!lineEnd)
+                lineEnd = end;
+            parseLine(pos, lineEnd);
+            pos = lineEnd == end ? end : lineEnd + 1;
+        }
+    }
+    catch (...)
+    {
+        error = current_exception();
+    }
+    if (!hasTexCoords)
+        tentativeTex = vertices.size();
+}
+
+void OBJLoader::Chunk::parseLine(char const *begin, char const *end)
+{
+    if (begin != end && *begin == '#')
         return;                     // ignore comments
 
-    StringList tokens = split(line, ' ', false);
+    char const *pos = begin;
+    Token keyword = nextToken(pos, end);
 
-    if(tokens.size() <= 0) {
+    if (keyword.empty()) {
         // Empty line
         return;
     }
 
-    if (tokens[0] == "v")
-        parseVertex(tokens);
-    else if (tokens[0] == "vn")
-        parseNormal(tokens);
-    else if (tokens[0] == "vt")
-        parseTexCoord(tokens);
-    else if (tokens[0] == "f")
-        parseFace(tokens);
+    if (keyword == "v")
+        parseVertex(pos, end);
+    else if (keyword == "vn")
+        parseNormal(pos, end);
+    else if (keyword == "vt")
+        parseTexCoord(pos, end);
+    else if (keyword == "f")
+        parseFace(pos, end);
 
     // Other data is also ignored
 }
 
-void OBJLoader::parseVertex(StringList const &tokens)
+void OBJLoader::Chunk::parseVertex(char const *pos, char const *end)
 {
     float x, y, z;
-    x = stof(tokens.at(1));         // 0 is the "v" token
-    y = stof(tokens.at(2));
-    z = stof(tokens.at(3));
-    d_coordinates.push_back(vec3{x, y, z});
+    x = parseFloat(requiredToken(pos, end));
+    y = parseFloat(requiredToken(pos, end));
+    z = parseFloat(requiredToken(pos, end));
+    coordinates.push_back(vec3{x, y, z});
 }
 
-void OBJLoader::parseNormal(StringList const &tokens)
+void OBJLoader::Chunk::parseNormal(char const *pos, char const *end)
 {
     float x, y, z;
-    x = stof(tokens.at(1));         // 0 is the "vn" token
-    y = stof(tokens.at(2));
-    z = stof(tokens.at(3));
-    d_normals.push_back(vec3{x, y, z});
+    x = parseFloat(requiredToken(pos, end));
+    y = parseFloat(requiredToken(pos, end));
+    z = parseFloat(requiredToken(pos, end));
+    normals.push_back(vec3{x, y, z});
 }
 
-void OBJLoader::parseTexCoord(StringList const &tokens)
+void OBJLoader::Chunk::parseTexCoord(char const *pos, char const *end)
 {
-    d_hasTexCoords = true;          // Texture data will be read
+    if (!hasTexCoords)
+    {
+        hasTexCoords = true;        // Texture data will be read
+        tentativeTex = vertices.size();
+    }
 
     float u, v;
-    u = stof(tokens.at(1));         // 0 is the "vt" token
-    v = stof(tokens.at(2));
-    d_texCoords.push_back(vec2{u, v});
+    u = parseFloat(requiredToken(pos, end));
+    v = parseFloat(requiredToken(pos, end));
+    texCoords.push_back(vec2{u, v});
 }
 
-void OBJLoader::parseFace(StringList const &tokens)
+void OBJLoader::Chunk::parseFace(char const *pos, char const *end)
 {
-    std::vector<size_t> face;
-    // skip the first token ("f")
-    for (size_t idx = 1; idx < tokens.size(); ++idx)
+    Face_idx face {vertices.size(), 0};
+    for (Token token = nextToken(pos, end); !token.empty(); token = nextToken(pos, end))
     {
         // format is:
         // <vertex idx + 1>/<texture idx +1>/<normal idx + 1>
         // Wavefront .obj files start counting from 1 (yuck)
+        // Negative indices count back from the last element read (-1)
 
-        if(tokens.at(idx).compare("\r") == 0) {
+        if (token == "\r") {
             // Fix for Windows-style newline
             continue;
         }
 
-        StringList elements = split(tokens.at(idx), '/');
         Vertex_idx vertex {}; // initialize to zeros on all fields
+        uint8_t rel = 0;
 
-        vertex.d_coord = stoul(elements.at(0)) - 1U;
+        vertex.d_coord = index(faceElement(token, 0), coordinates.size(), RELATIVE_COORD, rel);
 
-        if (d_hasTexCoords)
-            vertex.d_tex = stoul(elements.at(1)) - 1U;
+        Token tex;
+        if (hasTexCoords)
+            vertex.d_tex = index(faceElement(token, 1), texCoords.size(), RELATIVE_TEX, rel);
+        else if (!missingTex.begin)
+        {
+            // Needed if an earlier chunk has texture coordinates; without
+            // them an empty element is normal, don't throw for that
+            try
+            {
+                if (!findElement(token, 1, tex) || tex.empty())
+                    throw out_of_range("missing face element");
+                vertex.d_tex = index(tex, texCoords.size(), RELATIVE_TEX, rel);
+            }
+            catch (...)
+            {
+                missingTex = token;
+                missingTexLine = lines;
+                vertex.d_tex = 0U;
+            }
+        }
         else
-            vertex.d_tex = 0U;       // ignored
+            vertex.d_tex = 0U;      // resolved (as an error) or ignored
 
-        vertex.d_norm = stoul(elements.at(2)) - 1U;
+        vertex.d_norm = index(faceElement(token, 2), normals.size(), RELATIVE_NORM, rel);
 
-        size_t v_index = d_vertices.size();
-        d_vertices.push_back(vertex);
-        face.push_back(v_index);
+        vertices.push_back(vertex);
+        if (rel != 0 || !relative.empty())
+        {
+            relative.resize(vertices.size());
+            relative.back() = rel;
+        }
+        ++face.d_count;
     }
-    d_faces.push_back(face);
+    faces.push_back(face);
 }
 
-OBJLoader::StringList OBJLoader::split(string const &line,
-                                       char splitChar,
-                                       bool keepEmpty)
+size_t OBJLoader::Chunk::index(Token const &element, size_t count, uint8_t bit, uint8_t &rel)
 {
-    StringList tokens;
-    istringstream iss(line);
-    string token;
-    while (getline(iss, token, splitChar))
-        if (token.size() > 0 || (token.size() == 0 && keepEmpty))
-            tokens.push_back(token);
-
-    return tokens;
+    if (element.end - element.begin < 2 || *element.begin != '-' || !isDigit(element.begin[1]))
+        return parseIndex(element) - 1U;
+
+    rel |= bit;
+    return count - parseIndex(Token{element.begin + 1, element.end});
 }
 
 OBJLoader::Error::Error(std::string filename, unsigned line, std::exception_ptr exception)
     :
       m_filename(filename),
+      m_line(line),
       m_exception(exception)
 {
 }
@@ -6,6 +6,7 @@
 // file (.cpp / .cc)
 
 #include "face.h"
+#include "meshdata.h"
 #include "vertex.h"
 
 #include <string>
@@ -47,10 +48,20 @@ class OBJLoader
     };
 
     std::vector<Vertex_idx> d_vertices;
-    std::vector<std::vector<size_t>> d_faces;
-    unsigned d_current_line;
 
-    typedef std::vector<std::string> StringList;
+    /**
+     * @brief The Face struct
+     * The vertices of a face are stored
+     * consecutively in d_vertices
+     */
+    struct Face_idx
+    {
+        size_t d_first;
+        size_t d_count;
+    };
+
+    std::vector<Face_idx> d_faces;
+    unsigned d_current_line;
 
     public:
         class Error;
@@ -58,8 +69,10 @@ class OBJLoader
         /**
          * @brief OBJLoader
          * @param filename
+         * @param threads parse on this many threads, 0: one per core.
+         *  Small files are always parsed on the calling thread.
          */
-        explicit OBJLoader(std::string const &filename);
+        explicit OBJLoader(std::string const &filename, unsigned threads = 1);
 
         /**
          * @brief vertex_data
@@ -75,6 +88,14 @@ class OBJLoader
          */
         std::vector<Face> face_data() const;
 
+        /**
+         * @brief mesh_data
+         * @return indexed triangle data, see meshdata.h
+         *
+         * @throws std::runtime_error if a face is not a triangle
+         */
+        MeshData mesh_data() const;
+
         unsigned numTriangles() const;
 
         bool hasTexCoords() const;
@@ -88,16 +109,15 @@ class OBJLoader
 
     private:
 
-        void parseFile(std::string const &filename);
-        void parseLine(std::string const &line);
-        void parseVertex(StringList const &tokens);
-        void parseNormal(StringList const &tokens);
-        void parseTexCoord(StringList const &tokens);
-        void parseFace(StringList const &tokens);
+        // Records of a range of whole lines, see objloader.cpp
+        struct Chunk;
 
-        StringList split(std::string const &str,
-                             char splitChar,
-                             bool keepEmpty = true);
+        // The file is mapped into memory, cut into chunks at line
+        // boundaries which are parsed in place (in parallel), and the
+        // records of the chunks are concatenated
+        void parseFile(std::string const &filename, unsigned threads);
+        void checkChunks(std::vector<Chunk> const &chunks);
+        void mergeChunks(std::vector<Chunk> &chunks, unsigned threads);
 
 };
 
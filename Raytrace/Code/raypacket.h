@@ -0,0 +1,104 @@
+#ifndef RAYPACKET_H_
+#define RAYPACKET_H_
+
+#include "hit.h"
+#include "ray.h"
+#include "triple.h"
+
+// Bundle of coherent rays (e.g. the supersamples of neighbouring pixels)
+// stored as a structure of arrays, so intersection kernels can process
+// several rays per SIMD instruction. Lanes beyond size hold copies of the
+// last ray after pad(), which lets kernels always work on full registers
+// of up to WIDTH lanes.
+class RayPacket
+{
+    public:
+        enum : unsigned { MAX_SIZE = 16, WIDTH = 4 };
+
+        alignas(32) Real ox[MAX_SIZE];
+        alignas(32) Real oy[MAX_SIZE];
+        alignas(32) Real oz[MAX_SIZE];
+        alignas(32) Real dx[MAX_SIZE];
+        alignas(32) Real dy[MAX_SIZE];
+        alignas(32) Real dz[MAX_SIZE];
+        unsigned size;
+
+        RayPacket()
+        :
+            size(0)
+        {}
+
+        void add(Ray const &ray)
+        {
+            ox[size] = ray.O.x;
+            oy[size] = ray.O.y;
+            oz[size] = ray.O.z;
+            dx[size] = ray.D.x;
+            dy[size] = ray.D.y;
+            dz[size] = ray.D.z;
+            ++size;
+        }
+
+        // number of lanes rounded up to whole registers
+        unsigned paddedSize() const
+        {
+            return (size + WIDTH - 1) / WIDTH * WIDTH;
+        }
+
+        void pad()
+        {
+            for (unsigned lane = size; lane < paddedSize(); ++lane)
+            {
+                ox[lane] = ox[size - 1];
+                oy[lane] = oy[size - 1];
+                oz[lane] = oz[size - 1];
+                dx[lane] = dx[size - 1];
+                dy[lane] = dy[size - 1];
+                dz[lane] = dz[size - 1];
+            }
+        }
+
+        // bit i is set for every valid lane i
+        unsigned mask() const
+        {
+            return size >= 32 ? ~0U : (1U << size) - 1;
+        }
+
+        Ray ray(unsigned lane) const
+        {
+            return Ray(Point(ox[lane], oy[lane], oz[lane]),
+                       Vector(dx[lane], dy[lane], dz[lane]));
+        }
+};
+
+// Per lane result of intersecting a packet with an object: distance (NaN
+// for a miss) and normal, like Hit
+class PacketHits
+{
+    public:
+        alignas(32) Real t[RayPacket::MAX_SIZE];
+        alignas(32) Real nx[RayPacket::MAX_SIZE];
+        alignas(32) Real ny[RayPacket::MAX_SIZE];
+        alignas(32) Real nz[RayPacket::MAX_SIZE];
+        unsigned primitive[RayPacket::MAX_SIZE];   // see Hit
+        Real u[RayPacket::MAX_SIZE];
+        Real v[RayPacket::MAX_SIZE];
+
+        void set(unsigned lane, Hit const &hit)
+        {
+            t[lane] = hit.t;
+            nx[lane] = hit.N.x;
+            ny[lane] = hit.N.y;
+            nz[lane] = hit.N.z;
+            primitive[lane] = hit.primitive;
+            u[lane] = hit.u;
+            v[lane] = hit.v;
+        }
+
+        Hit hit(unsigned lane) const
+        {
+            return Hit(t[lane], Vector(nx[lane], ny[lane], nz[lane]), primitive[lane], u[lane], v[lane]);
+        }
+};
+
+#endif
@@ -5,7 +5,10 @@
 #include "material.h"
 #include "triple.h"
 #include "objloader.h"
+#include "texturecache.h"
 #include "fs-utils.h"
+#include "hash.h"
+#include "tilefile.h"
 
 // =============================================================================
 // -- Include all your shapes here ---------------------------------------------
@@ -13,6 +16,7 @@
 
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
+#include "shapes/trianglemesh.h"
 #include "shapes/cylinder.h"
 #include "shapes/cone.h"
 
@@ -22,12 +26,19 @@
 
 #include "json/json.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <exception>
 #include <fstream>
+#include <future>
+#include <iomanip>
+#include <memory>
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
 #include <cmath>
+#include <utility>
 
 using namespace std;        // no std:: required
 using json = nlohmann::json;
@@ -77,27 +88,15 @@ bool Raytracer::parseObjectNode(json const &node)
     {
         std::string filename = node["path"];
         try {
-            OBJLoader loader(filename);
-            std::vector<Face> faces = loader.face_data();
-            std::cout << faces.size() << std::endl;
-            for(Face face : faces) {
-                if(face.vertices.size() != 3) {
-                    std::stringstream msg;
-                    msg << "Unsupported face type, expected 3 vertices per face, got " << face.vertices.size() << " vertices";
-                    throw std::runtime_error(msg.str());
-                }
-                ObjectPtr obj = ObjectPtr(new Triangle(face.vertices.at(0), face.vertices.at(1), face.vertices.at(2)));
-                obj->material = parseMaterialNode(node["material"]);
-                scene.addObject(obj);
-            }
+            unique_ptr<TriangleMesh> mesh = meshes.load(filename);
+            std::cout << mesh->numTriangles() << std::endl;
+            obj = move(mesh);
         } catch(OBJLoader::Error e) {
             // The previous code did not throw error on failure to parse.
             // This code will show the exact line of the error within the *.obj file.
             cout << e.filename() << ":" << e.line() << ": Error parsing file!" << endl;
             return false;
         }
-
-        return true;
     }
     else
     {
@@ -112,8 +111,20 @@ bool Raytracer::parseObjectNode(json const &node)
         return false;
 
     // Parse material and add object to the scene
-    obj->material = parseMaterialNode(node["material"]);
+    obj->material = scene.addMaterial(parseMaterialNode(node["material"]));
     scene.addObject(obj);
+
+    // the material, and the rotation of a sphere (which only moves its
+    // texture), do not change the geometry of the object
+    json shape = node;
+    shape.erase("material");
+    if (node["type"] == "sphere")
+    {
+        shape.erase("rotation");
+        shape.erase("angle");
+    }
+    objectNodes.push_back(node.dump());
+    shapeNodes.push_back(shape.dump());
     return true;
 }
 
@@ -152,8 +163,14 @@ try
     dirname = fs::dirname(ifname);
     ifstream infile(ifname);
     if (!infile) throw runtime_error("Could not open input file for reading.");
-    json jsonscene;
-    infile >> jsonscene;
+    string text{istreambuf_iterator<char>(infile), istreambuf_iterator<char>()};
+    sceneHash = contentHash(text.data(), text.data() + text.size());
+    json jsonscene = json::parse(text);
+
+    json settings = jsonscene;
+    settings.erase("Objects");
+    settings["dirname"] = dirname;      // textures are relative to it
+    settingsNode = settings.dump();
 
 // =============================================================================
 // -- Read your scene data in this section -------------------------------------
@@ -182,6 +199,48 @@ try
         scene.superSamplingFactor(value);
     }
 
+    if(jsonscene["SuperSampling"].is_object()) {
+        json node = jsonscene["SuperSampling"];
+        if(node["factor"].is_number()) {
+            int value = node["factor"];
+            if(value < 1) {
+                value = 1;
+            }
+            scene.superSamplingFactor(value);
+        }
+        if(node["mode"].is_string()) {
+            string mode = node["mode"];
+            if(mode != "adaptive" && mode != "grid") {
+                throw runtime_error("Unknown super sampling mode \"" + mode + "\".");
+            }
+            scene.adaptiveSuperSampling(mode == "adaptive");
+        }
+        if(node["threshold"].is_number()) {
+            double value = node["threshold"];
+            scene.contrastThreshold(value);
+        }
+    }
+
+    if(jsonscene["PacketSize"].is_number()) {
+        int value = jsonscene["PacketSize"];
+        if(value < 1) {
+            value = 1;
+        }
+        scene.packetSize(static_cast<unsigned>(value));
+    }
+
+    if(jsonscene["TextureFilter"].is_string()) {
+        scene.textureFilter(Texture::filter(jsonscene["TextureFilter"]));
+    }
+
+    if(jsonscene["Threads"].is_number()) {
+        int value = jsonscene["Threads"];
+        if(value < 0) {
+            value = 0;
+        }
+        scene.threads(static_cast<unsigned>(value));
+    }
+
     for (auto const &lightNode : jsonscene["Lights"])
         scene.addLight(parseLightNode(lightNode));
 
@@ -204,13 +263,414 @@ catch (exception const &ex)
     return false;
 }
 
+void Raytracer::meshCache(string const &directory)
+{
+    meshes = MeshCache(directory);
+}
+
+void Raytracer::threads(unsigned count)
+{
+    scene.threads(count);
+}
+
+void Raytracer::packetSize(unsigned size)
+{
+    scene.packetSize(size);
+}
+
+Texture::Filter Raytracer::textureFilter() const
+{
+    return scene.textureFilter();
+}
+
+void Raytracer::textureFilter(Texture::Filter filter)
+{
+    scene.textureFilter(filter);
+}
+
+void Raytracer::build()
+{
+    scene.build();
+}
+
+void Raytracer::render(Image &img)
+{
+    scene.render(img);
+}
+
+RenderStats const &Raytracer::stats() const
+{
+    return scene.stats();
+}
+
+void Raytracer::writeStats(string const &fname) const
+{
+    RenderStats const &stats = scene.stats();
+
+    json out;
+    out["rays"]["primary"] = stats.primaryRays;
+    out["rays"]["shadow"] = stats.shadowRays;
+    out["rays"]["reflection"] = stats.reflectionRays;
+    // Every hit spawns at most one reflection ray, so the reflection rays
+    // per primary ray are the average depth a primary ray reached
+    out["depth"]["average"] = stats.primaryRays == 0 ? 0.0
+        : static_cast<double>(stats.reflectionRays) / stats.primaryRays;
+    out["depth"]["max"] = stats.maxDepth;
+
+    json tests = json::object();
+    json objects = json::array();
+    for (unsigned idx = 0; idx != stats.objectTests.size(); ++idx)
+    {
+        string type = scene.object(idx).typeName();
+        unsigned long count = stats.objectTests[idx];
+        tests[type] = (tests.count(type) ? tests[type].get<unsigned long>() : 0) + count;
+        objects.push_back({ { "type", type }, { "tests", count }, { "hits", stats.objectHits[idx] } });
+    }
+    if (stats.triangleTests != 0)
+        tests["mesh triangle"] = stats.triangleTests;
+    out["tests"] = tests;
+    out["objects"] = objects;
+
+    json lights = json::array();
+    for (unsigned idx = 0; idx != stats.lightTests.size(); ++idx)
+    {
+        unsigned long count = stats.lightTests[idx];
+        unsigned long blocked = stats.lightOccluded[idx];
+        lights.push_back({ { "shadow rays", count }, { "occluded", blocked },
+                           { "occlusion rate", count == 0 ? 0.0 : static_cast<double>(blocked) / count } });
+    }
+    out["lights"] = lights;
+    out["materials"] = scene.getNumMaterials();
+    out["textures"] = TextureCache::size();
+    out["reused pixels"] = scene.reusedPixels();
+
+    ofstream file(fname);
+    if (!file)
+        throw runtime_error("Could not open " + fname + " for writing.");
+    file << setw(4) << out << '\n';
+}
+
+void Raytracer::imageWriter(ImageWriter const &settings)
+{
+    writer = settings;
+}
+
+void Raytracer::heatmap(Scene::Cost cost)
+{
+    scene.heatmap(cost);
+}
+
+void Raytracer::region(Scene::Region const &region)
+{
+    tiled = true;
+    tileRegion = region;
+    tileCount = 0;
+}
+
+void Raytracer::tile(unsigned index, unsigned count)
+{
+    tiled = true;
+    tileIndex = index;
+    tileCount = count;
+}
+
+// False color for value in [0, 1]: black, blue, red, yellow, white
+static Color heatColor(float value)
+{
+    static Color const ramp[] = {
+        Color(0, 0, 0), Color(0, 0, 1), Color(1, 0, 0), Color(1, 1, 0), Color(1, 1, 1)
+    };
+    unsigned const last = sizeof(ramp) / sizeof(ramp[0]) - 1;
+
+    float pos = min(max(value, 0.0f), 1.0f) * last;
+    unsigned idx = min(static_cast<unsigned>(pos), last - 1);
+    float frac = pos - idx;
+    return (1 - frac) * ramp[idx] + frac * ramp[idx + 1];
+}
+
+void Raytracer::writeHeatmap(string const &basename, unsigned width, unsigned height) const
+{
+    vector<float> const &costs = scene.costs();
+
+    // raw native endian floats, row by row from the top
+    ofstream raw(basename + ".cost.f32", ios::binary);
+    if (!raw)
+        throw runtime_error("Could not open " + basename + ".cost.f32 for writing.");
+    raw.write(reinterpret_cast<char const *>(costs.data()), costs.size() * sizeof(float));
+
+    // The scale ends at the 99th percentile, a few outliers (e.g. a thread
+    // being preempted while timing) would make the rest of the image black
+    vector<float> sorted(costs);
+    sort(sorted.begin(), sorted.end());
+    float top = sorted.empty() ? 0 : sorted[sorted.size() * 99 / 100];
+    if (top <= 0)
+        top = 1;
+
+    Image img(width, height);
+    for (unsigned y = 0; y != height; ++y)
+        for (unsigned x = 0; x != width; ++x)
+            img.put_pixel(x, y, heatColor(costs[y * width + x] / top));
+    writer.write(img, basename + ".cost.png", ImageWriter::Format::PNG);
+}
+
+void Raytracer::progressive(double seconds)
+{
+    progressInterval = seconds;
+}
+
+// Replaces the file only once the new image is complete, so an aborted
+// render never leaves a truncated image behind
+static void writePartialImage(ImageWriter const &writer, Image const &img, string const &ofname)
+{
+    string tmpname = ofname + ".part";
+    writer.write(img, tmpname, writer.format(ofname));
+    if (rename(tmpname.c_str(), ofname.c_str()) != 0)
+        throw runtime_error("Could not write " + ofname);
+}
+
 void Raytracer::renderToFile(string const &ofname)
 {
     // TODO: the size may be a settings in your file
     Image img(400, 400);
-    cout << "Tracing...\n";
-    scene.render(img);
-    cout << "Writing image to " << ofname << "...\n";
-    img.write_png(ofname);
+    renderFrame(img, ofname);
+    writeOutput(img, ofname);
+    removeCheckpoint(ofname);
+}
+
+void Raytracer::renderFrame(Image &img, string const &ofname)
+{
+    string checkpoint = checkpointFile(ofname);
+    if (!checkpoint.empty())
+        startCheckpoints(img, checkpoint);
+
+    Scene::Region rect{0, 0, img.width(), img.height()};
+    if (tiled)
+    {
+        rect = tileOf(img);
+        if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1)
+            throw runtime_error("The tile lies outside the image");
+        cout << "Tracing pixels " << rect.x0 << ',' << rect.y0 << " to "
+             << rect.x1 << ',' << rect.y1 << "...\n";
+        scene.region(rect);
+        render(img);
+    }
+    else if (progressInterval < 0)
+    {
+        cout << "Tracing...\n";
+        render(img);
+    }
+    else
+    {
+        cout << "Tracing...\n";
+        typedef chrono::steady_clock Clock;
+        Clock::time_point lastWrite = Clock::now();
+        scene.renderProgressive(img, [&](Image const &partial, unsigned pass, unsigned numPasses)
+        {
+            if (pass == numPasses)      // written by writeOutput
+                return;
+            chrono::duration<double> elapsed = Clock::now() - lastWrite;
+            if (elapsed.count() < progressInterval)
+                return;
+            cout << "Pass " << pass << '/' << numPasses << ", writing partial image to " << ofname << '\n';
+            writePartialImage(writer, partial, ofname);
+            lastWrite = Clock::now();
+        });
+    }
+    if (scene.adaptiveSuperSampling()) {
+        unsigned long grid = static_cast<unsigned long>(rect.x1 - rect.x0) * (rect.y1 - rect.y0)
+            * scene.superSamplingFactor() * scene.superSamplingFactor();
+        cout << "Adaptive supersampling: " << scene.primaryRays() << " of "
+             << grid << " primary rays, " << grid - min(grid, scene.primaryRays())
+             << " saved.\n";
+    }
+
+    if (!checkpoint.empty())
+        finishCheckpoints();
+}
+
+Checkpoint::Fingerprint Raytracer::fingerprint(Image const &img) const
+{
+    Scene::Region rect = tiled ? tileOf(img) : Scene::Region{0, 0, img.width(), img.height()};
+    Checkpoint::Fingerprint result = {};
+    result.sceneHash = sceneHash;
+    result.textureFilter = static_cast<uint32_t>(scene.textureFilter());
+    result.progressive = !tiled && progressInterval >= 0;
+    result.width = img.width();
+    result.height = img.height();
+    result.x0 = rect.x0;
+    result.y0 = rect.y0;
+    result.x1 = rect.x1;
+    result.y1 = rect.y1;
+    return result;
+}
+
+void Raytracer::startCheckpoints(Image const &img, string const &checkpointName)
+{
+    Checkpoint::Fingerprint current = fingerprint(img);
+    if (resuming)
+    {
+        if (!ifstream(checkpointName))
+            cout << "No checkpoint " << checkpointName << ", rendering from the start.\n";
+        else
+        {
+            Checkpoint checkpoint = Checkpoint::read(checkpointName);
+            if (checkpoint.fingerprint() != current)
+                throw runtime_error(checkpointName + " is a checkpoint of another scene or other settings");
+            cout << "Resuming from " << checkpointName << "...\n";
+            scene.resume(move(checkpoint.state()));
+        }
+    }
+
+    if (checkpointInterval < 0)
+        return;
+    // the render goes on while the checkpoint is written, if the previous
+    // one is still being written the render skips this one
+    auto busy = [this]
+    {
+        return checkpointWriting.valid()
+            && checkpointWriting.wait_for(chrono::seconds(0)) != future_status::ready;
+    };
+    scene.checkpoint(checkpointInterval, [this, current, checkpointName](Scene::RenderState state)
+    {
+        checkpointWriting = async(launch::async, [current, checkpointName, state = move(state)]() mutable
+        {
+            try
+            {
+                Checkpoint(current, move(state)).write(checkpointName);
+            }
+            catch (exception const &ex)
+            {
+                cerr << "Error: " << ex.what() << '\n';
+            }
+        });
+    }, busy);
+}
+
+void Raytracer::finishCheckpoints()
+{
+    scene.checkpoint(0, Scene::CheckpointFun());
+    if (checkpointWriting.valid())
+        checkpointWriting.get();
+}
+
+string Raytracer::checkpointFile(string const &ofname)
+{
+    return ofname.empty() ? "" : ofname.substr(0, ofname.find_last_of('.')) + ".checkpoint";
+}
+
+void Raytracer::removeCheckpoint(string const &ofname) const
+{
+    string checkpoint = checkpointFile(ofname);
+    if (!checkpoint.empty() && (checkpointInterval >= 0 || resuming))
+    {
+        remove(checkpoint.c_str());
+        remove((checkpoint + ".tmp").c_str());
+    }
+}
+
+void Raytracer::checkpoint(double seconds)
+{
+    checkpointInterval = seconds;
+}
+
+void Raytracer::resume(bool resume)
+{
+    resuming = resume;
+}
+
+Scene::Region Raytracer::tileOf(Image const &img) const
+{
+    unsigned w = img.width();
+    unsigned h = img.height();
+    if (tileCount != 0)
+        return Scene::Region{0, static_cast<unsigned>(static_cast<unsigned long>(h) * tileIndex / tileCount),
+                             w, static_cast<unsigned>(static_cast<unsigned long>(h) * (tileIndex + 1) / tileCount)};
+    return Scene::Region{min(tileRegion.x0, w), min(tileRegion.y0, h),
+                         min(tileRegion.x1, w), min(tileRegion.y1, h)};
+}
+
+TileFile Raytracer::tileFile(Image const &img) const
+{
+    Scene::Region rect = tileOf(img);
+    Image pixels(rect.x1 - rect.x0, rect.y1 - rect.y0);
+    for (unsigned y = rect.y0; y != rect.y1; ++y)
+        for (unsigned x = rect.x0; x != rect.x1; ++x)
+            pixels.put_pixel(x - rect.x0, y - rect.y0, img.get_pixel(x, y));
+    return TileFile(sceneHash, scene.textureFilter(), img.width(), img.height(), rect, move(pixels));
+}
+
+uint64_t Raytracer::hash() const
+{
+    return sceneHash;
+}
+
+double Raytracer::estimateCost(unsigned width, unsigned height, Scene::Region const &region)
+{
+    return scene.estimateCost(width, height, region);
+}
+
+void Raytracer::incremental(bool record)
+{
+    scene.recordDependencies(record);
+}
+
+uint64_t Raytracer::changedObjects(Raytracer const &previous) const
+{
+    uint64_t const all = ~uint64_t(0);
+    if (settingsNode != previous.settingsNode || objectNodes.size() != previous.objectNodes.size())
+        return all;
+
+    uint64_t changed = 0;
+    for (size_t idx = 0; idx != objectNodes.size(); ++idx)
+    {
+        if (objectNodes[idx] == previous.objectNodes[idx])
+            continue;
+        if (shapeNodes[idx] != previous.shapeNodes[idx])
+            return all;
+        changed |= Scene::objectBit(idx);
+    }
+    return changed;
+}
+
+void Raytracer::renderIncremental(Image &img, string const &ofname,
+                                  Raytracer const &previous, Image const &previousImage)
+{
+    if (progressInterval >= 0)
+    {
+        renderFrame(img, ofname);
+        return;
+    }
+
+    cout << "Tracing incrementally...\n";
+    scene.renderIncremental(img, previousImage, previous.scene.dependencies(), changedObjects(previous));
+    cout << "Reused " << scene.reusedPixels() << " of " << img.size() << " pixels ("
+         << fixed << setprecision(1) << 100.0 * scene.reusedPixels() / img.size() << "%).\n"
+         << defaultfloat;
+}
+
+void Raytracer::writeOutput(Image const &img, string const &ofname) const
+{
+    if (tiled)
+    {
+        cout << "Writing tile to " << ofname << "...\n";
+        tileFile(img).write(ofname);
+    }
+    else
+    {
+        cout << "Writing image to " << ofname << "...\n";
+        writer.write(img, ofname);
+    }
+
+    // statistics next to the image: out.png -> out.stats.json
+    string basename = ofname.substr(0, ofname.find_last_of('.'));
+    string statsname = basename + ".stats.json";
+    cout << "Writing statistics to " << statsname << "...\n";
+    writeStats(statsname);
+
+    if (scene.heatmap() != Scene::Cost::NONE) {
+        cout << "Writing heatmap to " << basename << ".cost.png and "
+             << basename << ".cost.f32 (" << img.width() << 'x' << img.height() << " floats)...\n";
+        writeHeatmap(basename, img.width(), img.height());
+    }
     cout << "Done.\n";
 }
@@ -1,13 +1,21 @@
 #ifndef RAYTRACER_H_
 #define RAYTRACER_H_
 
+#include "checkpoint.h"
+#include "imagewriter.h"
+#include "meshcache.h"
 #include "scene.h"
 
+#include <cstdint>
+#include <future>
 #include <string>
+#include <vector>
 
 // Forward declerations
+class Image;
 class Light;
 class Material;
+class TileFile;
 
 #include "json/json_fwd.h"
 
@@ -15,17 +23,151 @@ class Raytracer
 {
     Scene scene;
     std::string dirname;
+    double progressInterval = -1;   // < 0: render in one go
+    MeshCache meshes;
+    ImageWriter writer;
+
+    // The scene file as read, to find what changed between frames: the
+    // json of the settings (all but the objects), of every object and of
+    // every object without the keys which only affect its appearance
+    std::string settingsNode;
+    std::vector<std::string> objectNodes;
+    std::vector<std::string> shapeNodes;
+
+    // Tile mode: only a rectangle of the image is rendered and written as
+    // a TileFile. The rectangle is tileRegion, or band tileIndex of
+    // tileCount horizontal bands when tileCount is not 0.
+    uint64_t sceneHash = 0;         // contentHash of the scene file
+    bool tiled = false;
+    Scene::Region tileRegion{0, 0, 0, 0};
+    unsigned tileIndex = 0;
+    unsigned tileCount = 0;
+
+    // Checkpoints of renderFrame are written to out.checkpoint (for
+    // out.png) in the background, one at a time
+    double checkpointInterval = -1;     // < 0: no checkpoints
+    bool resuming = false;
+    std::future<void> checkpointWriting;
 
     public:
+        // cache directory for the meshes of the scene, empty disables the
+        // cache; set before readScene
+        void meshCache(std::string const &directory);
+
         bool readScene(std::string const &ifname);
         void renderToFile(std::string const &ofname);
 
+        // The two halves of renderToFile: rendering img (progressively,
+        // writing partial images to ofname, when set) and writing it with
+        // the statistics and heatmap of the render. The output of one
+        // frame can be written while another Raytracer renders. In tile
+        // mode only the tile is rendered (never progressively) and written.
+        // @throws std::runtime_error if the tile lies outside the image
+        void renderFrame(Image &img, std::string const &ofname);
+        void writeOutput(Image const &img, std::string const &ofname) const;
+
+        // Removes the checkpoint of the render to ofname. renderFrame keeps
+        // it, so a render can still be resumed until writeOutput succeeded.
+        void removeCheckpoint(std::string const &ofname) const;
+
+        // record the dependencies of the pixels, so the next frame can be
+        // rendered incrementally
+        void incremental(bool record);
+
+        // Renders img as the frame following previous, whose image is
+        // previousImage: when the scenes differ only in the materials or
+        // texture mapping of some objects, only the pixels depending on
+        // them are traced. Renders the whole frame otherwise.
+        void renderIncremental(Image &img, std::string const &ofname,
+                               Raytracer const &previous, Image const &previousImage);
+
+        // build the acceleration structure of the scene, render does this
+        // when it has not been done yet
+        void build();
+
+        // render the scene into img
+        void render(Image &img);
+
+        // work done by the last render
+        RenderStats const &stats() const;
+
+        // number of render threads, overrides the "Threads" scene key
+        void threads(unsigned count);
+
+        // primary rays per packet, overrides the "PacketSize" scene key
+        void packetSize(unsigned size);
+
+        // texture filtering, overrides the "TextureFilter" scene key
+        Texture::Filter textureFilter() const;
+        void textureFilter(Texture::Filter filter);
+
+        // format, compression and encoding threads of the output files
+        void imageWriter(ImageWriter const &settings);
+
+        // Tile mode: render only the pixels [x0, x1) x [y0, y1) of the
+        // image, respectively the index-th (from 0) of count horizontal
+        // bands of about equal height, and write them as a TileFile
+        void region(Scene::Region const &region);
+        void tile(unsigned index, unsigned count);
+
+        // the tile of img rendered in tile mode, as written by writeOutput
+        TileFile tileFile(Image const &img) const;
+
+        // contentHash of the scene file read
+        uint64_t hash() const;
+
+        // see Scene::estimateCost, builds the acceleration structure when
+        // that has not been done yet
+        double estimateCost(unsigned width, unsigned height, Scene::Region const &region);
+
+        // save the state of renderFrame to a checkpoint file at most every
+        // 'seconds' seconds, see Scene::checkpoint
+        void checkpoint(double seconds);
+
+        // let renderFrame continue from its checkpoint file, when there is
+        // one; renderFrame throws std::runtime_error if it belongs to
+        // another scene or other settings
+        void resume(bool resume);
+
+        // also write a heatmap of the cost of every pixel
+        void heatmap(Scene::Cost cost);
+
+        // render progressively, writing the image so far to the output
+        // file at most every 'seconds' seconds
+        void progressive(double seconds);
+
     private:
 
         bool parseObjectNode(nlohmann::json const &node);
 
+        // mask (Scene::objectBit) of the objects which look different in
+        // previous, all bits set if anything else differs
+        uint64_t changedObjects(Raytracer const &previous) const;
+
         Light parseLightNode(nlohmann::json const &node) const;
         Material parseMaterialNode(nlohmann::json const &node) const;
+
+        // the tile of img rendered in tile mode, clipped to img
+        Scene::Region tileOf(Image const &img) const;
+
+        // what a checkpoint must match to be resumed by renderFrame
+        Checkpoint::Fingerprint fingerprint(Image const &img) const;
+
+        // out.checkpoint for out.png, empty if ofname is
+        static std::string checkpointFile(std::string const &ofname);
+
+        // Resumes from and sets up the checkpoints to file checkpointName,
+        // respectively stops them once the render is done (waiting for the
+        // checkpoint being written)
+        void startCheckpoints(Image const &img, std::string const &checkpointName);
+        void finishCheckpoints();
+
+        // write the statistics of the last render as json
+        void writeStats(std::string const &fname) const;
+
+        // write the cost per pixel as basename.cost.png (false colors)
+        // and basename.cost.f32 (floats)
+        void writeHeatmap(std::string const &basename, unsigned width, unsigned height) const;
 };
 
 #endif
@@ -0,0 +1,578 @@
+#include "renderfarm.h"
+
+#include "fs-utils.h"
+#include "image.h"
+#include "raytracer.h"
+#include "tilefile.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+    // Every message is a header followed by size bytes of payload
+    enum MessageType : uint32_t
+    {
+        JOB = 1,        // coordinator to worker: Job and the scene path
+        TILE = 2,       // worker to coordinator: a TileFile
+        FAILED = 3      // worker to coordinator: why the job failed
+    };
+
+    struct MessageHeader
+    {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t size;
+    };
+
+    // longest scene path (of a job) or reason (of a failure); a tile is
+    // at most TileFile::size of its region
+    uint64_t const MAX_TEXT = 1 << 16;
+
+    // A worker which has not sent its tile after MIN_TIMEOUT seconds plus
+    // SECONDS_PER_TEST for every intersection test of the tile's
+    // Scene::estimateCost is taken to hang. Generous, as a test takes
+    // tens of nanoseconds.
+    double const MIN_TIMEOUT = 30;
+    double const SECONDS_PER_TEST = 1e-6;
+
+    typedef chrono::steady_clock Clock;
+
+    struct Job
+    {
+        uint64_t sceneHash;
+        uint32_t textureFilter;
+        uint32_t width;
+        uint32_t height;
+        uint32_t x0, y0, x1, y1;
+        uint32_t reserved;
+    };
+
+    struct Address
+    {
+        bool local;             // Unix socket
+        string path;
+        string host;            // empty: all interfaces
+        string port;
+    };
+
+    // A port alone is on the loopback interface, for the coordinator as
+    // well as the workers: listening on all interfaces has to be asked
+    // for (:PORT or 0.0.0.0:PORT).
+    Address parseAddress(string const &address)
+    {
+        Address result = {};
+        if (address.compare(0, 5, "unix:") == 0)
+        {
+            result.local = true;
+            result.path = address.substr(5);
+            return result;
+        }
+        size_t colon = address.rfind(':');
+        if (colon == string::npos)
+        {
+            result.host = "127.0.0.1";
+            result.port = address;
+        }
+        else
+        {
+            result.host = address.substr(0, colon);
+            result.port = address.substr(colon + 1);
+        }
+        return result;
+    }
+
+    runtime_error systemError(string const &what)
+    {
+        return runtime_error(what + ": " + strerror(errno));
+    }
+
+    void noDelay(int fd)
+    {
+        // jobs and tiles are sent in one go, do not wait for more
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    sockaddr_un unixAddress(string const &path)
+    {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw runtime_error("Socket path too long: " + path);
+        strcpy(addr.sun_path, path.c_str());
+        return addr;
+    }
+
+    // socket of the addresses of a TCP host and port, bound (listening) or
+    // connected; -1 if none works
+    int tcpSocket(Address const &address, bool listening)
+    {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        addrinfo *found;
+        int status = getaddrinfo(address.host.empty() ? nullptr : address.host.c_str(),
+                                 address.port.c_str(), &hints, &found);
+        if (status != 0)
+            throw runtime_error(address.host + ':' + address.port + ": " + gai_strerror(status));
+
+        int fd = -1;
+        for (addrinfo *info = found; info != nullptr && fd < 0; info = info->ai_next)
+        {
+            fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+            if (fd < 0)
+                continue;
+            int one = 1;
+            if (listening)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if ((listening ? bind(fd, info->ai_addr, info->ai_addrlen)
+                           : connect(fd, info->ai_addr, info->ai_addrlen)) != 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (fd >= 0)
+            noDelay(fd);
+        return fd;
+    }
+
+    int connectTo(Address const &address)
+    {
+        if (!address.local)
+            return tcpSocket(address, false);
+
+        sockaddr_un addr = unixAddress(address.path);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    // false if the connection is broken
+    bool sendAll(int fd, char const *data, size_t size)
+    {
+        while (size != 0)
+        {
+            ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return false;
+            data += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    bool sendMessage(int fd, MessageType type, string const &payload)
+    {
+        MessageHeader header = {type, 0, payload.size()};
+        return sendAll(fd, reinterpret_cast<char const *>(&header), sizeof(header))
+            && sendAll(fd, payload.data(), payload.size());
+    }
+
+    // number of bytes received, less than size if the connection was
+    // closed; throws if it broke
+    size_t receiveAll(int fd, char *data, size_t size)
+    {
+        size_t done = 0;
+        while (done != size)
+        {
+            ssize_t got = recv(fd, data + done, size - done, 0);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                throw systemError("Connection to the coordinator broke");
+            if (got == 0)
+                break;
+            done += got;
+        }
+        return done;
+    }
+
+    string describe(Scene::Region const &rect)
+    {
+        ostringstream out;
+        out << rect.x0 << ',' << rect.y0 << " to " << rect.x1 << ',' << rect.y1;
+        return out.str();
+    }
+}
+
+Coordinator::Coordinator(string const &address)
+:
+    d_listen(-1)
+{
+    Address addr = parseAddress(address);
+    if (addr.local)
+    {
+        // a socket left behind by an earlier run would make bind fail
+        struct stat info;
+        if (lstat(addr.path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+            unlink(addr.path.c_str());
+
+        sockaddr_un local = unixAddress(addr.path);
+        d_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (d_listen < 0 || bind(d_listen, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0)
+        {
+            runtime_error error = systemError("Cannot bind to " + addr.path);
+            if (d_listen >= 0)
+                close(d_listen);
+            throw error;
+        }
+        d_socketPath = addr.path;
+    }
+    else
+    {
+        d_listen = tcpSocket(addr, true);
+        if (d_listen < 0)
+            throw systemError("Cannot bind to " + address);
+    }
+
+    if (listen(d_listen, 64) != 0)
+    {
+        runtime_error error = systemError("Cannot listen on " + address);
+        close(d_listen);
+        if (!d_socketPath.empty())
+            unlink(d_socketPath.c_str());
+        throw error;
+    }
+}
+
+Coordinator::~Coordinator()
+{
+    close(d_listen);
+    if (!d_socketPath.empty())
+        unlink(d_socketPath.c_str());
+}
+
+vector<Coordinator::Tile> Coordinator::tiles(Raytracer &raytracer, Image const &img, unsigned tileSize)
+{
+    vector<Tile> result;
+    for (unsigned y = 0; y < img.height(); y += tileSize)
+        for (unsigned x = 0; x < img.width(); x += tileSize)
+        {
+            Scene::Region rect{x, y, min(x + tileSize, img.width()), min(y + tileSize, img.height())};
+            result.push_back(Tile{rect, raytracer.estimateCost(img.width(), img.height(), rect), 0});
+        }
+    stable_sort(result.begin(), result.end(), [](Tile const &lhs, Tile const &rhs)
+    {
+        return lhs.cost < rhs.cost;
+    });
+    return result;
+}
+
+void Coordinator::render(Raytracer &raytracer, string const &sceneFile, Image &img, unsigned tileSize)
+{
+    vector<Tile> all = tiles(raytracer, img, max(tileSize, 1U));
+
+    // the job message is the same for every tile but the region
+    string path = fs::realpath(sceneFile);
+    Job job = {};
+    job.sceneHash = raytracer.hash();
+    job.textureFilter = static_cast<uint32_t>(raytracer.textureFilter());
+    job.width = img.width();
+    job.height = img.height();
+
+    // indices of the tiles still to hand out, the most expensive last
+    vector<unsigned> pending(all.size());
+    for (unsigned idx = 0; idx != all.size(); ++idx)
+        pending[idx] = idx;
+    size_t remaining = all.size();
+
+    vector<Connection> connections;
+    unsigned nextId = 1;
+
+    auto closeAll = [&]
+    {
+        for (Connection const &conn : connections)
+            close(conn.fd);
+        connections.clear();
+    };
+
+    // drops the connection, queuing its tile again
+    auto drop = [&](size_t idx, string const &why)
+    {
+        Connection &conn = connections[idx];
+        cout << "Worker " << conn.id << " dropped: " << why << '\n';
+        if (conn.job >= 0)
+        {
+            Tile &tile = all[conn.job];
+            if (++tile.attempts >= MAX_ATTEMPTS)
+                throw runtime_error("Tile " + describe(tile.region) + " failed on "
+                                    + to_string(tile.attempts) + " workers");
+            pending.insert(upper_bound(pending.begin(), pending.end(), conn.job,
+                                       [&](unsigned lhs, unsigned rhs)
+                                       {
+                                           return all[lhs].cost < all[rhs].cost;
+                                       }),
+                           conn.job);
+        }
+        close(conn.fd);
+        connections.erase(connections.begin() + idx);
+    };
+
+    // handles the complete messages received on the connection, false if
+    // it was dropped
+    auto handle = [&](size_t idx) -> bool
+    {
+        Connection &conn = connections[idx];
+        while (conn.received.size() >= sizeof(MessageHeader))
+        {
+            MessageHeader header;
+            memcpy(&header, conn.received.data(), sizeof(header));
+            // dropped before its payload is buffered if it cannot be the
+            // tile being rendered
+            uint64_t limit = header.type == FAILED ? MAX_TEXT
+                           : conn.job >= 0 ? TileFile::size(all[conn.job].region) : 0;
+            if (header.size > limit)
+            {
+                drop(idx, "invalid message");
+                return false;
+            }
+            if (conn.received.size() < sizeof(header) + header.size)
+                break;
+            string payload = conn.received.substr(sizeof(header), header.size);
+            conn.received.erase(0, sizeof(header) + header.size);
+
+            if (header.type == FAILED)
+            {
+                drop(idx, payload);
+                return false;
+            }
+            if (header.type != TILE || conn.job < 0)
+            {
+                drop(idx, "unexpected message");
+                return false;
+            }
+
+            Tile const &tile = all[conn.job];
+            string error;
+            try
+            {
+                istringstream in(payload);
+                TileFile result = TileFile::read(in, "tile of worker " + to_string(conn.id));
+                Scene::Region const &rect = result.region();
+                if (result.sceneHash() != job.sceneHash)
+                    error = "rendered another scene";
+                else if (static_cast<uint32_t>(result.textureFilter()) != job.textureFilter)
+                    error = "used another texture filter";
+                else if (result.width() != img.width() || result.height() != img.height()
+                         || rect.x0 != tile.region.x0 || rect.y0 != tile.region.y0
+                         || rect.x1 != tile.region.x1 || rect.y1 != tile.region.y1)
+                    error = "rendered another tile";
+                else
+                    result.copyTo(img);
+            }
+            catch (exception const &ex)
+            {
+                error = ex.what();
+            }
+            if (!error.empty())
+            {
+                drop(idx, error);
+                return false;
+            }
+
+            --remaining;
+            ++conn.done;
+            conn.job = -1;
+            cout << "Tile " << all.size() - remaining << '/' << all.size() << " ("
+                 << describe(tile.region) << ") from worker " << conn.id << '\n';
+        }
+        return true;
+    };
+
+    cout << "Waiting for workers, " << all.size() << " tiles...\n";
+    try
+    {
+        while (remaining != 0)
+        {
+            // hand out the most expensive tiles to idle workers
+            for (size_t idx = connections.size(); idx-- != 0; )
+            {
+                Connection &conn = connections[idx];
+                if (conn.job >= 0 || pending.empty())
+                    continue;
+                conn.job = pending.back();
+                pending.pop_back();
+                conn.deadline = Clock::now() + chrono::duration_cast<Clock::duration>(
+                    chrono::duration<double>(MIN_TIMEOUT + all[conn.job].cost * SECONDS_PER_TEST));
+                Scene::Region const &rect = all[conn.job].region;
+                job.x0 = rect.x0;
+                job.y0 = rect.y0;
+                job.x1 = rect.x1;
+                job.y1 = rect.y1;
+                if (!sendMessage(conn.fd, JOB, string(reinterpret_cast<char const *>(&job), sizeof(job)) + path))
+                    drop(idx, "connection lost");
+            }
+
+            // wait until the first deadline at most
+            vector<pollfd> fds(1, pollfd{d_listen, POLLIN, 0});
+            Clock::time_point wake = Clock::time_point::max();
+            for (Connection const &conn : connections)
+            {
+                fds.push_back(pollfd{conn.fd, POLLIN, 0});
+                if (conn.job >= 0)
+                    wake = min(wake, conn.deadline);
+            }
+            int timeout = -1;
+            if (wake != Clock::time_point::max())
+                timeout = max<long long>(0, chrono::duration_cast<chrono::milliseconds>(
+                                                wake - Clock::now()).count() + 1);
+            if (poll(fds.data(), fds.size(), timeout) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw systemError("poll");
+            }
+
+            // backwards, as dropping a connection removes it
+            for (size_t idx = connections.size(); idx-- != 0; )
+            {
+                if (fds[idx + 1].revents == 0)
+                    continue;
+                char buffer[65536];
+                ssize_t got = recv(connections[idx].fd, buffer, sizeof(buffer), 0);
+                if (got <= 0)
+                {
+                    drop(idx, got == 0 ? "disconnected" : strerror(errno));
+                    continue;
+                }
+                connections[idx].received.append(buffer, got);
+                handle(idx);
+            }
+
+            Clock::time_point now = Clock::now();
+            for (size_t idx = connections.size(); idx-- != 0; )
+                if (connections[idx].job >= 0 && now >= connections[idx].deadline)
+                    drop(idx, "no tile in time");
+
+            if (fds[0].revents & POLLIN)
+            {
+                int fd = accept(d_listen, nullptr, nullptr);
+                if (fd >= 0)
+                {
+                    noDelay(fd);
+                    connections.push_back(Connection{fd, nextId++, string(), -1, 0});
+                    cout << "Worker " << connections.back().id << " connected\n";
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        closeAll();
+        throw;
+    }
+
+    for (Connection const &conn : connections)
+        cout << "Worker " << conn.id << " rendered " << conn.done << " tiles\n";
+    closeAll();
+}
+
+Worker::Worker(string const &address, Loader const &load)
+:
+    d_socket(-1),
+    d_load(load)
+{
+    Address addr = parseAddress(address);
+    for (unsigned attempt = 0; attempt != 100 && d_socket < 0; ++attempt)
+    {
+        if (attempt != 0)
+            this_thread::sleep_for(chrono::milliseconds(100));
+        d_socket = connectTo(addr);
+    }
+    if (d_socket < 0)
+        throw systemError("Cannot connect to " + address);
+}
+
+Worker::~Worker()
+{
+    close(d_socket);
+}
+
+unsigned Worker::serve()
+{
+    unique_ptr<Raytracer> raytracer;
+    string loaded;              // scene file of raytracer
+    unsigned rendered = 0;
+    while (true)
+    {
+        MessageHeader header;
+        size_t got = receiveAll(d_socket, reinterpret_cast<char *>(&header), sizeof(header));
+        if (got == 0)           // the coordinator is done
+            return rendered;
+        if (got != sizeof(header) || header.type != JOB || header.size < sizeof(Job)
+            || header.size > sizeof(Job) + MAX_TEXT)
+            throw runtime_error("Invalid message from the coordinator");
+        string payload(header.size, '\0');
+        if (receiveAll(d_socket, &payload[0], payload.size()) != payload.size())
+            throw runtime_error("Connection to the coordinator closed during a job");
+
+        Job job;
+        memcpy(&job, payload.data(), sizeof(job));
+        string path = payload.substr(sizeof(job));
+        Scene::Region rect{job.x0, job.y0, job.x1, job.y1};
+
+        string error;
+        string tile;
+        try
+        {
+            if (!raytracer || loaded != path || raytracer->hash() != job.sceneHash)
+            {
+                raytracer = d_load(path);
+                loaded = path;
+            }
+            if (!raytracer)
+                error = "cannot read " + path;
+            else if (raytracer->hash() != job.sceneHash)
+                error = path + " differs from the scene of the coordinator";
+            else
+            {
+                raytracer->textureFilter(static_cast<Texture::Filter>(job.textureFilter));
+                raytracer->region(rect);
+                Image img(job.width, job.height);
+                raytracer->renderFrame(img, "");
+                ostringstream out;
+                raytracer->tileFile(img).write(out);
+                tile = out.str();
+            }
+        }
+        catch (exception const &ex)
+        {
+            error = ex.what();
+        }
+
+        if (!error.empty())
+            cerr << "Error: " << error << '\n';
+        if (!(error.empty() ? sendMessage(d_socket, TILE, tile) : sendMessage(d_socket, FAILED, error)))
+            throw runtime_error("Connection to the coordinator lost");
+        if (error.empty())
+            ++rendered;
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef RENDERFARM_H_
+#define RENDERFARM_H_
+
+#include "scene.h"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Image;
+class Raytracer;
+
+// Rendering of one image by several worker processes (ray --serve), which
+// connect to a coordinator (ray --coordinate) over a Unix socket or TCP.
+//
+// The coordinator cuts the image into tiles and hands them out one at a
+// time to whichever worker is idle, the most expensive first (by
+// Scene::estimateCost), so the last tiles to finish are small ones. A job
+// names the scene file, its hash and the texture filter; the worker reads
+// the scene (once for all jobs of the same file) and sends the tile back
+// as a TileFile. A worker that disconnects, fails a job or takes far longer
+// than its estimated cost is dropped and its tile queued again. Workers
+// read the scene files themselves, so they must see the same files at the
+// same paths (and meshes relative to the same working directory) as the
+// coordinator.
+//
+// Addresses are unix:PATH, HOST:PORT or PORT. A port alone means
+// 127.0.0.1; the coordinator only listens on all interfaces for :PORT or
+// 0.0.0.0:PORT.
+class Coordinator
+{
+    int d_listen;
+    std::string d_socketPath;       // removed again by the destructor
+
+    public:
+        // @throws std::runtime_error if the address cannot be listened on
+        explicit Coordinator(std::string const &address);
+        ~Coordinator();
+
+        Coordinator(Coordinator const &) = delete;
+        Coordinator &operator=(Coordinator const &) = delete;
+
+        // Renders the scene of raytracer, read from sceneFile, into img with
+        // the workers connecting, in tiles of tileSize x tileSize pixels.
+        // Closes the connections when done, which ends the workers.
+        // @throws std::runtime_error if a tile failed on MAX_ATTEMPTS workers
+        void render(Raytracer &raytracer, std::string const &sceneFile, Image &img,
+                    unsigned tileSize);
+
+        static unsigned const MAX_ATTEMPTS = 3;
+
+    private:
+        struct Tile
+        {
+            Scene::Region region;
+            double cost;
+            unsigned attempts;
+        };
+
+        struct Connection
+        {
+            int fd;
+            unsigned id;
+            std::string received;       // start of an incomplete message
+            int job;                    // tile being rendered, -1 if idle
+            unsigned done;              // tiles rendered
+            std::chrono::steady_clock::time_point deadline;     // for job
+        };
+
+        // tiles of the image, the most expensive last
+        static std::vector<Tile> tiles(Raytracer &raytracer, Image const &img, unsigned tileSize);
+};
+
+class Worker
+{
+    public:
+        // reads a scene and configures the Raytracer, nullptr on failure
+        typedef std::function<std::unique_ptr<Raytracer>(std::string const &)> Loader;
+
+    private:
+        int d_socket;
+        Loader d_load;
+
+    public:
+        // Connects to the coordinator, retrying for a few seconds so
+        // workers can be started before it
+        // @throws std::runtime_error if it cannot connect
+        Worker(std::string const &address, Loader const &load);
+        ~Worker();
+
+        Worker(Worker const &) = delete;
+        Worker &operator=(Worker const &) = delete;
+
+        // Renders the jobs of the coordinator until it closes the
+        // connection, returns the number of tiles rendered
+        // @throws std::runtime_error if the connection breaks
+        unsigned serve();
+};
+
+#endif
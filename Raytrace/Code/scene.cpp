@@ -3,32 +3,133 @@
 #include "image.h"
 #include "material.h"
 #include "ray.h"
+#include "raypacket.h"
 #include "debug.h"
+#include "stats.h"
+#include "threadpool.h"
 
 #include <cmath>
+#include <climits>
 #include <limits>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <mutex>
+#include <stdexcept>
 
 using namespace std;
 
-Color Scene::trace(Ray const &ray, unsigned depth)
+namespace
+{
+    // objects hit by the rays of the pixel being rendered, see
+    // Scene::dependencies
+    thread_local uint64_t pixelDependencies;
+
+    // The tiles of a render which are done, shared by its threads. With a
+    // checkpoint function tiles are finished under a lock, and the
+    // function is called with the state of the render at most every
+    // interval seconds. The state is only copied when busy (if set) says
+    // the previous checkpoint is saved.
+    class TileProgress
+    {
+        typedef chrono::steady_clock Clock;
+
+        Image &d_img;
+        unsigned d_tileSize;
+        unsigned d_tilesX;
+        vector<uint8_t> d_done;
+        Scene::CheckpointFun const &d_checkpoint;
+        Scene::CheckpointBusyFun const &d_busy;
+        double d_interval;
+        Clock::time_point d_last;
+        mutex d_mutex;
+
+        public:
+            TileProgress(Image &img, unsigned tileSize, vector<uint8_t> done,
+                         Scene::CheckpointFun const &checkpoint,
+                         Scene::CheckpointBusyFun const &busy, double interval)
+            :
+                d_img(img),
+                d_tileSize(tileSize),
+                d_tilesX((img.width() + tileSize - 1) / tileSize),
+                d_done(move(done)),
+                d_checkpoint(checkpoint),
+                d_busy(busy),
+                d_interval(interval),
+                d_last(Clock::now())
+            {}
+
+            // whether the tile of pixel (x, y) was done before
+            bool done(unsigned x, unsigned y) const
+            {
+                return d_done[index(x, y)] != 0;
+            }
+
+            // Runs put, which writes the tile of pixel (x, y) to the image
+            template <typename Put>
+            void finish(unsigned x, unsigned y, Put const &put)
+            {
+                if (!d_checkpoint)
+                {
+                    put();
+                    return;
+                }
+
+                lock_guard<mutex> lock(d_mutex);
+                put();
+                d_done[index(x, y)] = 1;
+                Clock::time_point now = Clock::now();
+                if (chrono::duration<double>(now - d_last).count() < d_interval
+                    || (d_busy && d_busy()))
+                    return;
+                Scene::RenderState state;
+                state.tiles = d_done;
+                state.image = d_img;
+                d_checkpoint(move(state));
+                d_last = now;
+            }
+
+        private:
+            size_t index(unsigned x, unsigned y) const
+            {
+                return (y / d_tileSize) * d_tilesX + x / d_tileSize;
+            }
+    };
+}
+
+Color Scene::trace(Ray const &ray, unsigned depth, Real distance)
 {
     if (depth > m_max_depth_recursion) {
         return Color();
     }
 
+    RenderStats &stats = localStats;
+    if (depth == 0)
+        ++stats.primaryRays;
+    else
+    {
+        ++stats.reflectionRays;
+        stats.maxDepth = max(stats.maxDepth, depth);
+    }
+
     // Find hit object and distance
-    auto objIntersecion = traceToObject(ray);
+    return shade(ray, traceToObject(ray), depth, distance);
+}
 
+Color Scene::shade(Ray const &ray, std::pair<ObjectPtr, Hit> const &objIntersecion, unsigned depth, Real distance)
+{
     // No hit? Return background color.
     if (!objIntersecion.first) return Color();
 
-    Color ambient = objIntersecion.first->material.ka * getMaterialColor(ray, objIntersecion.first->material, objIntersecion);
+    // The (texture) color is looked up once for the ambient and all lights
+    Material const &material = *objIntersecion.first->material;
+    Color color = getMaterialColor(ray, material, objIntersecion, distance);
+    Color ambient = material.ka * color;
     Color phong;
 
-    for(auto light : lights) {
-        phong += phongIllumination(ray, objIntersecion, objIntersecion.first->material, *light, 0x3);
+    for(unsigned idx = 0; idx != lights.size(); ++idx) {
+        phong += phongIllumination(ray, objIntersecion, material, color, idx, 0x3);
     }
 
     if (depth + 1 <= m_max_depth_recursion) {
@@ -37,13 +138,14 @@ Color Scene::trace(Ray const &ray, unsigned depth)
         Vector R = 2 * (objIntersecion.second.N.dot(V)) * objIntersecion.second.N - V;
         R.normalize();
         Ray reflectRay(intersectionPoint, R);
-        phong += objIntersecion.first->material.ks * trace(reflectRay, depth + 1);
+        phong += material.ks * trace(reflectRay, depth + 1, distance + objIntersecion.second.t);
     }
 
     return (ambient + phong);
 }
 
-Color Scene::phongIllumination(const Ray& ray, const std::pair<ObjectPtr, Hit>& intersection, const Material& material, const Light& light, unsigned flags) {
+Color Scene::phongIllumination(const Ray& ray, const std::pair<ObjectPtr, Hit>& intersection, const Material& material, Color const &color, unsigned lightIdx, unsigned flags) {
+    Light const &light = *lights[lightIdx];
     Point intersectionPoint = ray.at(intersection.second.t);
     Vector L = light.position - intersectionPoint;
     L.normalize();
@@ -52,91 +154,745 @@ Color Scene::phongIllumination(const Ray& ray, const std::pair<ObjectPtr, Hit>&
     Color phong;
 
     if(m_shadows) {
-        Ray objectLightRay(intersectionPoint, (light.position - intersectionPoint).normalized());
-        auto lightIntersection = traceToObject(objectLightRay);
-        if(lightIntersection.first != nullptr && lightIntersection.first != intersection.first) {
+        // Only objects between the point and the light cast a shadow. An
+        // object which cannot shadow itself is skipped, and so is anything
+        // behind the point where the ray enters it again: the point is lit
+        // when the first object hit is its own.
+        Object *lit = intersection.first.get();
+        Vector toLight = light.position - intersectionPoint;
+        Ray objectLightRay(intersectionPoint, toLight.normalized());
+        Real tMax = toLight.length();
+        Object const *ignore = nullptr;
+        if(!lit->shadowsItself()) {
+            ignore = lit;
+            Hit self = lit->intersect(objectLightRay);
+            if(!std::isnan(self.t)) {
+                tMax = std::min(tMax, self.t);
+            }
+        }
+        bool blocked = occluded(objectLightRay, tMax, ignore);
+        RenderStats &stats = localStats;
+        ++stats.shadowRays;
+        ++stats.lightTests[lightIdx];
+        if(blocked) {
+            ++stats.lightOccluded[lightIdx];
             return Color();
         }
     }
 
     if(flags & 0x1) {
-        double diffuse = std::max(0.0, L.dot(intersection.second.N));
-        phong += material.kd * diffuse * light.color * getMaterialColor(ray, material, intersection);
+        Real diffuse = std::max(Real(0), L.dot(intersection.second.N));
+        phong += material.kd * diffuse * light.color * color;
     }
     if(flags & 0x2) {
-        double specular = pow(std::max(0.0, R.dot(V)), material.n);
+        Real specular = pow(std::max(Real(0), R.dot(V)), material.n);
         phong += material.ks * light.color * specular;
     }
 
     return phong;
 }
 
-Color Scene::getMaterialColor(const Ray& ray, const Material& material, const pair<ObjectPtr, Hit>& intersection) {
+Color Scene::getMaterialColor(const Ray& ray, const Material& material, const pair<ObjectPtr, Hit>& intersection, Real distance) {
     if(material.texture) {
         Point texCoords = intersection.first->mapTexture(ray, intersection.second);
-        return material.texture->colorAt(texCoords.x, texCoords.y);
+        if (m_texture_filter == Texture::Filter::NEAREST)
+            return material.texture->colorAt(texCoords.x, texCoords.y);
+
+        Real lod = textureLevel(ray, intersection, texCoords, *material.texture, distance);
+        return material.texture->sample(texCoords.x, texCoords.y, lod, m_texture_filter);
     }
     return material.color;
 }
 
+Real Scene::textureLevel(Ray const &ray, pair<ObjectPtr, Hit> const &intersection,
+                         Point const &texCoords, Texture const &texture, Real distance)
+{
+    // The rays of neighbouring samples form a cone around the ray, whose
+    // width at the hit is its footprint (ray cones without the widening
+    // by curved reflectors). The footprint in texture space follows from
+    // the texture coordinates of two rays parallel to the ray at that
+    // distance, which also accounts for the angle of the surface.
+    Real width = m_ray_spread * (distance + intersection.second.t);
+    if (!(width > 0))
+        return 0;
+
+    Object &obj = *intersection.first;
+    Vector side1 = ray.D.cross(fabs(ray.D.x) < 0.9 ? Vector(1, 0, 0) : Vector(0, 1, 0)).normalized();
+    Vector side2 = ray.D.cross(side1);
+
+    Point diff[2];
+    Vector const *sides[2] = {&side1, &side2};
+    for (unsigned axis = 0; axis != 2; ++axis)
+    {
+        // on a silhouette try the other side
+        for (Real sign : {Real(1), Real(-1)})
+        {
+            Ray offset(ray.O + sign * width * *sides[axis], ray.D);
+            Hit hit = obj.intersect(offset);
+            if (std::isnan(hit.t))
+                continue;
+            Point coords = obj.mapTexture(offset, hit);
+            Real du = coords.x - texCoords.x;
+            du -= floor(du + 0.5);          // u repeats
+            diff[axis] = Point(du, coords.y - texCoords.y, 0);
+            break;
+        }
+    }
+    return texture.levelOfDetail(diff[0], diff[1]);
+}
+
 std::pair<ObjectPtr, Hit> Scene::traceToObject(const Ray& ray) {
-    Hit min_hit(numeric_limits<double>::infinity(), Vector());
-    ObjectPtr obj = nullptr;
-    for (unsigned idx = 0; idx != objects.size(); ++idx)
+    RenderStats &stats = localStats;
+    Hit min_hit(numeric_limits<Real>::infinity(), Vector());
+    unsigned closest = objects.size();
+    d_bvh.closestHit(ray, min_hit.t, [&](unsigned idx, Real &tMax)
     {
+        ++stats.objectTests[idx];
         Hit hit(objects[idx]->intersect(ray));
-        if (hit.t < min_hit.t)
+        // Hits behind the origin are ignored. On equal distance the object
+        // added first wins, like it did with a linear scan over the objects.
+        if (hit.t >= 0.0 && (hit.t < min_hit.t || (hit.t == min_hit.t && idx < closest)))
         {
             min_hit = hit;
-            obj = objects[idx];
+            closest = idx;
+            tMax = hit.t;
+        }
+    });
+    if (closest == objects.size())
+        return std::make_pair(nullptr, min_hit);
+    ++stats.objectHits[closest];
+    pixelDependencies |= objectBit(closest);
+    return std::make_pair(objects[closest], min_hit);
+}
+
+void Scene::traceToObjects(RayPacket const &packet, std::pair<ObjectPtr, Hit> hits[])
+{
+    RenderStats &stats = localStats;
+    stats.primaryRays += packet.size;
+    PacketHits closestHits;
+    unsigned closest[RayPacket::MAX_SIZE];
+    for (unsigned lane = 0; lane != packet.size; ++lane)
+    {
+        closestHits.set(lane, Hit(numeric_limits<Real>::infinity(), Vector()));
+        closest[lane] = objects.size();
+    }
+
+    d_bvh.closestHit(packet, closestHits.t, [&](unsigned idx, unsigned mask, Real tMax[])
+    {
+        stats.objectTests[idx] += __builtin_popcount(mask);
+        PacketHits objHits;
+        objects[idx]->intersectPacket(packet, mask, objHits);
+        for (unsigned lanes = mask; lanes != 0; lanes &= lanes - 1)
+        {
+            // Same acceptance rule as traceToObject
+            unsigned lane = __builtin_ctz(lanes);
+            Real t = objHits.t[lane];
+            if (t >= 0.0 &&
+                (t < tMax[lane] || (t == tMax[lane] && idx < closest[lane])))
+            {
+                closestHits.set(lane, objHits.hit(lane));
+                closest[lane] = idx;
+            }
+        }
+    });
+
+    for (unsigned lane = 0; lane != packet.size; ++lane)
+    {
+        ObjectPtr obj = nullptr;
+        if (closest[lane] != objects.size())
+        {
+            obj = objects[closest[lane]];
+            ++stats.objectHits[closest[lane]];
+        }
+        hits[lane] = make_pair(obj, closestHits.hit(lane));
+    }
+}
+
+bool Scene::occluded(Ray const &ray, Real tMax, Object const *ignore)
+{
+    RenderStats &stats = localStats;
+    return d_bvh.anyHit(ray, tMax, [&](unsigned idx)
+    {
+        if (objects[idx].get() == ignore)
+            return false;
+        ++stats.objectTests[idx];
+        return objects[idx]->occluded(ray, tMax);
+    });
+}
+
+void Scene::build()
+{
+    for (ObjectPtr const &obj : objects)
+        obj->prepare();
+
+    vector<AABB> bounds;
+    bounds.reserve(objects.size());
+    for (ObjectPtr const &obj : objects)
+        bounds.push_back(obj->boundingBox());
+    d_bvh.build(bounds);
+}
+
+Ray Scene::primaryRay(unsigned x, unsigned y, unsigned sx, unsigned sy, unsigned ss, unsigned h) const
+{
+    // Implementation of supersampling:
+    // Pixel is a square with size 1x1
+    // We divide the pixel to N*N squares with size (1/n)x(1/n)
+    // For each square we take the center;
+    // If supersampling is 1 (default), there is only one square and the middle was at it was before at (0.5)x(0.5)
+    Real left = x + static_cast<Real>(sx) / ss;
+    Real right = x + static_cast<Real>(sx + 1) / ss;
+    Real top = (h - 1 - y) + static_cast<Real>(sy) / ss;
+    Real bottom = (h - 1 - y) + static_cast<Real>(sy + 1) / ss;
+    Real tx = (right + left) / 2;
+    Real ty = (top + bottom) / 2;
+    Point pixel(tx, ty, 0);
+    return Ray(eye, (pixel - eye).normalized());
+}
+
+Color Scene::renderPixel(unsigned x, unsigned y, unsigned h)
+{
+    currentX = x;
+    currentY = y;
+    Color color;
+    for(unsigned sy = 0; sy < m_super_sampling_factor; ++sy) {
+        for(unsigned sx = 0; sx < m_super_sampling_factor; ++sx) {
+            Color subColor = trace(primaryRay(x, y, sx, sy, m_super_sampling_factor, h));
+            subColor.clamp();
+            color += subColor;
         }
     }
-    return std::make_pair(obj, min_hit);
+    color /= m_super_sampling_factor * m_super_sampling_factor;
+    color.clamp();
+    return color;
+}
+
+Color Scene::samplePixel(unsigned x, unsigned y, unsigned h, Object const *&obj)
+{
+    // One ray through the center of the pixel, also reports the object it
+    // hit (nullptr for the background)
+    currentX = x;
+    currentY = y;
+    Ray ray(primaryRay(x, y, 0, 0, 1, h));
+    ++localStats.primaryRays;
+    pair<ObjectPtr, Hit> intersection(traceToObject(ray));
+    obj = intersection.first.get();
+    Color color = shade(ray, intersection, 0);
+    color.clamp();
+    return color;
+}
+
+void Scene::renderTilePackets(unsigned x0, unsigned y0, unsigned x1, unsigned y1, unsigned h, Color buffer[])
+{
+    // The primary rays of the tile (pixel by pixel, every pixel sample by
+    // sample) are cut into packets which are traced together. Shading,
+    // shadow and reflection rays continue one ray at a time. Samples are
+    // accumulated in the same order as in renderPixel, so the result is
+    // bit-identical.
+    unsigned const ss = m_super_sampling_factor;
+    unsigned const samples = ss * ss;
+    unsigned const tileWidth = x1 - x0;
+    unsigned const numSamples = tileWidth * (y1 - y0) * samples;
+
+    RayPacket packet;
+    std::vector<std::pair<ObjectPtr, Hit>> hits(RayPacket::MAX_SIZE, make_pair(nullptr, Hit::NO_HIT()));
+    for (unsigned first = 0; first < numSamples; first += m_packet_size)
+    {
+        unsigned last = min(first + m_packet_size, numSamples);
+        packet.size = 0;
+        for (unsigned sample = first; sample != last; ++sample)
+        {
+            unsigned pixel = sample / samples;
+            unsigned x = x0 + pixel % tileWidth;
+            unsigned y = y0 + pixel / tileWidth;
+            packet.add(primaryRay(x, y, sample % samples % ss, sample % samples / ss, ss, h));
+        }
+        packet.pad();
+        traceToObjects(packet, hits.data());
+
+        for (unsigned sample = first; sample != last; ++sample)
+        {
+            unsigned pixel = sample / samples;
+            unsigned x = pixel % tileWidth;
+            unsigned y = pixel / tileWidth;
+            currentX = x0 + x;
+            currentY = y0 + y;
+            Color &color = buffer[y * TILE_SIZE + x];
+            if (sample % samples == 0)
+                color = Color();
+
+            Color subColor = shade(packet.ray(sample - first), hits[sample - first], 0);
+            subColor.clamp();
+            color += subColor;
+
+            if (sample % samples == samples - 1)
+            {
+                color /= samples;
+                color.clamp();
+            }
+        }
+    }
+}
+
+// Runs task(idx) for idx in [0, numTasks) on the pool and adds the work
+// counted by the threads to d_stats
+template <typename Fun>
+void Scene::runCounted(ThreadPool &pool, unsigned numTasks, Fun const &task)
+{
+    mutex statsMutex;
+    pool.run(numTasks, [&](unsigned idx)
+    {
+        localStats.reset(objects.size(), lights.size());
+        task(idx);
+
+        lock_guard<mutex> lock(statsMutex);
+        d_stats += localStats;
+    });
+}
+
+// Runs tile(x0, y0, x1, y1) for all tiles of a w x h image
+template <typename Fun>
+void Scene::forEachTile(ThreadPool &pool, unsigned w, unsigned h, Fun const &tile)
+{
+    forEachTile(pool, Region{0, 0, w, h}, tile);
+}
+
+// Runs tile(x0, y0, x1, y1) for the tiles of the image overlapping rect,
+// clipped to it
+template <typename Fun>
+void Scene::forEachTile(ThreadPool &pool, Region const &rect, Fun const &tile)
+{
+    if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1)
+        return;
+    unsigned firstX = rect.x0 / TILE_SIZE;
+    unsigned firstY = rect.y0 / TILE_SIZE;
+    unsigned tilesX = (rect.x1 + TILE_SIZE - 1) / TILE_SIZE - firstX;
+    unsigned tilesY = (rect.y1 + TILE_SIZE - 1) / TILE_SIZE - firstY;
+    runCounted(pool, tilesX * tilesY, [&](unsigned idx)
+    {
+        unsigned x0 = (firstX + idx % tilesX) * TILE_SIZE;
+        unsigned y0 = (firstY + idx / tilesX) * TILE_SIZE;
+        tile(max(x0, rect.x0), max(y0, rect.y0), min(x0 + TILE_SIZE, rect.x1), min(y0 + TILE_SIZE, rect.y1));
+    });
+}
+
+// The region to render within the image, grown by border pixels on every
+// side (as far as the image goes)
+Scene::Region Scene::clippedRegion(Image const &img, unsigned border) const
+{
+    Region rect{
+        min(m_region.x0, img.width()), min(m_region.y0, img.height()),
+        min(m_region.x1, img.width()), min(m_region.y1, img.height())
+    };
+    rect.x0 -= min(rect.x0, border);
+    rect.y0 -= min(rect.y0, border);
+    rect.x1 = min(rect.x1 + border, img.width());
+    rect.y1 = min(rect.y1 + border, img.height());
+    return rect;
+}
+
+// Runs fun (which renders pixel idx) and adds its cost to the heatmap
+template <typename Fun>
+auto Scene::measured(unsigned pixel, Fun const &fun) -> decltype(fun())
+{
+    if (m_heatmap == Cost::TESTS)
+    {
+        unsigned long before = localStats.tests();
+        auto result = fun();
+        d_costs[pixel] += localStats.tests() - before;
+        return result;
+    }
+    if (m_heatmap == Cost::TIME)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        auto result = fun();
+        d_costs[pixel] += chrono::duration<float, nano>(chrono::steady_clock::now() - start).count();
+        return result;
+    }
+    return fun();
+}
+
+void Scene::startRender(Image const &img)
+{
+    if (d_bvh.empty() && !objects.empty())
+        build();
+    d_stats.reset(objects.size(), lights.size());
+    d_costs.assign(m_heatmap == Cost::NONE ? 0 : img.size(), 0);
+    d_dependencies.assign(m_record_dependencies ? img.size() : 0, ~uint64_t(0));
+    m_reused_pixels = 0;
+
+    // angle between the rays of neighbouring samples, at the center of
+    // the image (the image plane is z = 0, one unit per pixel)
+    Point center(img.width() / 2.0, img.height() / 2.0, 0);
+    m_ray_spread = 1 / (m_super_sampling_factor * (center - eye).length());
 }
 
 void Scene::render(Image &img)
 {
+    startRender(img);
+
+    if (m_adaptive && m_super_sampling_factor > 1)
+    {
+        renderAdaptive(img);
+        return;
+    }
+
     unsigned w = img.width();
     unsigned h = img.height();
-    for (unsigned y = 0; y < h; ++y)
+    Region rect = clippedRegion(img);
+    m_primary_rays = rect.x0 < rect.x1 && rect.y0 < rect.y1
+        ? static_cast<unsigned long>(rect.x1 - rect.x0) * (rect.y1 - rect.y0)
+          * m_super_sampling_factor * m_super_sampling_factor
+        : 0;
+
+    // The image is cut into square tiles which are handed out to the
+    // threads of the pool. A tile is rendered into a buffer of its own and
+    // copied into the image once it is done, so threads never write to
+    // the same cache lines while tracing.
+    ThreadPool pool(m_threads);
+    TileProgress progress(img, TILE_SIZE, resumedTiles(img), d_checkpoint, d_checkpointBusy,
+                          m_checkpoint_interval);
+    forEachTile(pool, rect, [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1)
     {
-        for (unsigned x = 0; x < w; ++x)
+        if (progress.done(x0, y0))
+            return;
+
+        Color buffer[TILE_SIZE * TILE_SIZE];
+        // packets trace the samples of several pixels at once, so the cost
+        // and dependencies of a pixel can only be recorded without them
+        if (m_packet_size > 1 && m_heatmap == Cost::NONE && !m_record_dependencies)
+            renderTilePackets(x0, y0, x1, y1, h, buffer);
+        else
+            for (unsigned y = y0; y < y1; ++y)
+                for (unsigned x = x0; x < x1; ++x)
+                    buffer[(y - y0) * TILE_SIZE + (x - x0)] = recordedPixel(x, y, w, h);
+
+        progress.finish(x0, y0, [&]
         {
-            currentX = x;
-            currentY = y;
-            Color color;
-            // Implementation of supersampling:
-            // Pixel is a square with size 1x1
-            // We divide the pixel to N*N squares with size (1/n)x(1/n)
-            // For each square we take the center;
-            // If supersampling is 1 (default), there is only one square and the middle was at it was before at (0.5)x(0.5)
-            for(unsigned sy = 0; sy < m_super_sampling_factor; ++sy) {
-                for(unsigned sx = 0; sx < m_super_sampling_factor; ++sx) {
-                    double left = x + static_cast<double>(sx) / m_super_sampling_factor;
-                    double right = x + static_cast<double>(sx + 1) / m_super_sampling_factor;
-                    double top = (h - 1 - y) + static_cast<double>(sy) / m_super_sampling_factor;
-                    double bottom = (h - 1 - y) + static_cast<double>(sy + 1) / m_super_sampling_factor;
-                    double tx = (right + left) / 2;
-                    double ty = (top + bottom) / 2;
-                    Point pixel(tx, ty, 0);
-                    Ray ray(eye, (pixel - eye).normalized());
-                    Color subColor = trace(ray);
-                    subColor.clamp();
-                    color += subColor;
+            for (unsigned y = y0; y < y1; ++y)
+                for (unsigned x = x0; x < x1; ++x)
+                    img.put_pixel(x, y, buffer[(y - y0) * TILE_SIZE + (x - x0)]);
+        });
+    });
+}
+
+// Renders pixel (x, y) while recording its cost and dependencies
+Color Scene::recordedPixel(unsigned x, unsigned y, unsigned w, unsigned h)
+{
+    pixelDependencies = 0;
+    Color color = measured(y * w + x, [&]
+    {
+        return renderPixel(x, y, h);
+    });
+    if (m_record_dependencies)
+        d_dependencies[y * w + x] = pixelDependencies;
+    return color;
+}
+
+void Scene::renderIncremental(Image &img, Image const &previous,
+                              vector<uint64_t> const &previousDeps, uint64_t changed)
+{
+    unsigned w = img.width();
+    unsigned h = img.height();
+    if (m_adaptive || previous.width() != w || previous.height() != h || previousDeps.size() != img.size())
+    {
+        render(img);
+        return;
+    }
+    startRender(img);
+
+    atomic<unsigned long> traced(0);
+    ThreadPool pool(m_threads);
+    forEachTile(pool, w, h, [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1)
+    {
+        Color buffer[TILE_SIZE * TILE_SIZE];
+        unsigned long count = 0;
+        for (unsigned y = y0; y < y1; ++y)
+            for (unsigned x = x0; x < x1; ++x)
+            {
+                unsigned pixel = y * w + x;
+                Color &color = buffer[(y - y0) * TILE_SIZE + (x - x0)];
+                if (previousDeps[pixel] & changed)
+                {
+                    color = recordedPixel(x, y, w, h);
+                    ++count;
+                }
+                else
+                {
+                    color = previous.get_pixel(x, y);
+                    if (m_record_dependencies)
+                        d_dependencies[pixel] = previousDeps[pixel];
                 }
             }
-            color /= m_super_sampling_factor * m_super_sampling_factor;
-            color.clamp();
-            img(x, y) = color;
+
+        for (unsigned y = y0; y < y1; ++y)
+            for (unsigned x = x0; x < x1; ++x)
+                img.put_pixel(x, y, buffer[(y - y0) * TILE_SIZE + (x - x0)]);
+        traced += count;
+    });
+
+    m_primary_rays = traced * m_super_sampling_factor * m_super_sampling_factor;
+    m_reused_pixels = img.size() - traced;
+}
+
+// True if the single sample of pixel (x, y) differs from one of its four
+// neighbours: the neighbour shows another object, or one of the color
+// channels differs by more than the threshold
+static bool needsRefinement(vector<Color> const &samples, vector<Object const *> const &hitObjects,
+                            unsigned x, unsigned y, unsigned w, unsigned h, Real threshold)
+{
+    unsigned pixel = y * w + x;
+    auto differs = [&](unsigned other)
+    {
+        if (hitObjects[pixel] != hitObjects[other])
+            return true;
+        Color diff = samples[pixel] - samples[other];
+        return fabs(diff.r) > threshold || fabs(diff.g) > threshold || fabs(diff.b) > threshold;
+    };
+    return (x > 0 && differs(pixel - 1))
+        || (x + 1 < w && differs(pixel + 1))
+        || (y > 0 && differs(pixel - w))
+        || (y + 1 < h && differs(pixel + w));
+}
+
+void Scene::renderAdaptive(Image &img)
+{
+    // First every pixel gets a single sample through its center. Pixels
+    // for which needsRefinement holds are then supersampled exactly like
+    // renderPixel does for every pixel, the others keep their sample.
+    // The decision needs the samples of the neighbours, so the first
+    // pass covers one more pixel around the region.
+    unsigned w = img.width();
+    unsigned h = img.height();
+    Region rect = clippedRegion(img);
+
+    vector<Color> samples(w * h);
+    vector<Object const *> hitObjects(w * h);
+
+    ThreadPool pool(m_threads);
+    forEachTile(pool, clippedRegion(img, 1), [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1)
+    {
+        for (unsigned y = y0; y < y1; ++y)
+            for (unsigned x = x0; x < x1; ++x)
+                samples[y * w + x] = measured(y * w + x, [&]
+                {
+                    return samplePixel(x, y, h, hitObjects[y * w + x]);
+                });
+    });
+
+    atomic<unsigned long> refined(0);
+    TileProgress progress(img, TILE_SIZE, resumedTiles(img), d_checkpoint, d_checkpointBusy,
+                          m_checkpoint_interval);
+    forEachTile(pool, rect, [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1)
+    {
+        if (progress.done(x0, y0))
+            return;
+
+        unsigned count = 0;
+        Color buffer[TILE_SIZE * TILE_SIZE];
+        for (unsigned y = y0; y < y1; ++y)
+            for (unsigned x = x0; x < x1; ++x)
+            {
+                bool refine = needsRefinement(samples, hitObjects, x, y, w, h, m_contrast_threshold);
+                if (refine)
+                    ++count;
+                buffer[(y - y0) * TILE_SIZE + (x - x0)] = !refine ? samples[y * w + x] : measured(y * w + x, [&]
+                {
+                    return renderPixel(x, y, h);
+                });
+            }
+
+        progress.finish(x0, y0, [&]
+        {
+            for (unsigned y = y0; y < y1; ++y)
+                for (unsigned x = x0; x < x1; ++x)
+                    img.put_pixel(x, y, buffer[(y - y0) * TILE_SIZE + (x - x0)]);
+        });
+        refined += count;
+    });
+
+    Region sampled = clippedRegion(img, 1);
+    m_primary_rays = (rect.x0 < rect.x1 && rect.y0 < rect.y1
+                      ? static_cast<unsigned long>(sampled.x1 - sampled.x0) * (sampled.y1 - sampled.y0) : 0)
+        + refined * m_super_sampling_factor * m_super_sampling_factor;
+}
+
+void Scene::renderProgressive(Image &img, ProgressFun const &progress)
+{
+    // The first passes trace one ray through the center of a pixel, on a
+    // grid which is halved every pass (8x8, 4x4, 2x2 and finally every
+    // pixel). A traced pixel fills its whole grid cell until a finer pass
+    // replaces it. After that every pass adds one sample of the
+    // supersampling grid to all pixels which are supersampled (all of them,
+    // or those selected by needsRefinement in adaptive mode). The samples
+    // are accumulated in the order of renderPixel, so the final image is
+    // the same as the one of render.
+    static_assert(TILE_SIZE % COARSE_STEP == 0, "grid cells must not cross tiles");
+
+    startRender(img);
+
+    unsigned const w = img.width();
+    unsigned const h = img.height();
+    unsigned const ss = m_super_sampling_factor;
+    unsigned const samplePasses = ss > 1 ? ss * ss : 0;
+
+    unsigned numPasses = samplePasses;
+    for (unsigned step = COARSE_STEP; step != 0; step /= 2)
+        ++numPasses;
+    unsigned pass = 0;
+
+    vector<Color> samples(w * h);
+    vector<Object const *> hitObjects(w * h);
+
+    ThreadPool pool(m_threads);
+    for (unsigned step = COARSE_STEP; step != 0; step /= 2)
+    {
+        forEachTile(pool, w, h, [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1)
+        {
+            for (unsigned y = y0; y < y1; y += step)
+                for (unsigned x = x0; x < x1; x += step)
+                {
+                    // skip the pixels of the previous (coarser) passes
+                    if (step != COARSE_STEP && x % (2 * step) == 0 && y % (2 * step) == 0)
+                        continue;
+
+                    Color color = measured(y * w + x, [&]
+                    {
+                        return samplePixel(x, y, h, hitObjects[y * w + x]);
+                    });
+                    samples[y * w + x] = color;
+                    for (unsigned cellY = y; cellY < min(y + step, y1); ++cellY)
+                        for (unsigned cellX = x; cellX < min(x + step, x1); ++cellX)
+                            img.put_pixel(cellX, cellY, color);
+                }
+        });
+        progress(img, ++pass, numPasses);
+    }
+
+    m_primary_rays = static_cast<unsigned long>(w) * h;
+    if (samplePasses == 0)
+        return;
+
+    vector<unsigned> refined;
+    for (unsigned y = 0; y != h; ++y)
+        for (unsigned x = 0; x != w; ++x)
+            if (!m_adaptive || needsRefinement(samples, hitObjects, x, y, w, h, m_contrast_threshold))
+                refined.push_back(y * w + x);
+    m_primary_rays += refined.size() * samplePasses;
+
+    // samples holds the sum of the samples traced so far from here on
+    fill(samples.begin(), samples.end(), Color());
+
+    // continue after the sample passes of a checkpoint
+    unsigned first = 0;
+    RenderState resumed = move(d_resume);
+    d_resume = RenderState();
+    if (resumed.samples < samplePasses && resumed.sums.size() == samples.size()
+        && resumed.image.width() == w && resumed.image.height() == h)
+    {
+        first = resumed.samples;
+        samples = move(resumed.sums);
+        img = move(resumed.image);
+        pass += first;
+    }
+
+    typedef chrono::steady_clock Clock;
+    Clock::time_point lastCheckpoint = Clock::now();
+
+    unsigned const chunkSize = TILE_SIZE * TILE_SIZE;
+    unsigned const numChunks = (refined.size() + chunkSize - 1) / chunkSize;
+    for (unsigned sample = first; sample != samplePasses; ++sample)
+    {
+        runCounted(pool, numChunks, [&](unsigned chunk)
+        {
+            unsigned end = min<unsigned>((chunk + 1) * chunkSize, refined.size());
+            for (unsigned idx = chunk * chunkSize; idx != end; ++idx)
+            {
+                unsigned x = refined[idx] % w;
+                unsigned y = refined[idx] / w;
+                currentX = x;
+                currentY = y;
+                Color subColor = measured(refined[idx], [&]
+                {
+                    return trace(primaryRay(x, y, sample % ss, sample / ss, ss, h));
+                });
+                subColor.clamp();
+                Color &sum = samples[refined[idx]];
+                sum += subColor;
+
+                Color color = sum;
+                color /= sample + 1;
+                color.clamp();
+                img.put_pixel(x, y, color);
+            }
+        });
+        progress(img, ++pass, numPasses);
+
+        if (d_checkpoint && sample + 1 != samplePasses
+            && chrono::duration<double>(Clock::now() - lastCheckpoint).count() >= m_checkpoint_interval
+            && !(d_checkpointBusy && d_checkpointBusy()))
+        {
+            RenderState state;
+            state.samples = sample + 1;
+            state.sums = samples;
+            state.image = img;
+            d_checkpoint(move(state));
+            lastCheckpoint = Clock::now();
         }
     }
 }
 
+// The done tiles of the state to resume from, whose pixels are copied to
+// img, if it fits; no tiles are done otherwise
+vector<uint8_t> Scene::resumedTiles(Image &img)
+{
+    unsigned tiles = numTiles(img.width(), img.height());
+    RenderState resumed = move(d_resume);
+    d_resume = RenderState();
+    if (resumed.tiles.size() != tiles || resumed.image.width() != img.width()
+        || resumed.image.height() != img.height() || resumed.image.format() != img.format())
+        return vector<uint8_t>(tiles, 0);
+
+    img = move(resumed.image);
+    return move(resumed.tiles);
+}
+
 // --- Misc functions ----------------------------------------------------------
 
+double Scene::estimateCost(unsigned w, unsigned h, Region const &rect, unsigned step)
+{
+    if (d_bvh.empty() && !objects.empty())
+        build();
+
+    unsigned x0 = min(rect.x0, w), x1 = min(rect.x1, w);
+    unsigned y0 = min(rect.y0, h), y1 = min(rect.y1, h);
+    if (x0 >= x1 || y0 >= y1)
+        return 0;
+
+    // counted by the calling thread, outside of any render
+    localStats.reset(objects.size(), lights.size());
+    unsigned long samples = 0;
+    for (unsigned y = y0 + min(step, y1 - y0) / 2; y < y1; y += step)
+        for (unsigned x = x0 + min(step, x1 - x0) / 2; x < x1; x += step)
+        {
+            Object const *obj;
+            samplePixel(x, y, h, obj);
+            ++samples;
+        }
+
+    double area = static_cast<double>(x1 - x0) * (y1 - y0);
+    return static_cast<double>(localStats.tests()) / samples * area
+        * m_super_sampling_factor * m_super_sampling_factor;
+}
+
 void Scene::addObject(ObjectPtr obj)
 {
     objects.push_back(obj);
+    d_bvh.clear();                  // rebuilt on the next build()
+}
+
+Material const *Scene::addMaterial(Material const &material)
+{
+    return &*d_materials.insert(material).first;
 }
 
 void Scene::addLight(Light const &light)
@@ -159,6 +915,16 @@ unsigned Scene::getNumLights()
     return lights.size();
 }
 
+unsigned Scene::getNumMaterials() const
+{
+    return d_materials.size();
+}
+
+Object const &Scene::object(unsigned idx) const
+{
+    return *objects[idx];
+}
+
 bool Scene::shadows() const {
     return m_shadows;
 }
@@ -175,6 +941,110 @@ void Scene::maxDepthRecursion(unsigned value) {
     m_max_depth_recursion = value;
 }
 
+unsigned Scene::packetSize() const {
+    return m_packet_size;
+}
+
+void Scene::packetSize(unsigned value) {
+    m_packet_size = min<unsigned>(value, RayPacket::MAX_SIZE);
+}
+
+bool Scene::adaptiveSuperSampling() const {
+    return m_adaptive;
+}
+
+void Scene::adaptiveSuperSampling(bool value) {
+    m_adaptive = value;
+}
+
+Real Scene::contrastThreshold() const {
+    return m_contrast_threshold;
+}
+
+void Scene::contrastThreshold(Real value) {
+    m_contrast_threshold = value;
+}
+
+unsigned long Scene::primaryRays() const {
+    return m_primary_rays;
+}
+
+RenderStats const &Scene::stats() const {
+    return d_stats;
+}
+
+Scene::Cost Scene::heatmap() const {
+    return m_heatmap;
+}
+
+void Scene::heatmap(Cost cost) {
+    m_heatmap = cost;
+}
+
+vector<float> const &Scene::costs() const {
+    return d_costs;
+}
+
+Scene::Region Scene::region() const {
+    return m_region;
+}
+
+void Scene::region(Region const &region) {
+    m_region = region;
+}
+
+void Scene::checkpoint(double seconds, CheckpointFun const &fun, CheckpointBusyFun const &busy) {
+    m_checkpoint_interval = seconds;
+    d_checkpoint = fun;
+    d_checkpointBusy = busy;
+}
+
+void Scene::resume(RenderState state) {
+    if (state.image.size() == 0)
+        throw invalid_argument("Cannot resume from an empty render state");
+    d_resume = move(state);
+}
+
+unsigned Scene::numTiles(unsigned width, unsigned height) {
+    return ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+bool Scene::recordDependencies() const {
+    return m_record_dependencies;
+}
+
+void Scene::recordDependencies(bool record) {
+    m_record_dependencies = record;
+}
+
+vector<uint64_t> const &Scene::dependencies() const {
+    return d_dependencies;
+}
+
+uint64_t Scene::objectBit(size_t idx) {
+    return uint64_t(1) << min<size_t>(idx, 63);
+}
+
+unsigned long Scene::reusedPixels() const {
+    return m_reused_pixels;
+}
+
+Texture::Filter Scene::textureFilter() const {
+    return m_texture_filter;
+}
+
+void Scene::textureFilter(Texture::Filter filter) {
+    m_texture_filter = filter;
+}
+
+unsigned Scene::threads() const {
+    return m_threads;
+}
+
+void Scene::threads(unsigned value) {
+    m_threads = value;
+}
+
 unsigned Scene::superSamplingFactor() const {
     return m_super_sampling_factor;
 }
@@ -183,5 +1053,5 @@ void Scene::superSamplingFactor(unsigned value) {
     m_super_sampling_factor = value;
 }
 
-Scene::Scene() : m_shadows{false}, m_max_depth_recursion{0}, m_super_sampling_factor{1} {
+Scene::Scene() : m_shadows{false}, m_max_depth_recursion{0}, m_super_sampling_factor{1}, m_threads{0}, m_packet_size{1}, m_adaptive{false}, m_contrast_threshold{0.1}, m_primary_rays{0}, m_heatmap{Cost::NONE}, m_texture_filter{Texture::Filter::NEAREST}, m_record_dependencies{false}, m_reused_pixels{0}, m_region{0, 0, UINT_MAX, UINT_MAX}, m_ray_spread{0}, m_checkpoint_interval{0} {
 }
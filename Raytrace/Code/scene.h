@@ -1,48 +1,168 @@
 #ifndef SCENE_H_
 #define SCENE_H_
 
+#include "bvh.h"
 #include "light.h"
 #include "object.h"
 #include "triple.h"
 #include "hit.h"
+#include "image.h"
+#include "stats.h"
 
+#include <cstdint>
+#include <functional>
+#include <set>
 #include <utility>
 #include <vector>
 
 // Forward declerations
 class Ray;
-class Image;
+class RayPacket;
+class ThreadPool;
 
 class Scene
 {
+public:
+    // measure of the cost of a pixel for the heatmap
+    enum class Cost
+    {
+        NONE,                       // no heatmap
+        TESTS,                      // intersection tests
+        TIME                        // nanoseconds spent tracing
+    };
+
+    // rectangle of pixels [x0, x1) x [y0, y1)
+    struct Region
+    {
+        unsigned x0, y0, x1, y1;
+    };
+
+    // The work done so far by an unfinished render, see checkpoint
+    struct RenderState
+    {
+        std::vector<uint8_t> tiles;     // render: 1 for every tile (row by row)
+                                        // which is done
+        unsigned samples = 0;           // renderProgressive: sample passes done
+        std::vector<Color> sums;        // renderProgressive: sum of these samples
+                                        // per pixel
+        Image image;                    // the pixels so far
+    };
+
+    // called with (a copy of) the state of a render, see checkpoint
+    typedef std::function<void(RenderState state)> CheckpointFun;
+
+    // true while the checkpoint before is still being saved
+    typedef std::function<bool()> CheckpointBusyFun;
+
+private:
     std::vector<ObjectPtr> objects;
+    std::set<Material> d_materials; // of the objects, each one stored once
+    BVH d_bvh;                      // acceleration structure over objects
     std::vector<LightPtr> lights;   // no ptr needed, but kept for consistency
     Point eye;
     bool m_shadows;
     unsigned m_max_depth_recursion;
     unsigned m_super_sampling_factor;
+    unsigned m_threads;             // 0: one per hardware thread
+    unsigned m_packet_size;         // primary rays per packet, 1: no packets
+    bool m_adaptive;                // supersample only where the image changes
+    Real m_contrast_threshold;      // color difference that triggers refinement
+    unsigned long m_primary_rays;   // primary rays traced by the last render
+    RenderStats d_stats;            // work done by the last render
+    Cost m_heatmap;
+    std::vector<float> d_costs;     // cost per pixel of the last render
+    Texture::Filter m_texture_filter;
+    bool m_record_dependencies;
+    std::vector<uint64_t> d_dependencies;   // per pixel of the last render
+    unsigned long m_reused_pixels;  // copied from the previous frame
+    Region m_region;                // rendered by render
+    Real m_ray_spread;              // angle between neighbouring samples
+    double m_checkpoint_interval;   // seconds between checkpoints
+    CheckpointFun d_checkpoint;     // empty: no checkpoints
+    CheckpointBusyFun d_checkpointBusy;     // empty: never busy
+    RenderState d_resume;           // continued by the next render
+
+    static unsigned const TILE_SIZE = 16;
+    static unsigned const COARSE_STEP = 8;  // first grid of renderProgressive
 
 protected:
     std::pair<ObjectPtr, Hit> traceToObject(Ray const &ray);
-    Color phongIllumination(const Ray& ray, const std::pair<ObjectPtr, Hit> &intersection, const Material& material, const Light &source, unsigned flags);
-    Color getMaterialColor(const Ray& ray, const Material& material, const std::pair<ObjectPtr, Hit>& intersection);
+    void traceToObjects(RayPacket const &packet, std::pair<ObjectPtr, Hit> hits[]);
+    Color shade(Ray const &ray, std::pair<ObjectPtr, Hit> const &intersection, unsigned depth, Real distance = 0);
+    Color phongIllumination(const Ray& ray, const std::pair<ObjectPtr, Hit> &intersection, const Material& material, Color const &color, unsigned lightIdx, unsigned flags);
+    Color getMaterialColor(const Ray& ray, const Material& material, const std::pair<ObjectPtr, Hit>& intersection, Real distance);
+    Real textureLevel(Ray const &ray, std::pair<ObjectPtr, Hit> const &intersection,
+                      Point const &texCoords, Texture const &texture, Real distance);
+    Ray primaryRay(unsigned x, unsigned y, unsigned sx, unsigned sy, unsigned ss, unsigned h) const;
+    Color renderPixel(unsigned x, unsigned y, unsigned h);
+    Color recordedPixel(unsigned x, unsigned y, unsigned w, unsigned h);
+    Color samplePixel(unsigned x, unsigned y, unsigned h, Object const *&obj);
+    void renderTilePackets(unsigned x0, unsigned y0, unsigned x1, unsigned y1, unsigned h, Color buffer[]);
+    void renderAdaptive(Image &img);
+    void startRender(Image const &img);
+    template <typename Fun>
+    auto measured(unsigned pixel, Fun const &fun) -> decltype(fun());
+    template <typename Fun>
+    void runCounted(ThreadPool &pool, unsigned numTasks, Fun const &task);
+    template <typename Fun>
+    void forEachTile(ThreadPool &pool, unsigned w, unsigned h, Fun const &tile);
+    template <typename Fun>
+    void forEachTile(ThreadPool &pool, Region const &rect, Fun const &tile);
+    Region clippedRegion(Image const &img, unsigned border = 0) const;
+    std::vector<uint8_t> resumedTiles(Image &img);
 
 public:
     Scene();
 
-    // trace a ray into the scene and return the color
-    Color trace(Ray const &ray, unsigned depth = 0);
+    // trace a ray into the scene and return the color; distance is the
+    // length of the path before the ray (for the texture footprint)
+    Color trace(Ray const &ray, unsigned depth = 0, Real distance = 0);
+
+    // true if any object other than ignore blocks the ray before
+    // distance tMax
+    bool occluded(Ray const &ray, Real tMax, Object const *ignore = nullptr);
 
-    // render the scene to the given image
+    // render the scene to the given image, only the pixels of region()
     void render(Image &img);
 
+    // called after every pass of renderProgressive with the image so far
+    typedef std::function<void(Image const &img, unsigned pass, unsigned numPasses)> ProgressFun;
+
+    // Renders the scene as the frame following previous (of the same
+    // size, rendered with dependency recording): pixels whose dependencies
+    // (previousDeps) contain none of the changed objects (a mask, see
+    // objectBit) are copied, the others traced. The changed objects may
+    // only differ in appearance (material, texture mapping), not in
+    // geometry. Adaptive supersampling renders the whole frame.
+    void renderIncremental(Image &img, Image const &previous,
+                           std::vector<uint64_t> const &previousDeps, uint64_t changed);
+
+    // render the scene in passes of increasing quality, the final image
+    // equals the one of render
+    void renderProgressive(Image &img, ProgressFun const &progress);
+
+    // Cheap estimate of the cost of rendering rect of a w x h image: the
+    // intersection tests of one sample (with its shadow and reflection
+    // rays) in every step-th pixel of every step-th row, scaled to all
+    // samples of the rect. Meant to compare regions, not to predict time.
+    double estimateCost(unsigned w, unsigned h, Region const &rect, unsigned step = 4);
+
+    // (re)build the acceleration structure, must be called after
+    // all objects have been added and before tracing any rays
+    void build();
 
     void addObject(ObjectPtr obj);
+
+    // The entry of the material table equal to material, added if there is
+    // none. Entries stay valid as long as the scene.
+    Material const *addMaterial(Material const &material);
     void addLight(Light const &light);
     void setEye(Triple const &position);
 
     unsigned getNumObject();
     unsigned getNumLights();
+    unsigned getNumMaterials() const;
+    Object const &object(unsigned idx) const;
 
     bool shadows() const;
     void shadows(bool);
@@ -52,6 +172,83 @@ public:
 
     unsigned superSamplingFactor() const;
     void superSamplingFactor(unsigned);
+
+    unsigned threads() const;
+    void threads(unsigned);
+
+    unsigned packetSize() const;
+    void packetSize(unsigned);
+
+    bool adaptiveSuperSampling() const;
+    void adaptiveSuperSampling(bool);
+
+    Real contrastThreshold() const;
+    void contrastThreshold(Real);
+
+    // number of primary rays traced by the last call to render
+    unsigned long primaryRays() const;
+
+    // work done by the last call to render
+    RenderStats const &stats() const;
+
+    // measure to record per pixel while rendering
+    Cost heatmap() const;
+    void heatmap(Cost);
+
+    // cost per pixel (row by row) of the last render, empty if the
+    // heatmap is NONE. Includes supersamples, reflection and shadow rays.
+    std::vector<float> const &costs() const;
+
+    // When set, render records for every pixel the objects hit by its
+    // primary and reflection rays (its dependencies). Packets are not
+    // used then.
+    bool recordDependencies() const;
+    void recordDependencies(bool);
+
+    // Dependencies per pixel (row by row) of the last render, a mask of
+    // objectBit of the objects; all bits are set for pixels which were
+    // not recorded (adaptive and progressive renders). Empty when not
+    // recording.
+    std::vector<uint64_t> const &dependencies() const;
+
+    // Bit of object idx in a dependency mask. Objects from 63 on share
+    // the last bit.
+    static uint64_t objectBit(size_t idx);
+
+    // pixels renderIncremental copied from the previous frame
+    unsigned long reusedPixels() const;
+
+    // The pixels render (also in adaptive mode) traces, the others are
+    // left as they are. By default the whole image; a region may extend
+    // beyond the image. Progressive and incremental renders always render
+    // the whole image.
+    Region region() const;
+    void region(Region const &region);
+
+    // While rendering (render, also adaptive, and renderProgressive)
+    // call fun with the state of the render at most every 'seconds'
+    // seconds. It is called by a render thread while the others wait for
+    // it, so it should only copy the state. render checkpoints after a
+    // tile, renderProgressive after a pass of samples. While busy returns
+    // true checkpoints are skipped, before the state is copied. An empty
+    // fun disables checkpoints.
+    void checkpoint(double seconds, CheckpointFun const &fun,
+                    CheckpointBusyFun const &busy = CheckpointBusyFun());
+
+    // Let the next render of an image of the same size, of the same kind
+    // (render or renderProgressive) and with the same settings continue
+    // from state: done tiles (or sample passes) are taken from it, the
+    // rest is traced. The image is the same as without interruption, the
+    // statistics only count the work done after resuming.
+    // @throws std::invalid_argument if state is empty
+    void resume(RenderState state);
+
+    // number of RenderState::tiles of a render of a width x height image
+    static unsigned numTiles(unsigned width, unsigned height);
+
+    // filtering of textures, NEAREST by default
+    Texture::Filter textureFilter() const;
+    void textureFilter(Texture::Filter);
 };
 
 #endif
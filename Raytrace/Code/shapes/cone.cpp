@@ -9,12 +9,12 @@ using namespace std;
 
 #define EPSILON (1e-6)
 
-Cone::CapHit Cone::getCapIntersection(const Vector &center, const Vector &normal, double r, const Ray &ray) {
+Cone::CapHit Cone::getCapIntersection(const Vector &center, const Vector &normal, Real r, const Ray &ray) {
 
     // Intersection with a plane
-    double denom = normal.dot(ray.D);
+    Real denom = normal.dot(ray.D);
     if(denom < -EPSILON) {
-        double t = (center - ray.O).dot(normal) / denom;
+        Real t = (center - ray.O).dot(normal) / denom;
         if(t < 0.0) {
             return CapHit{false, 0, Vector(), Vector()};
         }
@@ -22,30 +22,51 @@ Cone::CapHit Cone::getCapIntersection(const Vector &center, const Vector &normal
     }
     return CapHit{false, 0, Vector(), Vector()};
 }
+bool Cone::capOccludes(const Vector &center, const Vector &normal, Real r2, const Ray &ray, Real tMax) {
+
+    // Intersection with the plane of the cap, seen from either side
+    Real denom = normal.dot(ray.D);
+    if(-EPSILON < denom && denom < EPSILON) {
+        return false;
+    }
+    Real t = (center - ray.O).dot(normal) / denom;
+    if(t <= EPSILON || t >= tMax) {
+        return false;
+    }
+    return (ray.at(t) - center).length_2() <= r2;
+}
+
+void Cone::prepare()
+{
+    d_prepared.axis = b - a;
+    d_prepared.unitAxis = d_prepared.axis.normalized();
+    d_prepared.height = d_prepared.axis.length();
+    d_prepared.r2 = r * r;
+    d_prepared.r2c2 = r * r / d_prepared.axis.length_2();
+}
 
 Hit Cone::intersect(Ray const &ray)
 {
     // Vectro from base center A
     // to cone top B
-    Vector c = b - a;
-    Vector normC = c.normalized();
+    Vector const &normC = d_prepared.unitAxis;
 
-    double r2c2 = r * r / c.length_2();
+    Real r2c2 = d_prepared.r2c2;
     Vector dConeTop = ray.O - b;
-    double dotNormCD = normC.dot(ray.D);
+    Real dotNormCD = normC.dot(ray.D);
 
     // The cone can be viwedas a cylinder with a linearly decreasing radius where at some point B r = 0
     // The previously described formula for the cylinder is modified to fit the decreasing radius.
     // ((p(t) - a) x (b - a))^2 = r^2 * ((b - a).(p(t) - a))^2 / (b - a)^2
     // some of the variables are multiplied by r2c2 due to the fact that the right side of the quation
     // is divided by (b - a)^2
-    double x = ray.D.length_2() - r2c2 * (dotNormCD * dotNormCD) - dotNormCD * dotNormCD;
-    double y = 2 * (ray.D.dot(dConeTop) - r2c2 * ray.D.dot(normC) * dConeTop.dot(normC) - ray.D.dot(normC) * dConeTop.dot(normC));
-    double z = dConeTop.length_2() - r2c2 * dConeTop.dot(normC) * dConeTop.dot(normC) - dConeTop.dot(normC) * dConeTop.dot(normC);
+    Real x = ray.D.length_2() - r2c2 * (dotNormCD * dotNormCD) - dotNormCD * dotNormCD;
+    Real y = 2 * (ray.D.dot(dConeTop) - r2c2 * ray.D.dot(normC) * dConeTop.dot(normC) - ray.D.dot(normC) * dConeTop.dot(normC));
+    Real z = dConeTop.length_2() - r2c2 * dConeTop.dot(normC) * dConeTop.dot(normC) - dConeTop.dot(normC) * dConeTop.dot(normC);
 
     // Substituting in the quadratic formula to obtain possible number
     // of solutions
-    double D = y * y - 4 * x * z;
+    Real D = y * y - 4 * x * z;
     if(D < 0.0) {
         return Hit::NO_HIT();
     }
@@ -54,7 +75,7 @@ Hit Cone::intersect(Ray const &ray)
     // the shortest distance to the ray is needed
     // so only the solution t = (-b - sqrt(D)) / 2a
     // is calcualted
-    double t = (-y - sqrt(D)) / (2 * x);
+    Real t = (-y - sqrt(D)) / (2 * x);
 
     // Point of intersection P
     Vector p = ray.O + t * ray.D;
@@ -62,17 +83,17 @@ Hit Cone::intersect(Ray const &ray)
     // Distance from point A to the
     // perpendicular from the intersecrion point P
     // to the main cone axis AB
-    double alpha = (p - a).dot(normC);
+    Real alpha = (p - a).dot(normC);
 
     // Vector perpendicular to the main axis AB
     // to the point of intersection P
     // (distance between line and point in vector form)
-    Vector q = p - (a + alpha * c.normalized());
+    Vector q = p - (a + alpha * normC);
 
     // distance alpha can be used to restrict
     // the height of the cone. This applies
     // only for the top of the cone
-    if(alpha > c.length()) {
+    if(alpha > d_prepared.height) {
         return Hit::NO_HIT();
     }
 
@@ -107,11 +128,11 @@ Hit Cone::intersect(Ray const &ray)
     Vector k = b - baseK;
 
     // Angle between side of the cone and the base radius
-    double theta = acos(r / k.length());
+    Real theta = acos(r / k.length());
 
     // Length of the side PK where the intersection point
     // P is such that its perpendicular intersects with A
-    double kside = r * sin((acos(-1) / 2) - theta);
+    Real kside = r * sin((acos(-1) / 2) - theta);
 
     // The vector form of the side PK
     Vector ksideVector = kside * k.normalized();
@@ -121,14 +142,64 @@ Hit Cone::intersect(Ray const &ray)
     return Hit(t, N);
 }
 
-Cone::Cone(Point const &a, Point const &b, double r)
+bool Cone::occluded(Ray const &ray, Real tMax)
+{
+    // Same quadratic as in intersect, but both solutions are
+    // candidates and no normal is needed
+    Vector const &normC = d_prepared.unitAxis;
+    Real height = d_prepared.height;
+
+    Real r2c2 = d_prepared.r2c2;
+    Vector dConeTop = ray.O - b;
+    Real dotNormCD = normC.dot(ray.D);
+    Real dotNormCTop = dConeTop.dot(normC);
+
+    Real x = ray.D.length_2() - r2c2 * (dotNormCD * dotNormCD) - dotNormCD * dotNormCD;
+    Real y = 2 * (ray.D.dot(dConeTop) - r2c2 * dotNormCD * dotNormCTop - dotNormCD * dotNormCTop);
+    Real z = dConeTop.length_2() - r2c2 * dotNormCTop * dotNormCTop - dotNormCTop * dotNormCTop;
+
+    Real D = y * y - 4 * x * z;
+    if(D >= 0.0 && x != 0.0) {
+        Real t1 = (-y - sqrt(D)) / (2 * x);
+        Real t2 = (-y + sqrt(D)) / (2 * x);
+        for(Real t : {t1, t2}) {
+            if(t > EPSILON && t < tMax) {
+                // Only the part of the double cone between A and B counts
+                Real alpha = (ray.at(t) - a).dot(normC);
+                if(alpha >= 0.0 && alpha <= height) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return capOccludes(a, -normC, d_prepared.r2, ray, tMax);
+}
+
+Cone::Cone(Point const &a, Point const &b, Real r)
 :
     a(a),
     b(b),
     r(r)
-{}
+{
+    prepare();
+}
 
 
 Point Cone::mapTexture(Ray const &ray, Hit const &hit) {
     return Point{0, 0, 1};
 }
+
+AABB Cone::boundingBox() const
+{
+    // The base cap fits in a cube with sides 2r around A, the top is B
+    Vector extent(r, r, r);
+    AABB box(a - extent, a + extent);
+    box.extend(b);
+    return box;
+}
+
+char const *Cone::typeName() const
+{
+    return "cone";
+}
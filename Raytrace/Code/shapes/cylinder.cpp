@@ -8,12 +8,12 @@
 
 using namespace std;
 
-Cylinder::CapHit Cylinder::getCapIntersection(const Vector &center, const Vector &normal, double r, const Ray &ray) {
+Cylinder::CapHit Cylinder::getCapIntersection(const Vector &center, const Vector &normal, Real r, const Ray &ray) {
 
     // Intersection with a plane
-    double denom = normal.dot(ray.D);
+    Real denom = normal.dot(ray.D);
     if(denom < -EPSILON) {
-        double t = (center - ray.O).dot(normal) / denom;
+        Real t = (center - ray.O).dot(normal) / denom;
         if(t < 0.0) {
             return CapHit{false, 0, Vector(), Vector()};
         }
@@ -22,11 +22,34 @@ Cylinder::CapHit Cylinder::getCapIntersection(const Vector &center, const Vector
     return CapHit{false, 0, Vector(), Vector()};
 }
 
+bool Cylinder::capOccludes(const Vector &center, const Vector &normal, Real r2, const Ray &ray, Real tMax) {
+
+    // Intersection with the plane of the cap, seen from either side
+    Real denom = normal.dot(ray.D);
+    if(-EPSILON < denom && denom < EPSILON) {
+        return false;
+    }
+    Real t = (center - ray.O).dot(normal) / denom;
+    if(t <= EPSILON || t >= tMax) {
+        return false;
+    }
+    return (ray.at(t) - center).length_2() <= r2;
+}
+
+void Cylinder::prepare()
+{
+    d_prepared.axis = b - a;
+    d_prepared.unitAxis = d_prepared.axis.normalized();
+    d_prepared.height = d_prepared.axis.length();
+    d_prepared.r2 = r * r;
+    d_prepared.z = r * r * d_prepared.axis.length_2();
+}
 
 Hit Cylinder::intersect(Ray const &ray)
 {
     // Vector going through both centers of the cylinder
-    Vector c = b - a;
+    Vector const &c = d_prepared.axis;
+    Vector const &n = d_prepared.unitAxis;
 
     // Deriving the formula for a cylinder
     // ((p(t) - a) x (b - a))^2 = r^2 * (b - a)^2
@@ -39,11 +62,11 @@ Hit Cylinder::intersect(Ray const &ray)
     // tfor t1,2 solutions
     Vector x = (ray.O - a).cross(c);
     Vector y = ray.D.cross(c);
-    double z = r * r * c.length_2();
+    Real z = d_prepared.z;
 
     // Discriminant
     // D = b^2 - 4ac = 4(x.y)^2 - 4y^2(x^2 - z)
-    double D = 4 * x.dot(y) * x.dot(y) - 4 * y.length_2() * (x.length_2() - z);
+    Real D = 4 * x.dot(y) * x.dot(y) - 4 * y.length_2() * (x.length_2() - z);
 
     if(D < 0.0) {
         return Hit::NO_HIT();
@@ -53,7 +76,7 @@ Hit Cylinder::intersect(Ray const &ray)
     // the shortest distance to the ray is needed
     // so only the solution t = (-b - sqrt(D)) / 2a
     // is calcualted
-    double t = (-2 * x.dot(y) - sqrt(D)) / (2 * y.length_2());
+    Real t = (-2 * x.dot(y) - sqrt(D)) / (2 * y.length_2());
 
     // Point of intersection
     Point p = ray.O + t * ray.D;
@@ -61,12 +84,12 @@ Hit Cylinder::intersect(Ray const &ray)
     // Distance from point A to the
     // perpendicular from the intersecrion point P
     // to the main cylinder axis AB
-    double alpha = (p - a).dot(c.normalized());
+    Real alpha = (p - a).dot(n);
 
     // Vector perpendicular to the main axis AB
     // to the point of intersection P
     // (distance between line and point in vector form)
-    Vector q = p - (a + alpha * c.normalized());
+    Vector q = p - (a + alpha * n);
 
     // Normal vector is the same as vector Q
     // going oitside of the cylinder
@@ -74,13 +97,12 @@ Hit Cylinder::intersect(Ray const &ray)
 
     // distance alpha can be used to restrict
     // the height of the cylinder
-    if(alpha < 0.0 || alpha > c.length()) {
+    if(alpha < 0.0 || alpha > d_prepared.height) {
 
         // Ray might still intersect one of the two caps
         // of the cylinder (top and bottom)
         // The normal vector for the caps is the vector C
         // normalized. For the bottom cap its direction is reversed
-        Vector n = c.normalized();
         CapHit bottom = getCapIntersection(a, -n, r, ray);
         CapHit top = getCapIntersection(b, n, r, ray);
         CapHit selected;
@@ -111,14 +133,59 @@ Hit Cylinder::intersect(Ray const &ray)
     return Hit(t, N);
 }
 
-Cylinder::Cylinder(Point const &a, Point const &b, double r)
+bool Cylinder::occluded(Ray const &ray, Real tMax)
+{
+    // Same quadratic as in intersect, but both solutions are
+    // candidates and no normal is needed
+    Vector const &c = d_prepared.axis;
+    Vector const &n = d_prepared.unitAxis;
+    Real height = d_prepared.height;
+
+    Vector x = (ray.O - a).cross(c);
+    Vector y = ray.D.cross(c);
+    Real z = d_prepared.z;
+
+    Real D = 4 * x.dot(y) * x.dot(y) - 4 * y.length_2() * (x.length_2() - z);
+    if(D >= 0.0 && y.length_2() > 0.0) {
+        Real t1 = (-2 * x.dot(y) - sqrt(D)) / (2 * y.length_2());
+        Real t2 = (-2 * x.dot(y) + sqrt(D)) / (2 * y.length_2());
+        for(Real t : {t1, t2}) {
+            if(t > EPSILON && t < tMax) {
+                Real alpha = (ray.at(t) - a).dot(n);
+                if(alpha >= 0.0 && alpha <= height) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return capOccludes(a, n, d_prepared.r2, ray, tMax) || capOccludes(b, n, d_prepared.r2, ray, tMax);
+}
+
+Cylinder::Cylinder(Point const &a, Point const &b, Real r)
 :
     a(a),
     b(b),
     r(r)
-{}
+{
+    prepare();
+}
 
 
 Point Cylinder::mapTexture(Ray const &ray, Hit const &hit) {
     return Point{0, 0, 1};
 }
+
+AABB Cylinder::boundingBox() const
+{
+    // Both caps fit in a cube with sides 2r around their centers
+    Vector extent(r, r, r);
+    AABB box(a - extent, a + extent);
+    box.extend(AABB(b - extent, b + extent));
+    return box;
+}
+
+char const *Cylinder::typeName() const
+{
+    return "cylinder";
+}
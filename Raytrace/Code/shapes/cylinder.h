@@ -13,22 +13,38 @@ class Cylinder: public Object
     // time constraints no such class was created.
     typedef struct {
         bool isHit;
-        double t;
+        Real t;
         Vector normal;
         Vector center;
     } CapHit;
 
-    static CapHit getCapIntersection(const Vector &center, const Vector &normal, double r, const Ray &ray);
+    static CapHit getCapIntersection(const Vector &center, const Vector &normal, Real r, const Ray &ray);
+    static bool capOccludes(const Vector &center, const Vector &normal, Real r2, const Ray &ray, Real tMax);
+
+    // Values of intersect and occluded which do not depend on the ray
+    struct Prepared
+    {
+        Vector axis;        // b - a
+        Vector unitAxis;
+        Real height;        // |b - a|
+        Real r2;            // r^2
+        Real z;             // r^2 |b - a|^2, constant term of the quadratic
+    } d_prepared;
+
     public:
-        Cylinder(Point const &a, Point const &b, double r);
+        Cylinder(Point const &a, Point const &b, Real r);
 
+        virtual void prepare();
         virtual Hit intersect(Ray const &ray);
+        virtual bool occluded(Ray const &ray, Real tMax);
 
         Point const a;
         Point const b;
-        double r;
+        Real r;
 
         Point mapTexture(Ray const &ray, Hit const &hit);
+        AABB boundingBox() const;
+        char const *typeName() const;
 };
 
 #endif
@@ -6,12 +6,31 @@ Hit Example::intersect(Ray const &ray)
 {
     /* Your intersect calculation goes here */
 
-    double t = 0 /* = ... */;
+    Real t = 0 /* = ... */;
     Vector N /* = ... */;
 
     return Hit(t, N);
 }
 
+bool Example::occluded(Ray const &ray, Real tMax)
+{
+    /* Is the shape hit anywhere between the origin and tMax? */
+
+    return false;
+}
+
+AABB Example::boundingBox() const
+{
+    /* Smallest box containing all points of your shape */
+
+    return AABB(/* min, max */);
+}
+
+char const *Example::typeName() const
+{
+    return "example";
+}
+
 Example::Example(/* YOUR DATAMEMBERS HERE */)
 //:
 // See sphere.cpp how to initialize your data members
@@ -9,6 +9,9 @@ class Example: public Object
         Example(/* YOUR DATA MEMBERS HERE*/);
 
         virtual Hit intersect(Ray const &ray);
+        virtual bool occluded(Ray const &ray, Real tMax);
+        virtual AABB boundingBox() const;
+        virtual char const *typeName() const;
 
         /* YOUR DATA MEMBERS HERE*/
 };
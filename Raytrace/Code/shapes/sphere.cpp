@@ -1,29 +1,39 @@
 #include "sphere.h"
+#include "../cpu.h"
 #include "../debug.h"
 
 #include <cmath>
 #include <iostream>
+#include <limits>
+
+// The kernels work on doubles, single precision builds use the scalar code
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(RAY_SINGLE_PRECISION)
+#include <immintrin.h>
+#define SIMD_KERNELS
+#endif
 
 using namespace std;
 
+#define EPSILON (1e-6)
+
 Hit Sphere::intersect(Ray const &ray)
 {
     // Vector from ray origin to center of sphere
     Vector OC = (ray.O - center);
 
-    double a = ray.D.length_2();
-    double b = 2 * OC.dot(ray.D);
-    double c = OC.length_2() - radius * radius;
+    Real a = ray.D.length_2();
+    Real b = 2 * OC.dot(ray.D);
+    Real c = OC.length_2() - d_prepared.radius2;
 
-    double D = b * b - 4 * a * c;
+    Real D = b * b - 4 * a * c;
 
     if(D < 0.0) {
         return Hit::NO_HIT();
     }
-    double t1 = (-b + sqrt(D)) / (2 * a);
-    double t2 = (-b - sqrt(D)) / (2 * a);
+    Real t1 = (-b + sqrt(D)) / (2 * a);
+    Real t2 = (-b - sqrt(D)) / (2 * a);
 
-    double t = std::min(t1, t2);
+    Real t = std::min(t1, t2);
     if(t < 0.0) {
         t = std::max(t1, t2);
         if(t < sqrt(std::numeric_limits<decltype(t)>::epsilon())) {
@@ -37,67 +47,257 @@ Hit Sphere::intersect(Ray const &ray)
     return Hit(t,N);
 }
 
-Sphere::Sphere(Point const &center, double radius, double rotationAngle, Vector rotationAxis)
+#ifdef SIMD_KERNELS
+
+// The packet kernels perform exactly the same floating point operations in
+// the same order as Sphere::intersect, so both agree on every bit of the
+// hit.
+
+__attribute__((target("avx")))
+static void intersectSphereAVX(RayPacket const &packet, Point const &center, Real radius2, unsigned mask, PacketHits &hits)
+{
+    __m256d const cx = _mm256_set1_pd(center.x);
+    __m256d const cy = _mm256_set1_pd(center.y);
+    __m256d const cz = _mm256_set1_pd(center.z);
+    __m256d const r2 = _mm256_set1_pd(radius2);
+    __m256d const zero = _mm256_setzero_pd();
+    __m256d const two = _mm256_set1_pd(2.0);
+    __m256d const four = _mm256_set1_pd(4.0);
+    __m256d const sign = _mm256_set1_pd(-0.0);
+    __m256d const eps = _mm256_set1_pd(sqrt(numeric_limits<Real>::epsilon()));
+    __m256d const nan = _mm256_set1_pd(numeric_limits<Real>::quiet_NaN());
+    __m256d const one = _mm256_set1_pd(1.0);
+
+    for (unsigned lane = 0; lane < packet.size; lane += 4)
+    {
+        if (((mask >> lane) & 0xF) == 0)     // no active lanes in this group
+            continue;
+
+        __m256d dx = _mm256_loadu_pd(packet.dx + lane);
+        __m256d dy = _mm256_loadu_pd(packet.dy + lane);
+        __m256d dz = _mm256_loadu_pd(packet.dz + lane);
+        __m256d ocx = _mm256_sub_pd(_mm256_loadu_pd(packet.ox + lane), cx);
+        __m256d ocy = _mm256_sub_pd(_mm256_loadu_pd(packet.oy + lane), cy);
+        __m256d ocz = _mm256_sub_pd(_mm256_loadu_pd(packet.oz + lane), cz);
+
+        __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+        __m256d b = _mm256_mul_pd(two, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz)));
+        __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)), r2);
+        __m256d D = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(_mm256_mul_pd(four, a), c));
+        if (_mm256_movemask_pd(_mm256_cmp_pd(D, zero, _CMP_LT_OQ)) == 0xF)
+        {
+            _mm256_storeu_pd(hits.t + lane, nan);
+            continue;
+        }
+
+        __m256d sqrtD = _mm256_sqrt_pd(D);
+        __m256d minusB = _mm256_xor_pd(b, sign);
+        __m256d twoA = _mm256_mul_pd(two, a);
+        __m256d t1 = _mm256_div_pd(_mm256_add_pd(minusB, sqrtD), twoA);
+        __m256d t2 = _mm256_div_pd(_mm256_sub_pd(minusB, sqrtD), twoA);
+
+        // std::min(t1, t2) and std::max(t1, t2)
+        __m256d tNear = _mm256_blendv_pd(t1, t2, _mm256_cmp_pd(t2, t1, _CMP_LT_OQ));
+        __m256d tFar = _mm256_blendv_pd(t1, t2, _mm256_cmp_pd(t1, t2, _CMP_LT_OQ));
+        __m256d behind = _mm256_cmp_pd(tNear, zero, _CMP_LT_OQ);
+        __m256d tHit = _mm256_blendv_pd(tNear, tFar, behind);
+        __m256d miss = _mm256_or_pd(_mm256_cmp_pd(D, zero, _CMP_LT_OQ),
+                                    _mm256_and_pd(behind, _mm256_cmp_pd(tFar, eps, _CMP_LT_OQ)));
+        _mm256_storeu_pd(hits.t + lane, _mm256_blendv_pd(tHit, nan, miss));
+        if (_mm256_movemask_pd(miss) == 0xF)
+            continue;
+
+        // N = (O + t * D - center).normalized()
+        __m256d nx = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(packet.ox + lane), _mm256_mul_pd(tHit, dx)), cx);
+        __m256d ny = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(packet.oy + lane), _mm256_mul_pd(tHit, dy)), cy);
+        __m256d nz = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(packet.oz + lane), _mm256_mul_pd(tHit, dz)), cz);
+        __m256d len = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, nx), _mm256_mul_pd(ny, ny)), _mm256_mul_pd(nz, nz)));
+        __m256d invLen = _mm256_div_pd(one, len);
+        _mm256_storeu_pd(hits.nx + lane, _mm256_mul_pd(nx, invLen));
+        _mm256_storeu_pd(hits.ny + lane, _mm256_mul_pd(ny, invLen));
+        _mm256_storeu_pd(hits.nz + lane, _mm256_mul_pd(nz, invLen));
+    }
+}
+
+static inline __m128d select(__m128d mask, __m128d ifTrue, __m128d ifFalse)
+{
+    return _mm_or_pd(_mm_and_pd(mask, ifTrue), _mm_andnot_pd(mask, ifFalse));
+}
+
+static void intersectSphereSSE2(RayPacket const &packet, Point const &center, Real radius2, unsigned mask, PacketHits &hits)
+{
+    __m128d const cx = _mm_set1_pd(center.x);
+    __m128d const cy = _mm_set1_pd(center.y);
+    __m128d const cz = _mm_set1_pd(center.z);
+    __m128d const r2 = _mm_set1_pd(radius2);
+    __m128d const zero = _mm_setzero_pd();
+    __m128d const two = _mm_set1_pd(2.0);
+    __m128d const four = _mm_set1_pd(4.0);
+    __m128d const sign = _mm_set1_pd(-0.0);
+    __m128d const eps = _mm_set1_pd(sqrt(numeric_limits<Real>::epsilon()));
+    __m128d const nan = _mm_set1_pd(numeric_limits<Real>::quiet_NaN());
+    __m128d const one = _mm_set1_pd(1.0);
+
+    for (unsigned lane = 0; lane < packet.size; lane += 2)
+    {
+        if (((mask >> lane) & 0x3) == 0)     // no active lanes in this group
+            continue;
+
+        __m128d dx = _mm_loadu_pd(packet.dx + lane);
+        __m128d dy = _mm_loadu_pd(packet.dy + lane);
+        __m128d dz = _mm_loadu_pd(packet.dz + lane);
+        __m128d ocx = _mm_sub_pd(_mm_loadu_pd(packet.ox + lane), cx);
+        __m128d ocy = _mm_sub_pd(_mm_loadu_pd(packet.oy + lane), cy);
+        __m128d ocz = _mm_sub_pd(_mm_loadu_pd(packet.oz + lane), cz);
+
+        __m128d a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+        __m128d b = _mm_mul_pd(two, _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz)));
+        __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)), r2);
+        __m128d D = _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(_mm_mul_pd(four, a), c));
+        if (_mm_movemask_pd(_mm_cmplt_pd(D, zero)) == 0x3)
+        {
+            _mm_storeu_pd(hits.t + lane, nan);
+            continue;
+        }
+
+        __m128d sqrtD = _mm_sqrt_pd(D);
+        __m128d minusB = _mm_xor_pd(b, sign);
+        __m128d twoA = _mm_mul_pd(two, a);
+        __m128d t1 = _mm_div_pd(_mm_add_pd(minusB, sqrtD), twoA);
+        __m128d t2 = _mm_div_pd(_mm_sub_pd(minusB, sqrtD), twoA);
+
+        // std::min(t1, t2) and std::max(t1, t2)
+        __m128d tNear = select(_mm_cmplt_pd(t2, t1), t2, t1);
+        __m128d tFar = select(_mm_cmplt_pd(t1, t2), t2, t1);
+        __m128d behind = _mm_cmplt_pd(tNear, zero);
+        __m128d tHit = select(behind, tFar, tNear);
+        __m128d miss = _mm_or_pd(_mm_cmplt_pd(D, zero),
+                                 _mm_and_pd(behind, _mm_cmplt_pd(tFar, eps)));
+        _mm_storeu_pd(hits.t + lane, select(miss, nan, tHit));
+        if (_mm_movemask_pd(miss) == 0x3)
+            continue;
+
+        // N = (O + t * D - center).normalized()
+        __m128d nx = _mm_sub_pd(_mm_add_pd(_mm_loadu_pd(packet.ox + lane), _mm_mul_pd(tHit, dx)), cx);
+        __m128d ny = _mm_sub_pd(_mm_add_pd(_mm_loadu_pd(packet.oy + lane), _mm_mul_pd(tHit, dy)), cy);
+        __m128d nz = _mm_sub_pd(_mm_add_pd(_mm_loadu_pd(packet.oz + lane), _mm_mul_pd(tHit, dz)), cz);
+        __m128d len = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, nx), _mm_mul_pd(ny, ny)), _mm_mul_pd(nz, nz)));
+        __m128d invLen = _mm_div_pd(one, len);
+        _mm_storeu_pd(hits.nx + lane, _mm_mul_pd(nx, invLen));
+        _mm_storeu_pd(hits.ny + lane, _mm_mul_pd(ny, invLen));
+        _mm_storeu_pd(hits.nz + lane, _mm_mul_pd(nz, invLen));
+    }
+}
+
+#endif
+
+void Sphere::intersectPacket(RayPacket const &packet, unsigned mask, PacketHits &hits)
+{
+#ifdef SIMD_KERNELS
+    if (cpu::hasAVX())
+        intersectSphereAVX(packet, center, d_prepared.radius2, mask, hits);
+    else
+        intersectSphereSSE2(packet, center, d_prepared.radius2, mask, hits);
+#else
+    Object::intersectPacket(packet, mask, hits);
+#endif
+}
+
+bool Sphere::occluded(Ray const &ray, Real tMax)
+{
+    Vector OC = (ray.O - center);
+
+    Real a = ray.D.length_2();
+    Real b = 2 * OC.dot(ray.D);
+    Real c = OC.length_2() - d_prepared.radius2;
+
+    Real D = b * b - 4 * a * c;
+    if(D < 0.0) {
+        return false;
+    }
+
+    // Either of the two intersections will do
+    Real t1 = (-b - sqrt(D)) / (2 * a);
+    Real t2 = (-b + sqrt(D)) / (2 * a);
+    return (t1 > EPSILON && t1 < tMax) || (t2 > EPSILON && t2 < tMax);
+}
+
+Sphere::Sphere(Point const &center, Real radius, Real rotationAngle, Vector rotationAxis)
 :
     center(center),
     radius(radius),
     rotationAxis(rotationAxis.normalized()),
     rotationAngle(rotationAngle)
-{}
-
-
-Point Sphere::mapTexture(Ray const &ray, Hit const &hit) {
-    // Texture map is made from rectangular image (highly deformed).
-    // The line at y = 0 and y = height - 1 of the image correspond to north and south poles (as points)
-    // So the closer to the poles we get, mode deformed the texture is.
+{
+    prepare();
+}
 
-    // Texture X is defined between coordinates 0.0 and 1.0. It wraps around after these coordinates.
-    // Texture Y is defined between coordinates 0.0 and 1.0. It clamps to these coordinate.
+void Sphere::prepare()
+{
+    d_prepared.radius2 = radius * radius;
 
     // Texture is always cut at vector X (1, 0, 0), initially. Then a sphere is rotated around an axis.
     // So we need to know the new vector of rotation.
-    //Vector rotationAxis(0.0, 0.0, 1.0);
-    //double rotationAngle = 0.0;
-
     Vector X(1, 0, 0);
 
-    Vector N_2D = Vector(hit.N.x, hit.N.y, 0.0);
-    N_2D.normalize();
-
     // Rodrigues rotation formula
     Vector X_rotated = X * cos(rotationAngle) + rotationAxis.cross(X) * sin(rotationAngle) + rotationAxis * rotationAxis.dot(X) * (1 - cos(rotationAngle));
 
     // Now we look at rotationAxis as a normal vector to a plane.
     // U coordinates are mapped too the circle formed on that plane.
+    // X vector however is not on that plane. But the U coordinates are the same for all latitudes,
+    // so we can safely project it onto the plane.
+    d_prepared.uAxis = rotationAxis.cross(X_rotated.cross(rotationAxis)).normalized();
+    d_prepared.vAxis = rotationAxis.cross(d_prepared.uAxis);
+}
+
+
+Point Sphere::mapTexture(Ray const &ray, Hit const &hit) {
+    // Texture map is made from rectangular image (highly deformed).
+    // The line at y = 0 and y = height - 1 of the image correspond to north and south poles (as points)
+    // So the closer to the poles we get, mode deformed the texture is.
+
+    // Texture X is defined between coordinates 0.0 and 1.0. It wraps around after these coordinates.
+    // Texture Y is defined between coordinates 0.0 and 1.0. It clamps to these coordinate.
+
+    // The U axes on the plane normal to rotationAxis are fixed per sphere, see prepare.
+    Vector const &U_X_axis = d_prepared.uAxis;
+    Vector const &U_Y_axis = d_prepared.vAxis;
 
     // Remainder: Projection over plane is: Nx(SxN), where N is the normal vector for the plane, S is the source vector.
     Vector U_N_projection = rotationAxis.cross(hit.N.cross(rotationAxis)).normalized();
 
-    // X vector however is not on that plane. But the U coordinates are the same for all latitudes,
-    // so we can safely project it onto the plane.
-    Vector U_X_axis = rotationAxis.cross(X_rotated.cross(rotationAxis)).normalized();
-    Vector U_Y_axis = rotationAxis.cross(U_X_axis);
-
     // Now both vectors are onto the plane and have length 1. We can create trigonometric circumference and measure
     // the angle between them. We could measure the sine and cosine and to the atan(sin/cos) to find it.
     // Sine is given by length of the cross product vector, cosine is given by dot product.
-    double U_X_N_radians = atan2(U_Y_axis.dot(U_N_projection), U_X_axis.dot(U_N_projection));
+    Real U_X_N_radians = atan2(U_Y_axis.dot(U_N_projection), U_X_axis.dot(U_N_projection));
 
     // Now we have in ranges:
     // [-pi; pi] / pi = [-1; 1]
     // [-1; 1] / 2 = [-0.5; 0.5]
     // [-0.5; 0.5] + 0.5 = [0.0; 1.0] = U coordinates
-    double u = fmod(1.0 + U_X_N_radians / M_PI / 2.0, 1.0);
+    Real u = fmod(1.0 + U_X_N_radians / M_PI / 2.0, 1.0);
 
     // V coordinates are based solely between the difference of the angle between rotationAxis and the normal.
     // If they point in the same direction, dot is 1, acos(1) is 0
     // If they point in opposite direction, dot is -1, acos(-1) is pi
     // V is directly mapped in that range [0; pi]
-    double rad_N_R_V = acos(rotationAxis.dot(hit.N));
+    Real rad_N_R_V = acos(rotationAxis.dot(hit.N));
 
     // Now we have in ranges:
     // [0; pi] / pi = [0.0; 1.0]
-    double v = rad_N_R_V / M_PI;
+    Real v = rad_N_R_V / M_PI;
 
     return Point{u, v, 0};
 }
+
+AABB Sphere::boundingBox() const
+{
+    Vector extent(radius, radius, radius);
+    return AABB(center - extent, center + extent);
+}
+
+char const *Sphere::typeName() const
+{
+    return "sphere";
+}
@@ -5,17 +5,31 @@
 
 class Sphere: public Object
 {
+    // Values of intersect, occluded and mapTexture which do not depend on
+    // the ray
+    struct Prepared
+    {
+        Real radius2;       // radius^2
+        Vector uAxis;       // where u = 0, the rotated X axis projected on
+        Vector vAxis;       // the equator plane, and where u = 0.25
+    } d_prepared;
+
     public:
-        Sphere(Point const &center, double radius, double rotationAngle = 0.0, Vector rotationAxis = Vector(0.0, 0.0, 1.0));
+        Sphere(Point const &center, Real radius, Real rotationAngle = 0.0, Vector rotationAxis = Vector(0.0, 0.0, 1.0));
 
+        virtual void prepare();
         virtual Hit intersect(Ray const &ray);
+        virtual bool occluded(Ray const &ray, Real tMax);
+        virtual void intersectPacket(RayPacket const &packet, unsigned mask, PacketHits &hits);
 
         Point const center;
-        double const radius;
+        Real const radius;
         Vector rotationAxis;
-        double rotationAngle;
+        Real rotationAngle;
 
         Point mapTexture(Ray const &ray, Hit const &hit);
+        AABB boundingBox() const;
+        char const *typeName() const;
 };
 
 #endif
@@ -1,7 +1,15 @@
 #include "triangle.h"
+#include "../cpu.h"
 
 #include <cmath>
 #include <iostream>
+#include <limits>
+
+// The kernels work on doubles, single precision builds use the scalar code
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(RAY_SINGLE_PRECISION)
+#include <immintrin.h>
+#define SIMD_KERNELS
+#endif
 
 using namespace std;
 
@@ -9,27 +17,24 @@ using namespace std;
 
 Hit Triangle::intersect(Ray const &ray)
 {
-    Vector edge1 = v1 - v3;
-    Vector edge2 = v2 - v3;
-
     // Möller–Trumbore intersection
     Vector h = ray.D.cross(edge2);
-    double a = edge1.dot(h);
+    Real a = edge1.dot(h);
     if(-EPSILON < a && a < EPSILON) {
         return Hit::NO_HIT();
     }
-    double f = 1 / a;
+    Real f = 1 / a;
     Vector s = ray.O - v3;
-    double u = f * (s.dot(h));
+    Real u = f * (s.dot(h));
     if(u < 0.0 - EPSILON || u > 1.0 + EPSILON) {
         return Hit::NO_HIT();
     }
     Vector q = s.cross(edge1);
-    double v = f * ray.D.dot(q);
+    Real v = f * ray.D.dot(q);
     if(v < 0.0 - EPSILON || (u + v) > 1.0 + EPSILON) {
         return Hit::NO_HIT();
     }
-    double t = f * edge2.dot(q);
+    Real t = f * edge2.dot(q);
     if(t < EPSILON) {
         return Hit::NO_HIT();
     }
@@ -39,6 +44,180 @@ Hit Triangle::intersect(Ray const &ray)
     return Hit(t, N);
 }
 
+#ifdef SIMD_KERNELS
+
+// The packet kernels perform exactly the same floating point operations in
+// the same order as Triangle::intersect, so both agree on every bit of the
+// hit.
+
+__attribute__((target("avx")))
+static void intersectTriangleAVX(RayPacket const &packet, Triangle const &tri, unsigned mask, PacketHits &hits)
+{
+    Vector const &edge1 = tri.edge1;
+    Vector const &edge2 = tri.edge2;
+    __m256d const e1x = _mm256_set1_pd(edge1.x);
+    __m256d const e1y = _mm256_set1_pd(edge1.y);
+    __m256d const e1z = _mm256_set1_pd(edge1.z);
+    __m256d const e2x = _mm256_set1_pd(edge2.x);
+    __m256d const e2y = _mm256_set1_pd(edge2.y);
+    __m256d const e2z = _mm256_set1_pd(edge2.z);
+    __m256d const one = _mm256_set1_pd(1.0);
+    __m256d const eps = _mm256_set1_pd(EPSILON);
+    __m256d const minusEps = _mm256_set1_pd(0.0 - EPSILON);
+    __m256d const onePlusEps = _mm256_set1_pd(1.0 + EPSILON);
+    __m256d const nan = _mm256_set1_pd(numeric_limits<Real>::quiet_NaN());
+
+    for (unsigned lane = 0; lane < packet.size; lane += 4)
+    {
+        if (((mask >> lane) & 0xF) == 0)     // no active lanes in this group
+            continue;
+
+        __m256d dx = _mm256_loadu_pd(packet.dx + lane);
+        __m256d dy = _mm256_loadu_pd(packet.dy + lane);
+        __m256d dz = _mm256_loadu_pd(packet.dz + lane);
+
+        __m256d hx = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+        __m256d hy = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+        __m256d hz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+        __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, hx), _mm256_mul_pd(e1y, hy)), _mm256_mul_pd(e1z, hz));
+        __m256d miss = _mm256_and_pd(_mm256_cmp_pd(minusEps, a, _CMP_LT_OQ), _mm256_cmp_pd(a, eps, _CMP_LT_OQ));
+
+        __m256d f = _mm256_div_pd(one, a);
+        __m256d sx = _mm256_sub_pd(_mm256_loadu_pd(packet.ox + lane), _mm256_set1_pd(tri.v3.x));
+        __m256d sy = _mm256_sub_pd(_mm256_loadu_pd(packet.oy + lane), _mm256_set1_pd(tri.v3.y));
+        __m256d sz = _mm256_sub_pd(_mm256_loadu_pd(packet.oz + lane), _mm256_set1_pd(tri.v3.z));
+        __m256d u = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, hx), _mm256_mul_pd(sy, hy)), _mm256_mul_pd(sz, hz)));
+        miss = _mm256_or_pd(miss, _mm256_cmp_pd(u, minusEps, _CMP_LT_OQ));
+        miss = _mm256_or_pd(miss, _mm256_cmp_pd(u, onePlusEps, _CMP_GT_OQ));
+        if (_mm256_movemask_pd(miss) == 0xF)
+        {
+            _mm256_storeu_pd(hits.t + lane, nan);
+            continue;
+        }
+
+        __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+        __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+        __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+        __m256d v = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz)));
+        miss = _mm256_or_pd(miss, _mm256_cmp_pd(v, minusEps, _CMP_LT_OQ));
+        miss = _mm256_or_pd(miss, _mm256_cmp_pd(_mm256_add_pd(u, v), onePlusEps, _CMP_GT_OQ));
+
+        __m256d tHit = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz)));
+        miss = _mm256_or_pd(miss, _mm256_cmp_pd(tHit, eps, _CMP_LT_OQ));
+        _mm256_storeu_pd(hits.t + lane, _mm256_blendv_pd(tHit, nan, miss));
+        if (_mm256_movemask_pd(miss) == 0xF)
+            continue;
+
+        // N = u * n1 + v * n2 + (1 - u - v) * n3
+        __m256d w = _mm256_sub_pd(_mm256_sub_pd(one, u), v);
+        _mm256_storeu_pd(hits.nx + lane, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(u, _mm256_set1_pd(tri.n1.x)), _mm256_mul_pd(v, _mm256_set1_pd(tri.n2.x))), _mm256_mul_pd(w, _mm256_set1_pd(tri.n3.x))));
+        _mm256_storeu_pd(hits.ny + lane, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(u, _mm256_set1_pd(tri.n1.y)), _mm256_mul_pd(v, _mm256_set1_pd(tri.n2.y))), _mm256_mul_pd(w, _mm256_set1_pd(tri.n3.y))));
+        _mm256_storeu_pd(hits.nz + lane, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(u, _mm256_set1_pd(tri.n1.z)), _mm256_mul_pd(v, _mm256_set1_pd(tri.n2.z))), _mm256_mul_pd(w, _mm256_set1_pd(tri.n3.z))));
+    }
+}
+
+static void intersectTriangleSSE2(RayPacket const &packet, Triangle const &tri, unsigned mask, PacketHits &hits)
+{
+    Vector const &edge1 = tri.edge1;
+    Vector const &edge2 = tri.edge2;
+    __m128d const e1x = _mm_set1_pd(edge1.x);
+    __m128d const e1y = _mm_set1_pd(edge1.y);
+    __m128d const e1z = _mm_set1_pd(edge1.z);
+    __m128d const e2x = _mm_set1_pd(edge2.x);
+    __m128d const e2y = _mm_set1_pd(edge2.y);
+    __m128d const e2z = _mm_set1_pd(edge2.z);
+    __m128d const one = _mm_set1_pd(1.0);
+    __m128d const eps = _mm_set1_pd(EPSILON);
+    __m128d const minusEps = _mm_set1_pd(0.0 - EPSILON);
+    __m128d const onePlusEps = _mm_set1_pd(1.0 + EPSILON);
+    __m128d const nan = _mm_set1_pd(numeric_limits<Real>::quiet_NaN());
+
+    for (unsigned lane = 0; lane < packet.size; lane += 2)
+    {
+        if (((mask >> lane) & 0x3) == 0)     // no active lanes in this group
+            continue;
+
+        __m128d dx = _mm_loadu_pd(packet.dx + lane);
+        __m128d dy = _mm_loadu_pd(packet.dy + lane);
+        __m128d dz = _mm_loadu_pd(packet.dz + lane);
+
+        __m128d hx = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+        __m128d hy = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+        __m128d hz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+        __m128d a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, hx), _mm_mul_pd(e1y, hy)), _mm_mul_pd(e1z, hz));
+        __m128d miss = _mm_and_pd(_mm_cmplt_pd(minusEps, a), _mm_cmplt_pd(a, eps));
+
+        __m128d f = _mm_div_pd(one, a);
+        __m128d sx = _mm_sub_pd(_mm_loadu_pd(packet.ox + lane), _mm_set1_pd(tri.v3.x));
+        __m128d sy = _mm_sub_pd(_mm_loadu_pd(packet.oy + lane), _mm_set1_pd(tri.v3.y));
+        __m128d sz = _mm_sub_pd(_mm_loadu_pd(packet.oz + lane), _mm_set1_pd(tri.v3.z));
+        __m128d u = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(sx, hx), _mm_mul_pd(sy, hy)), _mm_mul_pd(sz, hz)));
+        miss = _mm_or_pd(miss, _mm_cmplt_pd(u, minusEps));
+        miss = _mm_or_pd(miss, _mm_cmpgt_pd(u, onePlusEps));
+        if (_mm_movemask_pd(miss) == 0x3)
+        {
+            _mm_storeu_pd(hits.t + lane, nan);
+            continue;
+        }
+
+        __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, e1z), _mm_mul_pd(sz, e1y));
+        __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, e1x), _mm_mul_pd(sx, e1z));
+        __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, e1y), _mm_mul_pd(sy, e1x));
+        __m128d v = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)), _mm_mul_pd(dz, qz)));
+        miss = _mm_or_pd(miss, _mm_cmplt_pd(v, minusEps));
+        miss = _mm_or_pd(miss, _mm_cmpgt_pd(_mm_add_pd(u, v), onePlusEps));
+
+        __m128d tHit = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_mul_pd(e2y, qy)), _mm_mul_pd(e2z, qz)));
+        miss = _mm_or_pd(miss, _mm_cmplt_pd(tHit, eps));
+        _mm_storeu_pd(hits.t + lane, _mm_or_pd(_mm_and_pd(miss, nan), _mm_andnot_pd(miss, tHit)));
+        if (_mm_movemask_pd(miss) == 0x3)
+            continue;
+
+        // N = u * n1 + v * n2 + (1 - u - v) * n3
+        __m128d w = _mm_sub_pd(_mm_sub_pd(one, u), v);
+        _mm_storeu_pd(hits.nx + lane, _mm_add_pd(_mm_add_pd(_mm_mul_pd(u, _mm_set1_pd(tri.n1.x)), _mm_mul_pd(v, _mm_set1_pd(tri.n2.x))), _mm_mul_pd(w, _mm_set1_pd(tri.n3.x))));
+        _mm_storeu_pd(hits.ny + lane, _mm_add_pd(_mm_add_pd(_mm_mul_pd(u, _mm_set1_pd(tri.n1.y)), _mm_mul_pd(v, _mm_set1_pd(tri.n2.y))), _mm_mul_pd(w, _mm_set1_pd(tri.n3.y))));
+        _mm_storeu_pd(hits.nz + lane, _mm_add_pd(_mm_add_pd(_mm_mul_pd(u, _mm_set1_pd(tri.n1.z)), _mm_mul_pd(v, _mm_set1_pd(tri.n2.z))), _mm_mul_pd(w, _mm_set1_pd(tri.n3.z))));
+    }
+}
+
+#endif
+
+void Triangle::intersectPacket(RayPacket const &packet, unsigned mask, PacketHits &hits)
+{
+#ifdef SIMD_KERNELS
+    if (cpu::hasAVX())
+        intersectTriangleAVX(packet, *this, mask, hits);
+    else
+        intersectTriangleSSE2(packet, *this, mask, hits);
+#else
+    Object::intersectPacket(packet, mask, hits);
+#endif
+}
+
+bool Triangle::occluded(Ray const &ray, Real tMax)
+{
+    // Möller–Trumbore intersection, without interpolating the normal
+    Vector h = ray.D.cross(edge2);
+    Real a = edge1.dot(h);
+    if(-EPSILON < a && a < EPSILON) {
+        return false;
+    }
+    Real f = 1 / a;
+    Vector s = ray.O - v3;
+    Real u = f * (s.dot(h));
+    if(u < 0.0 - EPSILON || u > 1.0 + EPSILON) {
+        return false;
+    }
+    Vector q = s.cross(edge1);
+    Real v = f * ray.D.dot(q);
+    if(v < 0.0 - EPSILON || (u + v) > 1.0 + EPSILON) {
+        return false;
+    }
+    Real t = f * edge2.dot(q);
+    return t >= EPSILON && t < tMax;
+}
+
 Triangle::Triangle(Vertex const &v1, Vertex const &v2, Vertex const &v3)
 :
     v1(Point(v1.x, v1.y, v1.z)),
@@ -46,7 +225,9 @@ Triangle::Triangle(Vertex const &v1, Vertex const &v2, Vertex const &v3)
     v3(Point(v3.x, v3.y, v3.z)),
     n1(Vector(v1.nx, v1.ny, v1.nz)),
     n2(Vector(v2.nx, v2.ny, v2.nz)),
-    n3(Vector(v3.nx, v3.ny, v3.nz))
+    n3(Vector(v3.nx, v3.ny, v3.nz)),
+    edge1(this->v1 - this->v3),
+    edge2(this->v2 - this->v3)
 {}
 
 Triangle::Triangle(Point const &v1, Point const &v2, Point const &v3)
@@ -56,9 +237,25 @@ Triangle::Triangle(Point const &v1, Point const &v2, Point const &v3)
     v3(Point(v3.x, v3.y, v3.z)),
     n1(((v2 - v1).cross(v3 - v1)).normalized()),
     n2(((v2 - v1).cross(v3 - v1)).normalized()),
-    n3(((v2 - v1).cross(v3 - v1)).normalized())
+    n3(((v2 - v1).cross(v3 - v1)).normalized()),
+    edge1(v1 - v3),
+    edge2(v2 - v3)
 {}
 
 Point Triangle::mapTexture(Ray const &ray, Hit const &hit) {
     return Point{0, 0, 1};
 }
+
+AABB Triangle::boundingBox() const
+{
+    AABB box;
+    box.extend(v1);
+    box.extend(v2);
+    box.extend(v3);
+    return box;
+}
+
+char const *Triangle::typeName() const
+{
+    return "triangle";
+}
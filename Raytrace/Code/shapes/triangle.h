@@ -11,6 +11,8 @@ class Triangle: public Object
         Triangle(Point const &v1, Point const &v2, Point const &v3);
 
         virtual Hit intersect(Ray const &ray);
+        virtual bool occluded(Ray const &ray, Real tMax);
+        virtual void intersectPacket(RayPacket const &packet, unsigned mask, PacketHits &hits);
 
         Point const v1;
         Point const v2;
@@ -18,8 +20,12 @@ class Triangle: public Object
         Vector const n1;
         Vector const n2;
         Vector const n3;
+        Vector const edge1;     // v1 - v3, precomputed for intersect
+        Vector const edge2;     // v2 - v3
 
         Point mapTexture(Ray const &ray, Hit const &hit);
+        AABB boundingBox() const;
+        char const *typeName() const;
 };
 
 #endif
@@ -0,0 +1,192 @@
+#include "trianglemesh.h"
+
+#include <cmath>
+#include <limits>
+#include <utility>
+
+using namespace std;
+
+#define EPSILON (1e-6)
+
+TriangleMesh::TriangleMesh(MeshData &&data)
+:
+    d_data(move(data))
+{
+    vector<AABB> bounds;
+    bounds.reserve(numTriangles());
+    for (unsigned tri = 0; tri != numTriangles(); ++tri)
+    {
+        AABB box;
+        for (unsigned corner = 0; corner != 3; ++corner)
+            box.extend(position(tri, corner));
+        bounds.push_back(box);
+    }
+    d_bvh.build(bounds, TriangleBlock::WIDTH);
+
+    d_blockOf.resize(numTriangles());
+    for (BVH::Node const &node : d_bvh.nodes())
+    {
+        if (node.count == 0)
+            continue;
+
+        TriangleBlock block;
+        for (unsigned pos = node.offset; pos != node.offset + node.count; ++pos)
+        {
+            unsigned tri = d_bvh.primitive(pos);
+            block.add(tri, position(tri, 0), position(tri, 1), position(tri, 2));
+        }
+        d_blockOf[node.offset] = d_blocks.size();
+        d_blocks.push_back(block);
+    }
+}
+
+TriangleMesh::TriangleMesh(MeshData &&data, BVH &&bvh, vector<TriangleBlock> &&blocks,
+                           vector<unsigned> &&blockOf)
+:
+    d_data(move(data)),
+    d_bvh(move(bvh)),
+    d_blocks(move(blocks)),
+    d_blockOf(move(blockOf))
+{}
+
+unsigned TriangleMesh::numTriangles() const
+{
+    return d_data.numTriangles();
+}
+
+Point TriangleMesh::position(unsigned tri, unsigned corner) const
+{
+    unsigned idx = d_data.positionIdx[3 * tri + corner];
+    return Point(d_data.x[idx], d_data.y[idx], d_data.z[idx]);
+}
+
+Vector TriangleMesh::normal(unsigned tri, unsigned corner) const
+{
+    unsigned idx = d_data.normalIdx[3 * tri + corner];
+    return Vector(d_data.nx[idx], d_data.ny[idx], d_data.nz[idx]);
+}
+
+TriangleBlock const &TriangleMesh::block(BVH::Node const &leaf) const
+{
+    return d_blocks[d_blockOf[leaf.offset]];
+}
+
+unsigned TriangleMesh::closestTriangle(Ray const &ray, Real &t, Real &u, Real &v) const
+{
+    unsigned closest = numTriangles();
+    t = numeric_limits<Real>::infinity();
+    d_bvh.closestLeaf(ray, t, [&](BVH::Node const &leaf, Real &tMax)
+    {
+        TriangleBlock const &tris = block(leaf);
+        Real triT, triU, triV;
+        unsigned lane = tris.intersect(ray, triT, triU, triV);
+        if (lane != TriangleBlock::WIDTH
+            && (triT < tMax || (triT == tMax && tris.tri[lane] < closest)))
+        {
+            closest = tris.tri[lane];
+            t = tMax = triT;
+            u = triU;
+            v = triV;
+        }
+    });
+    return closest;
+}
+
+Hit TriangleMesh::intersect(Ray const &ray)
+{
+    Real t, u, v;
+    unsigned tri = closestTriangle(ray, t, u, v);
+    if (tri == numTriangles())
+        return Hit::NO_HIT();
+
+    Vector N = u * normal(tri, 0) + v * normal(tri, 1) + (1 - u - v) * normal(tri, 2);
+
+    return Hit(t, N, tri, u, v);
+}
+
+bool TriangleMesh::occluded(Ray const &ray, Real tMax)
+{
+    return d_bvh.anyLeaf(ray, tMax, [&](BVH::Node const &leaf)
+    {
+        return block(leaf).occluded(ray, tMax);
+    });
+}
+
+void TriangleMesh::intersectPacket(RayPacket const &packet, unsigned mask, PacketHits &hits)
+{
+    Real u[RayPacket::MAX_SIZE];
+    Real v[RayPacket::MAX_SIZE];
+    unsigned closest[RayPacket::MAX_SIZE];
+    Real tMax[RayPacket::MAX_SIZE];
+    for (unsigned lane = 0; lane != packet.size; ++lane)
+    {
+        // Lanes outside mask start with a zero range, so they prune nothing
+        tMax[lane] = (mask & (1U << lane)) ? numeric_limits<Real>::infinity() : 0.0;
+        closest[lane] = numTriangles();
+    }
+
+    d_bvh.closestLeaf(packet, tMax, [&](BVH::Node const &leaf, unsigned lanes, Real tMax[])
+    {
+        TriangleBlock const &tris = block(leaf);
+        for (lanes &= mask; lanes != 0; lanes &= lanes - 1)
+        {
+            unsigned lane = __builtin_ctz(lanes);
+            Real triT, triU, triV;
+            unsigned hit = tris.intersect(packet.ray(lane), triT, triU, triV);
+            if (hit != TriangleBlock::WIDTH
+                && (triT < tMax[lane] || (triT == tMax[lane] && tris.tri[hit] < closest[lane])))
+            {
+                closest[lane] = tris.tri[hit];
+                tMax[lane] = triT;
+                u[lane] = triU;
+                v[lane] = triV;
+            }
+        }
+    });
+    for (unsigned lanes = mask; lanes != 0; lanes &= lanes - 1)
+    {
+        unsigned lane = __builtin_ctz(lanes);
+        unsigned tri = closest[lane];
+        if (tri == numTriangles())
+        {
+            hits.set(lane, Hit::NO_HIT());
+            continue;
+        }
+        Vector N = u[lane] * normal(tri, 0) + v[lane] * normal(tri, 1) + (1 - u[lane] - v[lane]) * normal(tri, 2);
+        hits.set(lane, Hit(tMax[lane], N, tri, u[lane], v[lane]));
+    }
+}
+
+Point TriangleMesh::mapTexture(Ray const &ray, Hit const &hit)
+{
+    // Without texture coordinates behave like Triangle
+    if (d_data.u.empty())
+        return Point{0, 0, 1};
+
+    // intersect recorded the triangle and where it was hit
+    Real texU = 0.0;
+    Real texV = 0.0;
+    Real const weights[3] = {hit.u, hit.v, 1 - hit.u - hit.v};
+    for (unsigned corner = 0; corner != 3; ++corner)
+    {
+        unsigned idx = d_data.texCoordIdx[3 * hit.primitive + corner];
+        texU += weights[corner] * d_data.u[idx];
+        texV += weights[corner] * d_data.v[idx];
+    }
+    return Point{texU, texV, 1};
+}
+
+bool TriangleMesh::shadowsItself() const
+{
+    return true;
+}
+
+AABB TriangleMesh::boundingBox() const
+{
+    return d_bvh.bounds();
+}
+
+char const *TriangleMesh::typeName() const
+{
+    return "mesh";
+}
@@ -0,0 +1,57 @@
+#ifndef TRIANGLEMESH_H_
+#define TRIANGLEMESH_H_
+
+#include "../bvh.h"
+#include "../meshdata.h"
+#include "../object.h"
+#include "../triangleblock.h"
+
+#include <vector>
+
+// Triangle mesh stored as a single object: the vertex attributes are shared
+// between the triangles and the mesh has its own BVH over the triangles, so
+// the scene only sees one object with one material. The triangles of each
+// leaf of the BVH are copied into a TriangleBlock, which tests them all at
+// once.
+//
+// Hits are exactly those of a Triangle per face, on equal distance the
+// triangle listed first wins.
+class TriangleMesh: public Object
+{
+    public:
+        explicit TriangleMesh(MeshData &&data);
+
+        virtual Hit intersect(Ray const &ray);
+        virtual bool occluded(Ray const &ray, Real tMax);
+        virtual bool shadowsItself() const;
+        virtual void intersectPacket(RayPacket const &packet, unsigned mask, PacketHits &hits);
+
+        Point mapTexture(Ray const &ray, Hit const &hit);
+        AABB boundingBox() const;
+        char const *typeName() const;
+
+        unsigned numTriangles() const;
+
+    private:
+        friend class MeshCache;     // saves and restores the members below
+
+        MeshData d_data;
+        BVH d_bvh;
+        std::vector<TriangleBlock> d_blocks;    // one per leaf
+        std::vector<unsigned> d_blockOf;        // block of the leaf starting
+                                                // at a position of the BVH
+
+        // Mesh with its acceleration data already built
+        TriangleMesh(MeshData &&data, BVH &&bvh, std::vector<TriangleBlock> &&blocks,
+                     std::vector<unsigned> &&blockOf);
+
+        Point position(unsigned tri, unsigned corner) const;
+        Vector normal(unsigned tri, unsigned corner) const;
+        TriangleBlock const &block(BVH::Node const &leaf) const;
+
+        // Index of the closest triangle hit by the ray, numTriangles() if
+        // there is none
+        unsigned closestTriangle(Ray const &ray, Real &t, Real &u, Real &v) const;
+};
+
+#endif
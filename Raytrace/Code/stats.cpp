@@ -0,0 +1,52 @@
+#include "stats.h"
+
+#include <algorithm>
+
+using namespace std;
+
+thread_local RenderStats localStats;
+
+void RenderStats::reset(unsigned numObjects, unsigned numLights)
+{
+    primaryRays = shadowRays = reflectionRays = 0;
+    maxDepth = 0;
+    triangleTests = 0;
+    objectTests.assign(numObjects, 0);
+    objectHits.assign(numObjects, 0);
+    lightTests.assign(numLights, 0);
+    lightOccluded.assign(numLights, 0);
+}
+
+unsigned long RenderStats::rays() const
+{
+    return primaryRays + shadowRays + reflectionRays;
+}
+
+unsigned long RenderStats::tests() const
+{
+    unsigned long sum = triangleTests;
+    for (unsigned long count : objectTests)
+        sum += count;
+    return sum;
+}
+
+// Adds the counters of other, which must count the same scene
+static void addCounts(vector<unsigned long> &counts, vector<unsigned long> const &other)
+{
+    for (size_t idx = 0; idx != counts.size(); ++idx)
+        counts[idx] += other[idx];
+}
+
+RenderStats &RenderStats::operator+=(RenderStats const &other)
+{
+    primaryRays += other.primaryRays;
+    shadowRays += other.shadowRays;
+    reflectionRays += other.reflectionRays;
+    maxDepth = max(maxDepth, other.maxDepth);
+    triangleTests += other.triangleTests;
+    addCounts(objectTests, other.objectTests);
+    addCounts(objectHits, other.objectHits);
+    addCounts(lightTests, other.lightTests);
+    addCounts(lightOccluded, other.lightOccluded);
+    return *this;
+}
@@ -0,0 +1,37 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <vector>
+
+// Counters of the work done while rendering
+struct RenderStats
+{
+    unsigned long primaryRays = 0;
+    unsigned long shadowRays = 0;
+    unsigned long reflectionRays = 0;
+    unsigned maxDepth = 0;          // deepest reflection reached
+
+    unsigned long triangleTests = 0;            // triangles of meshes
+    std::vector<unsigned long> objectTests;     // per object of the scene
+    std::vector<unsigned long> objectHits;      // closest hits per object
+
+    std::vector<unsigned long> lightTests;      // shadow rays per light
+    std::vector<unsigned long> lightOccluded;   // of which were blocked
+
+    // zero all counters, for a scene with the given number of objects
+    // and lights
+    void reset(unsigned numObjects, unsigned numLights);
+
+    unsigned long rays() const;     // rays traced: primary, shadow, reflection
+    unsigned long tests() const;    // intersection tests against objects and
+                                    // against the triangles of meshes
+
+    RenderStats &operator+=(RenderStats const &other);
+};
+
+// Counters of the calling thread. Scene resets them before every tile and
+// adds them to the totals of the render afterwards, so counting needs no
+// synchronisation.
+extern thread_local RenderStats localStats;
+
+#endif
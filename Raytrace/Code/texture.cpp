@@ -0,0 +1,224 @@
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    Texture::AccessHook accessHookFun = nullptr;
+
+    unsigned const LINE_TEXELS = 64 / sizeof(Image::RGBA8);
+
+    // Position of texel (x, y) within its 4x4 tile, bits interleaved as
+    // y1 x1 y0 x0
+    inline unsigned morton(unsigned x, unsigned y)
+    {
+        return (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2;
+    }
+
+    inline Real clamp01(Real value)
+    {
+        // also maps NaN to 0
+        return value >= 0 ? min(value, Real(1)) : 0;
+    }
+}
+
+Texture::Texture(Image const &image)
+{
+    // Sizes and offsets of all levels, each a whole number of tiles
+    size_t total = 0;
+    unsigned width = max(image.width(), 1U);
+    unsigned height = max(image.height(), 1U);
+    while (true)
+    {
+        unsigned tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        unsigned tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        d_levels.push_back(Level{width, height, tilesX, total});
+        total += static_cast<size_t>(tilesX) * tilesY * TILE_SIZE * TILE_SIZE;
+        if (width == 1 && height == 1)
+            break;
+        width = max(width / 2, 1U);
+        height = max(height / 2, 1U);
+    }
+
+    d_buffer.resize(total + LINE_TEXELS);
+    uintptr_t address = reinterpret_cast<uintptr_t>(d_buffer.data());
+    d_texels = d_buffer.data() + (LINE_TEXELS - address / sizeof(Image::RGBA8) % LINE_TEXELS) % LINE_TEXELS;
+
+    // Base level: an empty image (a texture which could not be read)
+    // becomes a single black texel
+    for (unsigned y = 0; y != image.height(); ++y)
+        for (unsigned x = 0; x != image.width(); ++x)
+        {
+            if (image.format() == Image::Format::RGBA8)
+                d_texels[index(0, x, y)] = image.pixels<Image::RGBA8>()[y * image.width() + x];
+            else
+            {
+                Color c = image.get_pixel(x, y);
+                c.clamp();
+                d_texels[index(0, x, y)] = Image::RGBA8{
+                    static_cast<uint8_t>(c.r * 255.0), static_cast<uint8_t>(c.g * 255.0),
+                    static_cast<uint8_t>(c.b * 255.0), 255
+                };
+            }
+        }
+    if (image.size() == 0)
+        d_texels[index(0, 0, 0)] = Image::RGBA8{0, 0, 0, 255};
+
+    // Every further level averages 2x2 texels of the one before, clamped
+    // at the border of odd sized levels
+    for (unsigned level = 1; level != d_levels.size(); ++level)
+    {
+        Level const &src = d_levels[level - 1];
+        Level const &dst = d_levels[level];
+        for (unsigned y = 0; y != dst.height; ++y)
+            for (unsigned x = 0; x != dst.width; ++x)
+            {
+                unsigned x0 = min(2 * x, src.width - 1);
+                unsigned x1 = min(2 * x + 1, src.width - 1);
+                unsigned y0 = min(2 * y, src.height - 1);
+                unsigned y1 = min(2 * y + 1, src.height - 1);
+                Image::RGBA8 const *corners[] = {
+                    d_texels + index(level - 1, x0, y0), d_texels + index(level - 1, x1, y0),
+                    d_texels + index(level - 1, x0, y1), d_texels + index(level - 1, x1, y1)
+                };
+                unsigned r = 2, g = 2, b = 2, a = 2;    // rounding
+                for (Image::RGBA8 const *corner : corners)
+                {
+                    r += corner->r;
+                    g += corner->g;
+                    b += corner->b;
+                    a += corner->a;
+                }
+                d_texels[index(level, x, y)] = Image::RGBA8{
+                    static_cast<uint8_t>(r / 4), static_cast<uint8_t>(g / 4),
+                    static_cast<uint8_t>(b / 4), static_cast<uint8_t>(a / 4)
+                };
+            }
+    }
+}
+
+Texture::Filter Texture::filter(string const &name)
+{
+    if (name == "nearest")
+        return Filter::NEAREST;
+    if (name == "bilinear")
+        return Filter::BILINEAR;
+    if (name == "trilinear")
+        return Filter::TRILINEAR;
+    throw invalid_argument("Unknown texture filter '" + name + "'.");
+}
+
+unsigned Texture::width(unsigned level) const
+{
+    return d_levels[level].width;
+}
+
+unsigned Texture::height(unsigned level) const
+{
+    return d_levels[level].height;
+}
+
+unsigned Texture::levels() const
+{
+    return d_levels.size();
+}
+
+Color Texture::colorAt(Real u, Real v) const
+{
+    // as Image::colorAt, which computes in float
+    unsigned x = static_cast<unsigned>(static_cast<float>(clamp01(u)) * (width() - 1));
+    unsigned y = static_cast<unsigned>(static_cast<float>(clamp01(v)) * (height() - 1));
+    return color(0, x, y);
+}
+
+Real Texture::levelOfDetail(Point const &dx, Point const &dy) const
+{
+    // Length of the longer side of the footprint in base level texels
+    Real lengthX = hypot(dx.x * width(), dx.y * height());
+    Real lengthY = hypot(dy.x * width(), dy.y * height());
+    Real length = max(lengthX, lengthY);
+    return length > 0 ? log2(length) : -numeric_limits<Real>::infinity();
+}
+
+Color Texture::sample(Real u, Real v, Real lod, Filter filter) const
+{
+    Real const maxLevel = d_levels.size() - 1;
+    switch (filter)
+    {
+        case Filter::NEAREST:
+            break;
+
+        case Filter::BILINEAR:
+        {
+            Real level = lod >= 0 ? min<Real>(floor(lod + Real(0.5)), maxLevel) : 0;
+            return bilinear(static_cast<unsigned>(level), u, v);
+        }
+
+        case Filter::TRILINEAR:
+        {
+            if (!(lod > 0))                 // magnified (or no footprint)
+                return bilinear(0, u, v);
+            if (lod >= maxLevel)
+                return bilinear(maxLevel, u, v);
+            unsigned level = static_cast<unsigned>(lod);
+            Real frac = lod - level;
+            return (1 - frac) * bilinear(level, u, v) + frac * bilinear(level + 1, u, v);
+        }
+    }
+    return colorAt(u, v);
+}
+
+void Texture::accessHook(AccessHook hook)
+{
+    accessHookFun = hook;
+}
+
+size_t Texture::index(unsigned level, unsigned x, unsigned y) const
+{
+    Level const &lvl = d_levels[level];
+    size_t tile = static_cast<size_t>(y / TILE_SIZE) * lvl.tilesX + x / TILE_SIZE;
+    return lvl.offset + tile * TILE_SIZE * TILE_SIZE + morton(x, y);
+}
+
+Color Texture::color(unsigned level, unsigned x, unsigned y) const
+{
+    if (accessHookFun)
+        accessHookFun(*this, level, x, y);
+    Image::RGBA8 const &pixel = d_texels[index(level, x, y)];
+    return Color(pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0);
+}
+
+Color Texture::bilinear(unsigned level, Real u, Real v) const
+{
+    Level const &lvl = d_levels[level];
+
+    // texel centers lie at (i + 0.5) / size
+    Real wrapped = u - floor(u);
+    if (!(wrapped >= 0 && wrapped <= 1))
+        wrapped = 0;                    // NaN or infinite
+    Real s = wrapped * lvl.width - 0.5;
+    Real t = clamp01(v) * lvl.height - 0.5;
+    Real s0 = floor(s);
+    Real t0 = floor(t);
+    Real fs = s - s0;
+    Real ft = t - t0;
+
+    // u repeats, v is clamped
+    int w = lvl.width;
+    int h = lvl.height;
+    int xi = static_cast<int>(s0);
+    int yi = static_cast<int>(t0);
+    unsigned x0 = (xi % w + w) % w;
+    unsigned x1 = ((xi + 1) % w + w) % w;
+    unsigned y0 = min(max(yi, 0), h - 1);
+    unsigned y1 = min(max(yi + 1, 0), h - 1);
+
+    return (1 - ft) * ((1 - fs) * color(level, x0, y0) + fs * color(level, x1, y0))
+         + ft * ((1 - fs) * color(level, x0, y1) + fs * color(level, x1, y1));
+}
@@ -0,0 +1,85 @@
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+
+#include "image.h"
+#include "triple.h"
+
+#include <string>
+#include <vector>
+
+// Texture sampler over an RGBA8 image.
+//
+// At construction a mip chain is built (every level halves the size of the
+// one before, down to 1x1, by averaging 2x2 texels). All levels are stored
+// in one buffer in 4x4 tiles of 64 bytes, one cache line each, with the
+// texels of a tile in Morton (Z) order. Texels close in the image are thus
+// close in memory in both directions, while the rows of a row-major image
+// are width * 4 bytes apart.
+//
+// Texture coordinates (u, v) run from 0 to 1 over the image, v = 0 is the
+// first row of the PNG file. For filtering u repeats and v is clamped, as
+// the sphere mapping needs.
+class Texture
+{
+    public:
+        enum class Filter
+        {
+            NEAREST,    // base level texel, as Image::colorAt
+            BILINEAR,   // bilinear on the level closest to the footprint
+            TRILINEAR   // bilinear on the two nearest levels, blended
+        };
+
+        explicit Texture(Image const &image);
+        Texture(Texture const &) = delete;
+        Texture &operator=(Texture const &) = delete;
+
+        // Filter named nearest, bilinear or trilinear
+        // @throws std::invalid_argument for another name
+        static Filter filter(std::string const &name);
+
+        unsigned width(unsigned level = 0) const;
+        unsigned height(unsigned level = 0) const;
+        unsigned levels() const;
+
+        // Index of a texel of a level in the tiled storage, where every
+        // 16 texels form a cache line
+        size_t index(unsigned level, unsigned x, unsigned y) const;
+
+        // Nearest texel of the base level, the same one Image::colorAt
+        // picks for u and v in [0, 1]; coordinates outside are clamped
+        Color colorAt(Real u, Real v) const;
+
+        // Level of detail for a footprint spanned by the (u, v) differences
+        // dx and dy (x and y of the points), in levels: 0 is the base level,
+        // 1 the level of half its size etc. Negative when magnified.
+        Real levelOfDetail(Point const &dx, Point const &dy) const;
+
+        // Filtered color at (u, v) for the given level of detail
+        Color sample(Real u, Real v, Real lod, Filter filter) const;
+
+        // When set, hook is called for every texel read, with its level and
+        // position. Used by ray_bench to simulate the cache behaviour of the
+        // texture layout. Not thread safe.
+        typedef void (*AccessHook)(Texture const &texture, unsigned level, unsigned x, unsigned y);
+        static void accessHook(AccessHook hook);
+
+    private:
+        struct Level
+        {
+            unsigned width;
+            unsigned height;
+            unsigned tilesX;        // tiles per row
+            size_t offset;          // of the first texel in the buffer
+        };
+
+        static unsigned const TILE_SIZE = 4;
+
+        std::vector<Level> d_levels;
+        std::vector<Image::RGBA8> d_buffer;
+        Image::RGBA8 *d_texels;     // d_buffer aligned to a cache line
+
+        Color color(unsigned level, unsigned x, unsigned y) const;
+        Color bilinear(unsigned level, Real u, Real v) const;
+};
+
+#endif
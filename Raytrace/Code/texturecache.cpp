@@ -0,0 +1,56 @@
+#include "texturecache.h"
+
+#include "fs-utils.h"
+#include "image.h"
+#include "texture.h"
+
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    mutex cacheMutex;
+    map<string, shared_ptr<Texture const>> cache;   // by canonical path
+}
+
+shared_ptr<Texture const> TextureCache::load(string const &path)
+{
+    string key = path;
+    try
+    {
+        key = fs::realpath(path);
+    }
+    catch (runtime_error const &)
+    {
+        // missing file: decoded (to an empty image) as before, once
+    }
+
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        auto found = cache.find(key);
+        if (found != cache.end())
+            return found->second;
+    }
+
+    // Decoded without holding the lock; should another thread decode the
+    // same file meanwhile, the first one to finish wins
+    shared_ptr<Texture const> texture = make_shared<Texture const>(Image(key));
+
+    lock_guard<mutex> lock(cacheMutex);
+    return cache.emplace(key, texture).first->second;
+}
+
+void TextureCache::clear()
+{
+    lock_guard<mutex> lock(cacheMutex);
+    cache.clear();
+}
+
+unsigned TextureCache::size()
+{
+    lock_guard<mutex> lock(cacheMutex);
+    return cache.size();
+}
@@ -0,0 +1,27 @@
+#ifndef TEXTURECACHE_H_
+#define TEXTURECACHE_H_
+
+#include <memory>
+#include <string>
+
+class Texture;
+
+// Process wide cache of decoded textures. A texture is decoded (and its
+// mip chain built) once and shared, read only, by every material using
+// it. Entries are identified by the canonical path of the file, so
+// different relative paths or links to the same file share an entry.
+// They are kept until clear() is called.
+class TextureCache
+{
+    public:
+        // The texture of the PNG file
+        static std::shared_ptr<Texture const> load(std::string const &path);
+
+        // Forgets all entries, textures still in use stay valid
+        static void clear();
+
+        // Number of textures in the cache
+        static unsigned size();
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include "threadpool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(unsigned numThreads)
+:
+    d_size(numThreads == 0 ? hardwareThreads() : numThreads),
+    d_queues(new Queue[d_size]),
+    d_task(nullptr),
+    d_generation(0),
+    d_busy(0),
+    d_quit(false)
+{
+    // Thread 0 is the thread calling run
+    for (unsigned id = 1; id < d_size; ++id)
+        d_workers.emplace_back(&ThreadPool::workerLoop, this, id);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(d_mutex);
+        d_quit = true;
+    }
+    d_start.notify_all();
+    for (thread &worker : d_workers)
+        worker.join();
+}
+
+unsigned ThreadPool::size() const
+{
+    return d_size;
+}
+
+unsigned ThreadPool::hardwareThreads()
+{
+    unsigned count = thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+}
+
+void ThreadPool::run(unsigned numTasks, function<void(unsigned)> const &task)
+{
+    if (numTasks == 0)
+        return;
+
+    // Hand every thread a contiguous range of tasks
+    for (unsigned id = 0; id != d_size; ++id)
+    {
+        unsigned begin = static_cast<unsigned long long>(numTasks) * id / d_size;
+        unsigned end = static_cast<unsigned long long>(numTasks) * (id + 1) / d_size;
+        lock_guard<mutex> lock(d_queues[id].mutex);
+        for (unsigned idx = begin; idx != end; ++idx)
+            d_queues[id].tasks.push_back(idx);
+    }
+
+    {
+        lock_guard<mutex> lock(d_mutex);
+        d_task = &task;
+        d_exception = nullptr;
+        d_busy = d_size;
+        ++d_generation;
+    }
+    d_start.notify_all();
+
+    work(0);
+
+    unique_lock<mutex> lock(d_mutex);
+    d_finished.wait(lock, [this] { return d_busy == 0; });
+    d_task = nullptr;
+    if (d_exception)
+        rethrow_exception(d_exception);
+}
+
+void ThreadPool::workerLoop(unsigned id)
+{
+    unsigned generation = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(d_mutex);
+            d_start.wait(lock, [&] { return d_quit || d_generation != generation; });
+            if (d_quit)
+                return;
+            generation = d_generation;
+        }
+        work(id);
+    }
+}
+
+void ThreadPool::work(unsigned id)
+{
+    unsigned task;
+    while (take(id, task))
+    {
+        try
+        {
+            (*d_task)(task);
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock(d_mutex);
+            if (!d_exception)
+                d_exception = current_exception();
+        }
+    }
+
+    lock_guard<mutex> lock(d_mutex);
+    if (--d_busy == 0)
+        d_finished.notify_all();
+}
+
+bool ThreadPool::take(unsigned id, unsigned &task)
+{
+    {
+        Queue &own = d_queues[id];
+        lock_guard<mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    // No work left: steal from the back of the other queues. Tasks are
+    // never added during a run, so once all queues are empty we are done.
+    for (unsigned offset = 1; offset < d_size; ++offset)
+    {
+        Queue &victim = d_queues[(id + offset) % d_size];
+        lock_guard<mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,65 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed size pool of threads executing indexed tasks.
+//
+// Each thread owns a queue which initially receives a contiguous range of
+// the tasks. A thread takes tasks from the front of its own queue; once it
+// runs dry it steals from the back of the queues of the other threads, so
+// uneven task costs (e.g. tiles with and without objects) balance out.
+class ThreadPool
+{
+    public:
+        // numThreads == 0 uses one thread per hardware thread
+        explicit ThreadPool(unsigned numThreads = 0);
+        ~ThreadPool();
+
+        ThreadPool(ThreadPool const &) = delete;
+        ThreadPool &operator=(ThreadPool const &) = delete;
+
+        // number of threads, including the thread calling run
+        unsigned size() const;
+
+        // Executes task(idx) for every idx in [0, numTasks) and returns
+        // once all of them have finished. The calling thread takes part in
+        // the work. The first exception thrown by a task is rethrown here.
+        void run(unsigned numTasks, std::function<void(unsigned)> const &task);
+
+        static unsigned hardwareThreads();
+
+    private:
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<unsigned> tasks;
+            char padding[64];       // keep queues on separate cache lines
+        };
+
+        unsigned d_size;
+        std::vector<std::thread> d_workers;
+        std::unique_ptr<Queue[]> d_queues;
+
+        std::mutex d_mutex;
+        std::condition_variable d_start;
+        std::condition_variable d_finished;
+        std::function<void(unsigned)> const *d_task;
+        std::exception_ptr d_exception;
+        unsigned d_generation;
+        unsigned d_busy;
+        bool d_quit;
+
+        void workerLoop(unsigned id);
+        void work(unsigned id);
+        bool take(unsigned id, unsigned &task);
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "tilefile.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+using namespace std;
+
+namespace
+{
+    char const MAGIC[8] = {'R', 'A', 'Y', 'T', 'I', 'L', 'E', '\0'};
+    uint32_t const VERSION = 1;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t textureFilter;
+        uint64_t sceneHash;
+        uint32_t width;
+        uint32_t height;
+        uint32_t x0, y0, x1, y1;
+    };
+}
+
+TileFile::TileFile(uint64_t sceneHash, Texture::Filter filter, unsigned width, unsigned height,
+                   Scene::Region const &region, Image pixels)
+:
+    d_sceneHash(sceneHash),
+    d_textureFilter(static_cast<uint32_t>(filter)),
+    d_width(width),
+    d_height(height),
+    d_region(region),
+    d_pixels(move(pixels))
+{
+    if (region.x0 >= region.x1 || region.y0 >= region.y1 || region.x1 > width || region.y1 > height)
+        throw invalid_argument("Tile region is empty or outside the image");
+    if (d_pixels.format() != Image::Format::RGB32F
+        || d_pixels.width() != region.x1 - region.x0 || d_pixels.height() != region.y1 - region.y0)
+        throw invalid_argument("Tile pixels do not match its region");
+}
+
+uint64_t TileFile::sceneHash() const
+{
+    return d_sceneHash;
+}
+
+Texture::Filter TileFile::textureFilter() const
+{
+    return static_cast<Texture::Filter>(d_textureFilter);
+}
+
+unsigned TileFile::width() const
+{
+    return d_width;
+}
+
+unsigned TileFile::height() const
+{
+    return d_height;
+}
+
+Scene::Region const &TileFile::region() const
+{
+    return d_region;
+}
+
+Image const &TileFile::pixels() const
+{
+    return d_pixels;
+}
+
+void TileFile::copyTo(Image &img) const
+{
+    if (img.format() != Image::Format::RGB32F || img.width() != d_width || img.height() != d_height)
+        throw invalid_argument("Image does not match the tile");
+
+    unsigned rowSize = d_region.x1 - d_region.x0;
+    Image::RGB32F const *src = d_pixels.pixels<Image::RGB32F>();
+    Image::RGB32F *dst = img.pixels<Image::RGB32F>();
+    for (unsigned y = d_region.y0; y != d_region.y1; ++y, src += rowSize)
+        copy(src, src + rowSize, dst + y * d_width + d_region.x0);
+}
+
+void TileFile::write(string const &filename) const
+{
+    ofstream out(filename, ios::binary);
+    write(out);
+    if (!out)
+        throw runtime_error("Could not write tile " + filename);
+}
+
+TileFile TileFile::read(string const &filename)
+{
+    ifstream in(filename, ios::binary);
+    if (!in)
+        throw runtime_error("Could not open tile " + filename);
+    return read(in, filename);
+}
+
+void TileFile::write(ostream &out) const
+{
+    Header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.textureFilter = d_textureFilter;
+    header.sceneHash = d_sceneHash;
+    header.width = d_width;
+    header.height = d_height;
+    header.x0 = d_region.x0;
+    header.y0 = d_region.y0;
+    header.x1 = d_region.x1;
+    header.y1 = d_region.y1;
+
+    out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    out.write(reinterpret_cast<char const *>(d_pixels.pixels<Image::RGB32F>()), d_pixels.bytes());
+}
+
+TileFile TileFile::read(istream &in, string const &name)
+{
+    Header header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))
+        || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw runtime_error(name + " is not a tile file");
+    if (header.version != VERSION)
+        throw runtime_error(name + " has an unsupported tile version");
+
+    Scene::Region region{header.x0, header.y0, header.x1, header.y1};
+    if (region.x0 >= region.x1 || region.y0 >= region.y1
+        || region.x1 > header.width || region.y1 > header.height)
+        throw runtime_error(name + " has an invalid region");
+
+    Image pixels(region.x1 - region.x0, region.y1 - region.y0, Image::Format::RGB32F);
+    if (!in.read(reinterpret_cast<char *>(pixels.pixels<Image::RGB32F>()), pixels.bytes()))
+        throw runtime_error(name + " is truncated");
+
+    return TileFile(header.sceneHash, static_cast<Texture::Filter>(header.textureFilter),
+                    header.width, header.height, region, move(pixels));
+}
+
+uint64_t TileFile::size(Scene::Region const &region)
+{
+    uint64_t pixels = uint64_t(region.x1 - region.x0) * (region.y1 - region.y0);
+    return sizeof(Header) + pixels * sizeof(Image::RGB32F);
+}
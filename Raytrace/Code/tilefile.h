@@ -0,0 +1,58 @@
+#ifndef TILEFILE_H_
+#define TILEFILE_H_
+
+#include "image.h"
+#include "scene.h"
+#include "texture.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+// A rectangle of a rendered image, as written by ray --region or --tile,
+// together with what is needed to join it with the other tiles of the
+// image (ray-merge): the hash of the scene file, the texture filter and
+// the size of the whole image.
+//
+// The file is a header followed by the floats (RGB32F) of the region, row
+// by row, in the byte order of the machine writing it.
+class TileFile
+{
+    uint64_t d_sceneHash;
+    uint32_t d_textureFilter;
+    unsigned d_width;               // of the whole image
+    unsigned d_height;
+    Scene::Region d_region;
+    Image d_pixels;
+
+    public:
+        // pixels must be RGB32F and cover region of a width x height image
+        // @throws std::invalid_argument otherwise
+        TileFile(uint64_t sceneHash, Texture::Filter filter, unsigned width, unsigned height,
+                 Scene::Region const &region, Image pixels);
+
+        uint64_t sceneHash() const;
+        Texture::Filter textureFilter() const;
+        unsigned width() const;
+        unsigned height() const;
+        Scene::Region const &region() const;
+        Image const &pixels() const;
+
+        // region of img, which must be width() x height()
+        void copyTo(Image &img) const;
+
+        // @throws std::runtime_error if the file cannot be written or read,
+        // or is not a tile file
+        void write(std::string const &filename) const;
+        static TileFile read(std::string const &filename);
+
+        // The same for the contents of a file (e.g. sent over a socket),
+        // name is used in the messages of the exceptions
+        void write(std::ostream &out) const;
+        static TileFile read(std::istream &in, std::string const &name);
+
+        // number of bytes write produces for a tile of region
+        static uint64_t size(Scene::Region const &region);
+};
+
+#endif
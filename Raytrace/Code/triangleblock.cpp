@@ -0,0 +1,244 @@
+#include "triangleblock.h"
+#include "cpu.h"
+#include "stats.h"
+
+
+// The kernels work on doubles, single precision builds use the scalar code
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(RAY_SINGLE_PRECISION)
+#include <immintrin.h>
+#define SIMD_KERNELS
+#endif
+
+using namespace std;
+
+#define EPSILON (1e-6)
+
+TriangleBlock::TriangleBlock()
+:
+    v3x(), v3y(), v3z(),
+    e1x(), e1y(), e1z(),
+    e2x(), e2y(), e2z(),
+    tri(),
+    size(0)
+{}
+
+void TriangleBlock::add(unsigned idx, Point const &v1, Point const &v2, Point const &v3)
+{
+    Vector edge1 = v1 - v3;
+    Vector edge2 = v2 - v3;
+    v3x[size] = v3.x;
+    v3y[size] = v3.y;
+    v3z[size] = v3.z;
+    e1x[size] = edge1.x;
+    e1y[size] = edge1.y;
+    e1z[size] = edge1.z;
+    e2x[size] = edge2.x;
+    e2y[size] = edge2.y;
+    e2z[size] = edge2.z;
+    tri[size] = idx;
+    ++size;
+}
+
+// The kernels perform the same floating point operations in the same order
+// as Triangle::intersect. A lane counts as hit when Triangle::intersect
+// would have returned a hit with t >= EPSILON. AVX is chosen at run time
+// when the CPU has it; SSE2 is part of the x86-64 baseline, the scalar
+// version is only used on other architectures.
+
+#if !defined(SIMD_KERNELS) || !defined(__SSE2__)
+
+static unsigned intersectLanesScalar(TriangleBlock const &block, Ray const &ray, Real t[], Real u[], Real v[])
+{
+    unsigned mask = 0;
+    for (unsigned lane = 0; lane != block.size; ++lane)
+    {
+        Vector edge1(block.e1x[lane], block.e1y[lane], block.e1z[lane]);
+        Vector edge2(block.e2x[lane], block.e2y[lane], block.e2z[lane]);
+
+        Vector h = ray.D.cross(edge2);
+        Real a = edge1.dot(h);
+        if(-EPSILON < a && a < EPSILON)
+            continue;
+        Real f = 1 / a;
+        Vector s = ray.O - Point(block.v3x[lane], block.v3y[lane], block.v3z[lane]);
+        u[lane] = f * (s.dot(h));
+        if(u[lane] < 0.0 - EPSILON || u[lane] > 1.0 + EPSILON)
+            continue;
+        Vector q = s.cross(edge1);
+        v[lane] = f * ray.D.dot(q);
+        if(v[lane] < 0.0 - EPSILON || (u[lane] + v[lane]) > 1.0 + EPSILON)
+            continue;
+        t[lane] = f * edge2.dot(q);
+        if (t[lane] >= EPSILON)
+            mask |= 1U << lane;
+    }
+    return mask;
+}
+
+#endif
+
+#ifdef SIMD_KERNELS
+
+__attribute__((target("avx")))
+static unsigned intersectLanesAVX(TriangleBlock const &block, Ray const &ray, Real t[], Real u[], Real v[])
+{
+    __m256d const one = _mm256_set1_pd(1.0);
+    __m256d const eps = _mm256_set1_pd(EPSILON);
+    __m256d const minusEps = _mm256_set1_pd(0.0 - EPSILON);
+    __m256d const onePlusEps = _mm256_set1_pd(1.0 + EPSILON);
+    __m256d const dx = _mm256_set1_pd(ray.D.x);
+    __m256d const dy = _mm256_set1_pd(ray.D.y);
+    __m256d const dz = _mm256_set1_pd(ray.D.z);
+
+    __m256d e1x = _mm256_loadu_pd(block.e1x);
+    __m256d e1y = _mm256_loadu_pd(block.e1y);
+    __m256d e1z = _mm256_loadu_pd(block.e1z);
+    __m256d e2x = _mm256_loadu_pd(block.e2x);
+    __m256d e2y = _mm256_loadu_pd(block.e2y);
+    __m256d e2z = _mm256_loadu_pd(block.e2z);
+
+    __m256d hx = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+    __m256d hy = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+    __m256d hz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+    __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, hx), _mm256_mul_pd(e1y, hy)), _mm256_mul_pd(e1z, hz));
+    __m256d miss = _mm256_and_pd(_mm256_cmp_pd(minusEps, a, _CMP_LT_OQ), _mm256_cmp_pd(a, eps, _CMP_LT_OQ));
+    if (_mm256_movemask_pd(miss) == 0xF)
+        return 0;
+
+    __m256d f = _mm256_div_pd(one, a);
+    __m256d sx = _mm256_sub_pd(_mm256_set1_pd(ray.O.x), _mm256_loadu_pd(block.v3x));
+    __m256d sy = _mm256_sub_pd(_mm256_set1_pd(ray.O.y), _mm256_loadu_pd(block.v3y));
+    __m256d sz = _mm256_sub_pd(_mm256_set1_pd(ray.O.z), _mm256_loadu_pd(block.v3z));
+    __m256d bu = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, hx), _mm256_mul_pd(sy, hy)), _mm256_mul_pd(sz, hz)));
+    miss = _mm256_or_pd(miss, _mm256_cmp_pd(bu, minusEps, _CMP_LT_OQ));
+    miss = _mm256_or_pd(miss, _mm256_cmp_pd(bu, onePlusEps, _CMP_GT_OQ));
+    if (_mm256_movemask_pd(miss) == 0xF)
+        return 0;
+
+    __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+    __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+    __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+    __m256d bv = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz)));
+    miss = _mm256_or_pd(miss, _mm256_cmp_pd(bv, minusEps, _CMP_LT_OQ));
+    miss = _mm256_or_pd(miss, _mm256_cmp_pd(_mm256_add_pd(bu, bv), onePlusEps, _CMP_GT_OQ));
+
+    __m256d bt = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz)));
+    miss = _mm256_or_pd(miss, _mm256_cmp_pd(bt, eps, _CMP_NGE_UQ));
+
+    _mm256_storeu_pd(t, bt);
+    _mm256_storeu_pd(u, bu);
+    _mm256_storeu_pd(v, bv);
+    return ~_mm256_movemask_pd(miss) & ((1U << block.size) - 1);
+}
+
+#endif
+
+#if defined(SIMD_KERNELS) && defined(__SSE2__)
+
+static unsigned intersectLanesSSE2(TriangleBlock const &block, Ray const &ray, Real t[], Real u[], Real v[])
+{
+    __m128d const one = _mm_set1_pd(1.0);
+    __m128d const eps = _mm_set1_pd(EPSILON);
+    __m128d const minusEps = _mm_set1_pd(0.0 - EPSILON);
+    __m128d const onePlusEps = _mm_set1_pd(1.0 + EPSILON);
+    __m128d const dx = _mm_set1_pd(ray.D.x);
+    __m128d const dy = _mm_set1_pd(ray.D.y);
+    __m128d const dz = _mm_set1_pd(ray.D.z);
+
+    unsigned mask = 0;
+    for (unsigned lane = 0; lane < block.size; lane += 2)
+    {
+        __m128d e1x = _mm_loadu_pd(block.e1x + lane);
+        __m128d e1y = _mm_loadu_pd(block.e1y + lane);
+        __m128d e1z = _mm_loadu_pd(block.e1z + lane);
+        __m128d e2x = _mm_loadu_pd(block.e2x + lane);
+        __m128d e2y = _mm_loadu_pd(block.e2y + lane);
+        __m128d e2z = _mm_loadu_pd(block.e2z + lane);
+
+        __m128d hx = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+        __m128d hy = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+        __m128d hz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+        __m128d a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, hx), _mm_mul_pd(e1y, hy)), _mm_mul_pd(e1z, hz));
+        __m128d miss = _mm_and_pd(_mm_cmplt_pd(minusEps, a), _mm_cmplt_pd(a, eps));
+        if (_mm_movemask_pd(miss) == 0x3)
+            continue;
+
+        __m128d f = _mm_div_pd(one, a);
+        __m128d sx = _mm_sub_pd(_mm_set1_pd(ray.O.x), _mm_loadu_pd(block.v3x + lane));
+        __m128d sy = _mm_sub_pd(_mm_set1_pd(ray.O.y), _mm_loadu_pd(block.v3y + lane));
+        __m128d sz = _mm_sub_pd(_mm_set1_pd(ray.O.z), _mm_loadu_pd(block.v3z + lane));
+        __m128d bu = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(sx, hx), _mm_mul_pd(sy, hy)), _mm_mul_pd(sz, hz)));
+        miss = _mm_or_pd(miss, _mm_cmplt_pd(bu, minusEps));
+        miss = _mm_or_pd(miss, _mm_cmpgt_pd(bu, onePlusEps));
+        if (_mm_movemask_pd(miss) == 0x3)
+            continue;
+
+        __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, e1z), _mm_mul_pd(sz, e1y));
+        __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, e1x), _mm_mul_pd(sx, e1z));
+        __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, e1y), _mm_mul_pd(sy, e1x));
+        __m128d bv = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)), _mm_mul_pd(dz, qz)));
+        miss = _mm_or_pd(miss, _mm_cmplt_pd(bv, minusEps));
+        miss = _mm_or_pd(miss, _mm_cmpgt_pd(_mm_add_pd(bu, bv), onePlusEps));
+
+        __m128d bt = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_mul_pd(e2y, qy)), _mm_mul_pd(e2z, qz)));
+        miss = _mm_or_pd(miss, _mm_cmpnge_pd(bt, eps));
+
+        _mm_storeu_pd(t + lane, bt);
+        _mm_storeu_pd(u + lane, bu);
+        _mm_storeu_pd(v + lane, bv);
+        mask |= (~_mm_movemask_pd(miss) & 0x3) << lane;
+    }
+    return mask & ((1U << block.size) - 1);
+}
+
+#endif
+
+unsigned TriangleBlock::intersectLanes(Ray const &ray, Real t[], Real u[], Real v[]) const
+{
+    localStats.triangleTests += size;
+#ifdef SIMD_KERNELS
+    if (cpu::hasAVX())
+        return intersectLanesAVX(*this, ray, t, u, v);
+#endif
+#if defined(SIMD_KERNELS) && defined(__SSE2__)
+    return intersectLanesSSE2(*this, ray, t, u, v);
+#else
+    return intersectLanesScalar(*this, ray, t, u, v);
+#endif
+}
+
+unsigned TriangleBlock::intersect(Ray const &ray, Real &t, Real &u, Real &v) const
+{
+    Real laneT[WIDTH];
+    Real laneU[WIDTH];
+    Real laneV[WIDTH];
+    unsigned mask = intersectLanes(ray, laneT, laneU, laneV);
+
+    unsigned closest = WIDTH;
+    for (; mask != 0; mask &= mask - 1)
+    {
+        unsigned lane = __builtin_ctz(mask);
+        if (closest == WIDTH || laneT[lane] < laneT[closest]
+            || (laneT[lane] == laneT[closest] && tri[lane] < tri[closest]))
+            closest = lane;
+    }
+
+    if (closest != WIDTH)
+    {
+        t = laneT[closest];
+        u = laneU[closest];
+        v = laneV[closest];
+    }
+    return closest;
+}
+
+bool TriangleBlock::occluded(Ray const &ray, Real tMax) const
+{
+    Real t[WIDTH];
+    Real u[WIDTH];
+    Real v[WIDTH];
+    for (unsigned mask = intersectLanes(ray, t, u, v); mask != 0; mask &= mask - 1)
+        if (t[__builtin_ctz(mask)] < tMax)
+            return true;
+    return false;
+}
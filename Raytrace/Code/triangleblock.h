@@ -0,0 +1,51 @@
+#ifndef TRIANGLEBLOCK_H_
+#define TRIANGLEBLOCK_H_
+
+#include "ray.h"
+#include "triple.h"
+
+// Up to WIDTH triangles prepared for intersection with SIMD instructions.
+//
+// For each triangle the corner v3 and the edges v1 - v3 and v2 - v3 used by
+// the Möller–Trumbore test are computed once and stored per component
+// (structure of arrays), so one instruction handles all triangles of the
+// block. Unused lanes hold degenerate triangles which are never hit.
+//
+// Results are exactly those of Triangle::intersect for each triangle.
+class TriangleBlock
+{
+    public:
+        enum : unsigned { WIDTH = 4 };
+
+        Real v3x[WIDTH];
+        Real v3y[WIDTH];
+        Real v3z[WIDTH];
+        Real e1x[WIDTH];
+        Real e1y[WIDTH];
+        Real e1z[WIDTH];
+        Real e2x[WIDTH];
+        Real e2y[WIDTH];
+        Real e2z[WIDTH];
+        unsigned tri[WIDTH];        // index of the triangle in its mesh
+        unsigned size;
+
+        TriangleBlock();
+
+        void add(unsigned idx, Point const &v1, Point const &v2, Point const &v3);
+
+        // Finds the closest triangle of the block hit by the ray (on equal
+        // distance the one with the lowest index). Returns its lane and sets
+        // the distance t and barycentric coordinates u (of v1) and v (of
+        // v2), or returns WIDTH if no triangle is hit.
+        unsigned intersect(Ray const &ray, Real &t, Real &u, Real &v) const;
+
+        // true if any triangle of the block is hit before distance tMax
+        bool occluded(Ray const &ray, Real tMax) const;
+
+    private:
+        // Per lane distance and barycentric coordinates, returns the mask
+        // of lanes hit
+        unsigned intersectLanes(Ray const &ray, Real t[], Real u[], Real v[]) const;
+};
+
+#endif
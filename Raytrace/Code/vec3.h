@@ -0,0 +1,313 @@
+#ifndef VEC3_H_
+#define VEC3_H_
+
+#include "json/json_fwd.h"
+
+#include <cmath>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// Storage of Vec3<T>: three components, float is padded to a full SSE
+// register (the fourth lane is kept zero)
+template <typename T>
+struct Vec3Layout
+{
+    enum : unsigned { LANES = 3, ALIGN = alignof(T) };
+};
+
+#ifdef __SSE__
+template <>
+struct Vec3Layout<float>
+{
+    enum : unsigned { LANES = 4, ALIGN = 16 };
+};
+#endif
+
+// Three component vector of T, used for points, vectors and colors (see
+// triple.h). All operators are defined inline in this header; Vec3<float>
+// performs the component wise operations with SSE instructions.
+template <typename T>
+class alignas(Vec3Layout<T>::ALIGN) Vec3
+{
+    public:
+// --- data members ------------------------------------------------------------
+
+        // union to acces the same elements by
+        // x, y, z, or r, g, b or data[index]
+        union {
+            T data[Vec3Layout<T>::LANES];
+            struct {
+                T x;
+                T y;
+                T z;
+            };
+            struct {
+                T r;
+                T g;
+                T b;
+            };
+        };
+
+// --- Constructors ------------------------------------------------------------
+
+        explicit Vec3(T X = 0, T Y = 0, T Z = 0)
+        {
+            data[0] = X;
+            data[1] = Y;
+            data[2] = Z;
+            for (unsigned idx = 3; idx < Vec3Layout<T>::LANES; ++idx)
+                data[idx] = 0;
+        }
+
+        explicit Vec3(nlohmann::json const &node);      // json -> Vec3
+
+// --- Operators ---------------------------------------------------------------
+
+        Vec3 operator+(Vec3 const &t) const     // add two triples
+        {
+            return Vec3(x + t.x, y + t.y, z + t.z);
+        }
+
+        Vec3 operator+(T f) const               // add a value to each member
+        {                                       // of a triple
+            return Vec3(x + f, y + f, z + f);
+        }
+
+        Vec3 operator-() const                  // negate
+        {
+            return Vec3(-x, -y, -z);
+        }
+
+        Vec3 operator-(Vec3 const &t) const     // subtract two triples
+        {
+            return Vec3(x - t.x, y - t.y, z - t.z);
+        }
+
+        Vec3 operator-(T f) const               // subtract a value from each
+        {                                       // member
+            return Vec3(x - f, y - f, z - f);
+        }
+
+        Vec3 operator*(Vec3 const &t) const     // memberwise multiplication
+        {
+            return Vec3(x * t.x, y * t.y, z * t.z);
+        }
+
+        Vec3 operator*(T f) const               // multiply each member with a
+        {                                       // value
+            return Vec3(x * f, y * f, z * f);
+        }
+
+        Vec3 operator/(T f) const               // divide each member by a value
+        {
+            T invf = 1.0 / f;
+            return Vec3(x * invf, y * invf, z * invf);
+        }
+
+// --- Compound operators ------------------------------------------------------
+
+        Vec3 &operator+=(Vec3 const &t)
+        {
+            return *this = *this + t;
+        }
+
+        Vec3 &operator+=(T f)
+        {
+            return *this = *this + f;
+        }
+
+        Vec3 &operator-=(Vec3 const &t)
+        {
+            return *this = *this - t;
+        }
+
+        Vec3 &operator-=(T f)
+        {
+            return *this = *this - f;
+        }
+
+        Vec3 &operator*=(T f)
+        {
+            return *this = *this * f;
+        }
+
+        Vec3 &operator/=(T f)
+        {
+            return *this = *this / f;
+        }
+
+// --- Vector Operators --------------------------------------------------------
+
+        T dot(Vec3 const &t) const              // dot product
+        {
+            return x * t.x + y * t.y + z * t.z;
+        }
+
+        Vec3 cross(Vec3 const &t) const         // cross product
+        {
+            return Vec3(y*t.z - z*t.y,
+                        z*t.x - x*t.z,
+                        x*t.y - y*t.x);
+        }
+
+        T length() const
+        {
+            return std::sqrt(length_2());
+        }
+
+        T length_2() const                      // length squared
+        {
+            return x * x + y * y + z * z;
+        }
+
+        // NOTE: normalized return a COPY, normalize does NOT
+        Vec3 normalized() const                 // normalized COPY
+        {
+            return (*this) / length();
+        }
+
+        void normalize()                        // normalize THIS
+        {
+            T len = length();
+            T invlen = 1.0 / len;
+            *this *= invlen;
+        }
+
+// --- Color functions ---------------------------------------------------------
+
+        void set(T f)                           // set all values to f
+        {
+            set(f, f, f);
+        }
+
+        void set(T f, T maxValue)               // set all values to f / maxVal
+        {
+            set(f / maxValue);
+        }
+
+        void set(T red, T green, T blue)
+        {
+            r = red;
+            g = green;
+            b = blue;
+        }
+
+        void set(T red, T green, T blue, T maxValue)
+        {
+            set(red / maxValue, green / maxValue, blue / maxValue);
+        }
+
+        void clamp(T maxValue = 1.0)            // clamp: fmin(val, maxValue)
+        {
+            r = std::fmin(r, maxValue);
+            g = std::fmin(g, maxValue);
+            b = std::fmin(b, maxValue);
+        }
+
+// --- Free Operators ----------------------------------------------------------
+
+        // Defined as friends so the scalar converts to T, e.g. 2 * v
+        friend Vec3 operator+(T f, Vec3 const &t)
+        {
+            return Vec3(f + t.x, f + t.y, f + t.z);
+        }
+
+        friend Vec3 operator-(T f, Vec3 const &t)
+        {
+            return Vec3(f - t.x, f - t.y, f - t.z);
+        }
+
+        friend Vec3 operator*(T f, Vec3 const &t)
+        {
+            return Vec3(f * t.x, f * t.y, f * t.z);
+        }
+};
+
+#ifdef __SSE__
+
+// --- SSE versions for float --------------------------------------------------
+
+// Each lane performs the same operation as the generic version, so the
+// results are identical. Lane 3 stays zero: all of these map 0 to 0.
+
+inline __m128 lanes(Vec3<float> const &t)
+{
+    return _mm_load_ps(t.data);
+}
+
+inline Vec3<float> fromLanes(__m128 m)
+{
+    Vec3<float> res;
+    _mm_store_ps(res.data, m);
+    return res;
+}
+
+template <>
+inline Vec3<float> Vec3<float>::operator+(Vec3<float> const &t) const
+{
+    return fromLanes(_mm_add_ps(lanes(*this), lanes(t)));
+}
+
+template <>
+inline Vec3<float> Vec3<float>::operator-() const
+{
+    return fromLanes(_mm_xor_ps(lanes(*this), _mm_set1_ps(-0.0f)));
+}
+
+template <>
+inline Vec3<float> Vec3<float>::operator-(Vec3<float> const &t) const
+{
+    return fromLanes(_mm_sub_ps(lanes(*this), lanes(t)));
+}
+
+template <>
+inline Vec3<float> Vec3<float>::operator*(Vec3<float> const &t) const
+{
+    return fromLanes(_mm_mul_ps(lanes(*this), lanes(t)));
+}
+
+template <>
+inline Vec3<float> Vec3<float>::operator*(float f) const
+{
+    return fromLanes(_mm_mul_ps(lanes(*this), _mm_set1_ps(f)));
+}
+
+template <>
+inline Vec3<float> Vec3<float>::operator/(float f) const
+{
+    float invf = 1.0 / f;
+    return fromLanes(_mm_mul_ps(lanes(*this), _mm_set1_ps(invf)));
+}
+
+template <>
+inline float Vec3<float>::dot(Vec3<float> const &t) const
+{
+    // multiply in parallel, sum in the order of the generic version
+    Vec3<float> prod = *this * t;
+    return prod.x + prod.y + prod.z;
+}
+
+template <>
+inline float Vec3<float>::length_2() const
+{
+    return dot(*this);
+}
+
+template <>
+inline Vec3<float> Vec3<float>::cross(Vec3<float> const &t) const
+{
+    // (y, z, x) * (t.z, t.x, t.y) - (z, x, y) * (t.y, t.z, t.x)
+    __m128 a = lanes(*this);
+    __m128 b = lanes(t);
+    __m128 aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 aZXY = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bZXY = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+    return fromLanes(_mm_sub_ps(_mm_mul_ps(aYZX, bZXY), _mm_mul_ps(aZXY, bYZX)));
+}
+
+#endif
+
+#endif
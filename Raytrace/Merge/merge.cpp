@@ -0,0 +1,140 @@
+// ray_merge: joins the tiles written by ray --region or --tile into the
+// image. All tiles must be of the same scene file (and texture filter and
+// image size), together they must cover every pixel of the image once;
+// pixels covered by more than one tile must be the same in each of them.
+
+#include "hash.h"
+#include "image.h"
+#include "imagewriter.h"
+#include "mappedfile.h"
+#include "tilefile.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    void usage(char const *program)
+    {
+        cerr << "Usage: " << program << " [options] out-file tile...\n"
+             << "Options:\n"
+             << "  --scene FILE      check that the tiles are renders of this scene file\n"
+             << "  --format F        write the image as png, ppm or pfm (default: by the\n"
+             << "                    extension of out-file, png)\n"
+             << "  --compression N   PNG compression level, 0 (fastest) to 9 (default: 6)\n";
+    }
+
+    // @throws std::runtime_error if tile does not belong to the image of first
+    void checkConsistent(TileFile const &first, TileFile const &tile, string const &name)
+    {
+        if (tile.sceneHash() != first.sceneHash())
+            throw runtime_error(name + " is a tile of another scene");
+        if (tile.width() != first.width() || tile.height() != first.height())
+            throw runtime_error(name + " is a tile of an image of another size");
+        if (tile.textureFilter() != first.textureFilter())
+            throw runtime_error(name + " was rendered with another texture filter");
+    }
+
+    // Copies the pixels of tile into img, marking them in covered
+    // @throws std::runtime_error if a pixel covered before differs
+    void place(TileFile const &tile, string const &name, Image &img, vector<bool> &covered)
+    {
+        Scene::Region const &rect = tile.region();
+        Image::RGB32F const *src = tile.pixels().pixels<Image::RGB32F>();
+        Image::RGB32F *dst = img.pixels<Image::RGB32F>();
+        for (unsigned y = rect.y0; y != rect.y1; ++y)
+            for (unsigned x = rect.x0; x != rect.x1; ++x, ++src)
+            {
+                size_t idx = static_cast<size_t>(y) * img.width() + x;
+                if (covered[idx] && memcmp(&dst[idx], src, sizeof(*src)) != 0)
+                    throw runtime_error(name + " differs from another tile in pixel "
+                                        + to_string(x) + ',' + to_string(y));
+                dst[idx] = *src;
+                covered[idx] = true;
+            }
+    }
+}
+
+int main(int argc, char *argv[])
+try
+{
+    string sceneFile;
+    ImageWriter writer;
+    vector<string> files;
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        string arg = argv[idx];
+        if (arg == "--scene" && idx + 1 < argc)
+            sceneFile = argv[++idx];
+        else if (arg == "--format" && idx + 1 < argc
+                 && (argv[idx + 1] == string("png") || argv[idx + 1] == string("ppm")
+                     || argv[idx + 1] == string("pfm")))
+            writer.format(ImageWriter::parseFormat(argv[++idx]));
+        else if (arg == "--compression" && idx + 1 < argc)
+            writer.compression(max(0, stoi(argv[++idx])));
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            files.push_back(arg);
+    }
+    if (files.size() < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    string const &ofname = files[0];
+    TileFile first = TileFile::read(files[1]);
+    if (!sceneFile.empty())
+    {
+        MappedFile scene;
+        if (!scene.open(sceneFile))
+            throw runtime_error("Could not open " + sceneFile);
+        if (contentHash(scene.begin(), scene.end()) != first.sceneHash())
+            throw runtime_error("The tiles are not renders of " + sceneFile);
+    }
+
+    Image img(first.width(), first.height());
+    vector<bool> covered(img.size());
+    place(first, files[1], img, covered);
+    for (size_t idx = 2; idx != files.size(); ++idx)
+    {
+        TileFile tile = TileFile::read(files[idx]);
+        checkConsistent(first, tile, files[idx]);
+        place(tile, files[idx], img, covered);
+    }
+
+    size_t missing = 0;
+    size_t firstMissing = 0;
+    for (size_t idx = covered.size(); idx-- != 0; )
+        if (!covered[idx])
+        {
+            ++missing;
+            firstMissing = idx;
+        }
+    if (missing != 0)
+        throw runtime_error(to_string(missing) + " pixels are not covered by any tile, the first is "
+                            + to_string(firstMissing % img.width()) + ','
+                            + to_string(firstMissing / img.width()));
+
+    cout << "Writing " << img.width() << 'x' << img.height() << " image of "
+         << files.size() - 1 << " tiles to " << ofname << "...\n";
+    writer.write(img, ofname);
+    return 0;
+}
+catch (exception const &ex)
+{
+    cerr << "Error: " << ex.what() << '\n';
+    return 1;
+}